@@ -0,0 +1,295 @@
+/*	$OpenBSD$	*/
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A minimal SMTP server that accepts everything, used to check what the
+ * MTA puts on the wire.  Readiness and each message are reported on
+ * stdout, and messages can be saved in a directory to be compared with
+ * the original.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define SINK_LINE_MAX	4096
+
+static void usage(void);
+static void session(int);
+static void reply(FILE *, const char *);
+static FILE *message_open(void);
+static void message_close(FILE *, size_t, size_t, const char *, size_t);
+
+static int	 chunking = 1;
+static int	 pipelining = 1;
+static int	 verbose = 0;
+static char	*dir = NULL;
+static size_t	 msgcount = 0;
+
+static void
+usage(void)
+{
+	extern const char *__progname;
+
+	fprintf(stderr, "usage: %s [-CPv] [-d dir] [-p port]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in	 sin;
+	const char		*errstr;
+	int			 ch, sock, fd, port, opt;
+
+	port = 2525;
+
+	while ((ch = getopt(argc, argv, "CPd:p:v")) != -1) {
+		switch (ch) {
+		case 'C':
+			chunking = 0;
+			break;
+		case 'P':
+			pipelining = 0;
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'p':
+			port = strtonum(optarg, 1, 65535, &errstr);
+			if (errstr)
+				errx(1, "port is %s: %s", errstr, optarg);
+			break;
+		case 'v':
+			verbose += 1;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage();
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	opt = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) == -1)
+		err(1, "setsockopt");
+
+	bzero(&sin, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *)&sin, sizeof sin) == -1)
+		err(1, "bind");
+	if (listen(sock, 5) == -1)
+		err(1, "listen");
+
+	/* tell the caller it may connect */
+	printf("listening on port %d\n", port);
+	fflush(stdout);
+
+	for (;;) {
+		if ((fd = accept(sock, NULL, NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "accept");
+		}
+		session(fd);
+	}
+
+	return (0);
+}
+
+static void
+session(int fd)
+{
+	FILE		*in, *out, *msg;
+	char		 line[SINK_LINE_MAX], *arg, *ep;
+	size_t		 len, size, nrcpt, nchunk, n;
+	unsigned long long	 chunk, left;
+	int		 last;
+
+	if ((in = fdopen(fd, "r")) == NULL)
+		err(1, "fdopen");
+	if ((out = fdopen(dup(fd), "w")) == NULL)
+		err(1, "fdopen");
+
+	msg = NULL;
+	size = nrcpt = nchunk = 0;
+
+	reply(out, "220 smtpsink ready");
+
+	while (fgets(line, sizeof line, in)) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (verbose)
+			fprintf(stderr, "<<< %s\n", line);
+
+		if (strncasecmp(line, "EHLO ", 5) == 0) {
+			reply(out, "250-smtpsink");
+			if (pipelining)
+				reply(out, "250-PIPELINING");
+			if (chunking)
+				reply(out, "250-CHUNKING");
+			reply(out, "250 8BITMIME");
+		}
+		else if (strncasecmp(line, "HELO ", 5) == 0)
+			reply(out, "250 smtpsink");
+		else if (strncasecmp(line, "MAIL FROM:", 10) == 0) {
+			if (msg)
+				message_close(msg, 0, 0, NULL, 0);
+			msg = message_open();
+			size = nrcpt = nchunk = 0;
+			reply(out, "250 Ok");
+		}
+		else if (strncasecmp(line, "RCPT TO:", 8) == 0) {
+			if (msg == NULL) {
+				reply(out, "503 Need MAIL first");
+				continue;
+			}
+			nrcpt++;
+			reply(out, "250 Ok");
+		}
+		else if (strcasecmp(line, "DATA") == 0) {
+			if (msg == NULL || nrcpt == 0) {
+				reply(out, "503 Need RCPT first");
+				continue;
+			}
+			reply(out, "354 Go ahead");
+			while (fgets(line, sizeof line, in)) {
+				len = strcspn(line, "\r\n");
+				if (len == 1 && line[0] == '.')
+					break;
+				arg = (line[0] == '.') ? line + 1 : line;
+				fputs(arg, msg);
+				size += strlen(arg);
+			}
+			message_close(msg, size, nrcpt, "DATA", 0);
+			msg = NULL;
+			reply(out, "250 Ok");
+		}
+		else if (strncasecmp(line, "BDAT ", 5) == 0) {
+			errno = 0;
+			chunk = strtoull(line + 5, &ep, 10);
+			if (ep == line + 5 || errno == ERANGE) {
+				reply(out, "501 Bad chunk size");
+				continue;
+			}
+			last = (strcasecmp(ep, " LAST") == 0);
+
+			/* read the chunk even if it gets rejected */
+			for (left = chunk; left; left -= n) {
+				n = left < sizeof line ? left : sizeof line;
+				if ((n = fread(line, 1, n, in)) == 0)
+					goto done;
+				if (msg)
+					fwrite(line, 1, n, msg);
+			}
+
+			if (msg == NULL || nrcpt == 0) {
+				reply(out, "503 Need RCPT first");
+				continue;
+			}
+			size += chunk;
+			nchunk++;
+			if (last) {
+				message_close(msg, size, nrcpt, "BDAT", nchunk);
+				msg = NULL;
+			}
+			reply(out, "250 Ok");
+		}
+		else if (strcasecmp(line, "RSET") == 0) {
+			if (msg)
+				message_close(msg, 0, 0, NULL, 0);
+			msg = NULL;
+			reply(out, "250 Ok");
+		}
+		else if (strcasecmp(line, "NOOP") == 0)
+			reply(out, "250 Ok");
+		else if (strcasecmp(line, "QUIT") == 0) {
+			reply(out, "221 Bye");
+			break;
+		}
+		else
+			reply(out, "500 Command unrecognized");
+	}
+
+    done:
+	if (msg)
+		message_close(msg, 0, 0, NULL, 0);
+	fclose(in);
+	fclose(out);
+}
+
+static void
+reply(FILE *out, const char *line)
+{
+	if (verbose)
+		fprintf(stderr, ">>> %s\n", line);
+	fprintf(out, "%s\r\n", line);
+	fflush(out);
+}
+
+static FILE *
+message_open(void)
+{
+	char	path[PATH_MAX];
+	FILE	*fp;
+
+	if (dir == NULL)
+		return (fopen("/dev/null", "w"));
+
+	snprintf(path, sizeof path, "%s/%zu.eml", dir, msgcount + 1);
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "fopen: %s", path);
+
+	return (fp);
+}
+
+static void
+message_close(FILE *fp, size_t size, size_t nrcpt, const char *method,
+    size_t nchunk)
+{
+	fclose(fp);
+
+	/* aborted transaction */
+	if (method == NULL)
+		return;
+
+	msgcount++;
+	if (nchunk)
+		printf("message %zu: %zu bytes, %zu recipient%s, %s in %zu "
+		    "chunk%s\n", msgcount, size, nrcpt, nrcpt > 1 ? "s" : "",
+		    method, nchunk, nchunk > 1 ? "s" : "");
+	else
+		printf("message %zu: %zu bytes, %zu recipient%s, %s\n",
+		    msgcount, size, nrcpt, nrcpt > 1 ? "s" : "", method);
+	fflush(stdout);
+}
@@ -0,0 +1,198 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure the throughput, in MB/s on a single core, of the message body
+ * reception of smtpd.  A message of the given size is fed through an
+ * iobuf the way the smtp session does it, and written to a file with
+ * iobuf_getbody() on a 64KB buffer, and for comparison, with
+ * iobuf_getline() and one fprintf() per line on a 2KB buffer.  The two
+ * outputs must match.
+ *
+ * usage: bodybench [-l linelen] [-o file] [-s megabytes]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iobuf.h"
+
+#define	MAXLINESIZE	2048
+#define	BODY_BUFSIZE	65536
+
+static char	*msg;
+static size_t	 msglen;
+static FILE	*ofile;
+
+static void
+makemsg(size_t size, size_t linelen)
+{
+	size_t	 i, n;
+
+	if ((msg = malloc(size + linelen + 8)) == NULL)
+		err(1, "malloc");
+
+	for (n = 0, i = 0; i < size; n++) {
+		/* Some lines need dot-stuffing */
+		msg[i++] = (n % 50) ? 'a' + n % 26 : '.';
+		memset(msg + i, 'x', linelen - 1);
+		i += linelen - 1;
+		msg[i++] = '\r';
+		msg[i++] = '\n';
+	}
+	memcpy(msg + i, ".\r\n", 3);
+	msglen = i + 3;
+}
+
+/* Simulate a read(2) on the socket into the free space of the buffer. */
+static int
+fill(struct iobuf *io, size_t *off)
+{
+	size_t	 n;
+
+	iobuf_normalize(io);
+	n = iobuf_left(io);
+	if (n > msglen - *off)
+		n = msglen - *off;
+	if (n == 0)
+		return (0);
+	memcpy(io->buf + io->wpos, msg + *off, n);
+	io->wpos += n;
+	*off += n;
+
+	return (1);
+}
+
+static size_t
+run_lines(void)
+{
+	struct iobuf	 io;
+	char		*line;
+	size_t		 off = 0, len, datalen = 0;
+
+	if (iobuf_init(&io, MAXLINESIZE, MAXLINESIZE) == -1)
+		err(1, "iobuf_init");
+
+	while (fill(&io, &off)) {
+		while ((line = iobuf_getline(&io, &len))) {
+			if (!strcmp(line, "."))
+				goto done;
+			if (line[0] == '.') {
+				line += 1;
+				len -= 1;
+			}
+			if (fprintf(ofile, "%s\n", line) != (int)len + 1)
+				err(1, "fprintf");
+			datalen += len + 1;
+		}
+	}
+    done:
+	iobuf_clear(&io);
+	return (datalen);
+}
+
+static size_t
+run_body(void)
+{
+	struct iobuf	 io;
+	size_t		 off = 0, n, len, datalen = 0;
+	int		 ret = 0, flags;
+
+	if (iobuf_init(&io, BODY_BUFSIZE, BODY_BUFSIZE) == -1)
+		err(1, "iobuf_init");
+
+	while (ret == 0 && fill(&io, &off)) {
+		flags = 0;
+		ret = iobuf_getbody(&io, MAXLINESIZE, 0, &n, &len, &flags);
+		if (ret == -1)
+			errx(1, "line too long");
+		if (len && fwrite(iobuf_data(&io), 1, len, ofile) != len)
+			err(1, "fwrite");
+		datalen += len;
+		iobuf_drop(&io, n);
+	}
+
+	iobuf_clear(&io);
+	return (datalen);
+}
+
+static size_t
+bench(const char *name, size_t (*fn)(void))
+{
+	struct timeval	 t0, t1;
+	double		 secs;
+	size_t		 datalen;
+
+	rewind(ofile);
+	gettimeofday(&t0, NULL);
+	datalen = fn();
+	if (fflush(ofile) == EOF)
+		err(1, "fflush");
+	gettimeofday(&t1, NULL);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+	printf("%-6s %10zu bytes in %.3fs: %8.1f MB/s\n", name, datalen,
+	    secs, msglen / secs / (1024 * 1024));
+
+	return (datalen);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr, *path = "/dev/null";
+	size_t		 size = 256, linelen = 76;
+	int		 ch;
+
+	while ((ch = getopt(argc, argv, "l:o:s:")) != -1) {
+		switch (ch) {
+		case 'l':
+			linelen = strtonum(optarg, 1, MAXLINESIZE - 3, &errstr);
+			if (errstr)
+				errx(1, "line length is %s: %s", errstr, optarg);
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		case 's':
+			size = strtonum(optarg, 1, 4096, &errstr);
+			if (errstr)
+				errx(1, "size is %s: %s", errstr, optarg);
+			break;
+		default:
+			fprintf(stderr,
+			    "usage: bodybench [-l linelen] [-o file] [-s megabytes]\n");
+			exit(1);
+		}
+	}
+
+	if ((ofile = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+
+	makemsg(size * 1024 * 1024, linelen);
+
+	if (bench("lines", run_lines) != bench("body", run_body))
+		errx(1, "output length mismatch");
+
+	fclose(ofile);
+	free(msg);
+	return (0);
+}
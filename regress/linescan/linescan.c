@@ -0,0 +1,242 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check iobuf_getline() and iobuf_getlines() against a byte by byte
+ * reference on random buffers, or with -b, compare their speed.
+ *
+ * usage: linescan [-b] [-n iterations] [-s seed]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "iobuf.h"
+
+#define	BUFSIZE		4096
+#define	NLINES		64
+
+static uint64_t	 rstate;
+
+/*
+ * xorshift64*, so that a failure can be replayed with -s.
+ */
+static uint32_t
+rnd_uniform(uint32_t n)
+{
+	rstate ^= rstate >> 12;
+	rstate ^= rstate << 25;
+	rstate ^= rstate >> 27;
+	return ((rstate * 2685821657736338717ULL) >> 32) % n;
+}
+
+static size_t
+ref_getlines(const char *buf, size_t len, struct iobuf_line *lines, size_t n)
+{
+	size_t	 count, i, start;
+	int	 flags;
+
+	start = 0;
+	count = 0;
+	flags = 0;
+	for (i = 0; i < len && count < n; i++) {
+		if (buf[i] & 0x80)
+			flags |= IOBUF_LINE_8BIT;
+		if (buf[i] == '\r' && (i + 1 == len || buf[i + 1] != '\n'))
+			flags |= IOBUF_LINE_BARECR;
+		if (buf[i] != '\n')
+			continue;
+		lines[count].line = (char *)buf + start;
+		lines[count].size = i + 1 - start;
+		lines[count].len = i - start;
+		if (i > start && buf[i - 1] == '\r')
+			lines[count].len -= 1;
+		else
+			flags |= IOBUF_LINE_BARELF;
+		lines[count].flags = flags;
+		count++;
+		flags = 0;
+		start = i + 1;
+	}
+
+	return (count);
+}
+
+static void
+fill(struct iobuf *io, const char *data, size_t len)
+{
+	io->rpos = 0;
+	io->wpos = len;
+	memcpy(io->buf, data, len);
+}
+
+static void
+fuzz(int iterations)
+{
+	static const char	 alphabet[] = "\r\n\r\n.ab\x80\xff";
+	struct iobuf_line	 lines[NLINES], ref[NLINES];
+	struct iobuf		 io;
+	char			 data[BUFSIZE], *line;
+	size_t			 len, off, n, nref, i, rlen;
+	int			 it;
+
+	if (iobuf_init(&io, BUFSIZE, BUFSIZE) == -1)
+		err(1, "iobuf_init");
+
+	for (it = 0; it < iterations; it++) {
+		len = rnd_uniform(BUFSIZE);
+		for (i = 0; i < len; i++) {
+			if (rnd_uniform(4))
+				data[i] = 'a' + rnd_uniform(26);
+			else
+				data[i] = alphabet[rnd_uniform(
+				    sizeof(alphabet) - 1)];
+		}
+		off = len ? rnd_uniform(len) : 0;
+
+		fill(&io, data, len);
+		n = iobuf_getlines(&io, off, lines, NLINES);
+		nref = ref_getlines(io.buf + off, len - off, ref, NLINES);
+		if (n != nref)
+			errx(1, "iteration %d: %zu lines, expected %zu",
+			    it, n, nref);
+		for (i = 0; i < n; i++)
+			if (lines[i].line != ref[i].line ||
+			    lines[i].len != ref[i].len ||
+			    lines[i].size != ref[i].size ||
+			    lines[i].flags != ref[i].flags)
+				errx(1, "iteration %d: line %zu differs", it, i);
+		if (iobuf_len(&io) != len)
+			errx(1, "iteration %d: data consumed", it);
+
+		n = ref_getlines(io.buf, len, ref, NLINES);
+		for (i = 0; i < n; i++) {
+			line = iobuf_getline(&io, &rlen);
+			if (line != ref[i].line || rlen != ref[i].len)
+				errx(1, "iteration %d: getline %zu differs",
+				    it, i);
+		}
+		if (n < NLINES && iobuf_getline(&io, &rlen) != NULL)
+			errx(1, "iteration %d: extra line", it);
+	}
+
+	iobuf_clear(&io);
+}
+
+static double
+elapsed(struct timeval *t0)
+{
+	struct timeval	 t1;
+
+	gettimeofday(&t1, NULL);
+	return ((t1.tv_sec - t0->tv_sec) + (t1.tv_usec - t0->tv_usec) / 1e6);
+}
+
+static void
+bench(int iterations)
+{
+	struct iobuf_line	 lines[NLINES];
+	struct iobuf		 io;
+	struct timeval		 t0;
+	char			 data[BUFSIZE];
+	size_t			 i, n, off, total;
+	int			 it;
+
+	if (iobuf_init(&io, BUFSIZE, BUFSIZE) == -1)
+		err(1, "iobuf_init");
+
+	/* 76 character lines, as found in message bodies */
+	for (i = 0; i < BUFSIZE; i++)
+		data[i] = (i % 78 == 76) ? '\r' :
+		    (i % 78 == 77) ? '\n' : 'a' + i % 26;
+	fill(&io, data, BUFSIZE);
+
+	total = 0;
+	gettimeofday(&t0, NULL);
+	for (it = 0; it < iterations; it++) {
+		off = 0;
+		while ((n = ref_getlines(io.buf + off, BUFSIZE - off, lines,
+		    NLINES)))
+			for (i = 0; i < n; i++)
+				off += lines[i].size;
+		total += off;
+	}
+	printf("bytewise  %8.1f MB/s\n",
+	    total / elapsed(&t0) / (1024 * 1024));
+
+	total = 0;
+	gettimeofday(&t0, NULL);
+	for (it = 0; it < iterations; it++) {
+		off = 0;
+		while ((n = iobuf_getlines(&io, off, lines, NLINES)))
+			for (i = 0; i < n; i++)
+				off += lines[i].size;
+		total += off;
+	}
+	printf("getlines  %8.1f MB/s\n",
+	    total / elapsed(&t0) / (1024 * 1024));
+
+	iobuf_clear(&io);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	uint32_t	 seed;
+	int		 ch, bflag = 0, iterations = 100000;
+
+	seed = arc4random();
+	while ((ch = getopt(argc, argv, "bn:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bflag = 1;
+			break;
+		case 'n':
+			iterations = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr)
+				errx(1, "iterations is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			seed = strtonum(optarg, 0, UINT32_MAX, &errstr);
+			if (errstr)
+				errx(1, "seed is %s: %s", errstr, optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: linescan [-b] [-n iterations] "
+			    "[-s seed]\n");
+			exit(1);
+		}
+	}
+
+	/* a zero state would only produce zeroes */
+	rstate = (uint64_t)seed << 32 | 0x9e3779b9;
+
+	if (bflag)
+		bench(iterations);
+	else {
+		printf("seed %u\n", seed);
+		fuzz(iterations);
+	}
+
+	return (0);
+}
@@ -0,0 +1,186 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drive the ram queue backend: queue a few messages, remove one of
+ * them as a whole and check that the others are left untouched.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	NMSG	3
+#define	NEVP	2
+
+static int (*message_create)(uint32_t *);
+static int (*message_commit)(uint32_t, const char *);
+static int (*message_delete)(uint32_t);
+static int (*message_fd_r)(uint32_t);
+static int (*envelope_create)(uint32_t, const char *, size_t, uint64_t *);
+static int (*envelope_load)(uint64_t, char *, size_t);
+
+extern struct queue_backend	queue_backend_ram;
+
+static uint32_t	lastmsgid;
+static char	tmpdir[] = "/tmp/queueram.XXXXXXXXXX";
+
+void queue_api_on_message_create(int(*cb)(uint32_t *))
+{ message_create = cb; }
+void queue_api_on_message_commit(int(*cb)(uint32_t, const char*))
+{ message_commit = cb; }
+void queue_api_on_message_delete(int(*cb)(uint32_t))
+{ message_delete = cb; }
+void queue_api_on_message_fd_r(int(*cb)(uint32_t))
+{ message_fd_r = cb; }
+void queue_api_on_message_corrupt(int(*cb)(uint32_t))
+{ }
+void queue_api_on_envelope_create(int(*cb)(uint32_t, const char *, size_t,
+    uint64_t *))
+{ envelope_create = cb; }
+void queue_api_on_envelope_delete(int(*cb)(uint64_t))
+{ }
+void queue_api_on_envelope_update(int(*cb)(uint64_t, const char *, size_t))
+{ }
+void queue_api_on_envelope_load(int(*cb)(uint64_t, char *, size_t))
+{ envelope_load = cb; }
+void queue_api_on_envelope_walk(int(*cb)(uint64_t *, char *, size_t))
+{ }
+
+uint32_t
+queue_generate_msgid(void)
+{
+	return (++lastmsgid);
+}
+
+uint64_t
+queue_generate_evpid(uint32_t msgid)
+{
+	static uint32_t	n;
+
+	return ((uint64_t)msgid << 32 | ++n);
+}
+
+int
+mktmpfile(void)
+{
+	char	path[MAXPATHLEN];
+	int	fd;
+
+	(void)snprintf(path, sizeof path, "%s/tmp.XXXXXXXXXX", tmpdir);
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	unlink(path);
+	return (fd);
+}
+
+void stat_increment(const char *k, size_t v)
+{
+}
+
+void stat_decrement(const char *k, size_t v)
+{
+}
+
+static int
+has_message(uint32_t msgid, uint64_t *evpids)
+{
+	char	buf[64], expect[64];
+	int	fd, i, n;
+
+	if ((fd = message_fd_r(msgid)) == -1)
+		return (0);
+	n = read(fd, buf, sizeof buf);
+	close(fd);
+	(void)snprintf(expect, sizeof expect, "message %08" PRIx32 "\n",
+	    msgid);
+	if (n != (int)strlen(expect) || memcmp(buf, expect, n))
+		errx(1, "message %08" PRIx32 ": bad content", msgid);
+
+	for (i = 0; i < NEVP; i++) {
+		n = envelope_load(evpids[i], buf, sizeof buf);
+		(void)snprintf(expect, sizeof expect, "envelope %08" PRIx32
+		    " %d", msgid, i);
+		if (n != (int)strlen(expect) || memcmp(buf, expect, n))
+			errx(1, "envelope %016" PRIx64 ": bad content",
+			    evpids[i]);
+	}
+
+	return (1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char		 path[MAXPATHLEN], buf[64];
+	uint64_t	 evpids[NMSG][NEVP];
+	uint32_t	 msgids[NMSG];
+	FILE		*f;
+	int		 i, j;
+
+	log_init(1);
+
+	if (mkdtemp(tmpdir) == NULL)
+		err(1, "mkdtemp");
+	(void)snprintf(path, sizeof path, "%s/message", tmpdir);
+
+	if (!queue_backend_ram.init(NULL, 1))
+		errx(1, "init failed");
+
+	for (i = 0; i < NMSG; i++) {
+		if (!message_create(&msgids[i]))
+			errx(1, "message_create failed");
+		if ((f = fopen(path, "w")) == NULL)
+			err(1, "%s", path);
+		fprintf(f, "message %08" PRIx32 "\n", msgids[i]);
+		fclose(f);
+		if (!message_commit(msgids[i], path))
+			errx(1, "message_commit failed");
+		for (j = 0; j < NEVP; j++) {
+			(void)snprintf(buf, sizeof buf, "envelope %08" PRIx32
+			    " %d", msgids[i], j);
+			if (!envelope_create(msgids[i], buf, strlen(buf),
+			    &evpids[i][j]))
+				errx(1, "envelope_create failed");
+		}
+	}
+	unlink(path);
+
+	if (!message_delete(msgids[1]))
+		errx(1, "message_delete failed");
+
+	if (!has_message(msgids[0], evpids[0]) ||
+	    !has_message(msgids[2], evpids[2]))
+		errx(1, "removing a message dropped other messages");
+	if (has_message(msgids[1], evpids[1]))
+		errx(1, "removed message is still queued");
+
+	rmdir(tmpdir);
+	printf("ok\n");
+
+	return (0);
+}
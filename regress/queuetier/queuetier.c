@@ -0,0 +1,323 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Drive the tiered fs queue backend: queue a few messages with the
+ * journal enabled in a first process.  Restore them in a second one with
+ * a lower memory limit, queue a new message that makes the backend spill,
+ * and check that the envelope walk reports every restored envelope
+ * exactly once.  The first message must be spilled after the walk.
+ *
+ * The queue is created in a temporary directory the process chroots to,
+ * so this must be run as root.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+#define	NMSG	3
+#define	NEVP	2
+#define	BIGMSG	(64 * 1024)
+
+static int (*message_create)(uint32_t *);
+static int (*message_commit)(uint32_t, const char *);
+static int (*envelope_create)(uint32_t, const char *, size_t, uint64_t *);
+static int (*envelope_walk)(uint64_t *, char *, size_t);
+
+extern struct queue_backend	queue_backend_fs;
+extern struct tree		evpcount;
+
+static struct smtpd	smtpd;
+struct smtpd		*env = &smtpd;
+
+static uint32_t	lastmsgid;
+static char	tmpdir[] = "/tmp/queuetier.XXXXXXXXXX";
+
+void queue_api_on_message_create(int(*cb)(uint32_t *))
+{ message_create = cb; }
+void queue_api_on_message_commit(int(*cb)(uint32_t, const char*))
+{ message_commit = cb; }
+void queue_api_on_message_delete(int(*cb)(uint32_t))
+{ }
+void queue_api_on_message_fd_r(int(*cb)(uint32_t))
+{ }
+void queue_api_on_message_corrupt(int(*cb)(uint32_t))
+{ }
+void queue_api_on_envelope_create(int(*cb)(uint32_t, const char *, size_t,
+    uint64_t *))
+{ envelope_create = cb; }
+void queue_api_on_envelope_delete(int(*cb)(uint64_t))
+{ }
+void queue_api_on_envelope_update(int(*cb)(uint64_t, const char *, size_t))
+{ }
+void queue_api_on_envelope_load(int(*cb)(uint64_t, char *, size_t))
+{ }
+void queue_api_on_envelope_walk(int(*cb)(uint64_t *, char *, size_t))
+{ envelope_walk = cb; }
+
+uint32_t
+queue_generate_msgid(void)
+{
+	return (++lastmsgid << 24);
+}
+
+uint64_t
+queue_generate_evpid(uint32_t msgid)
+{
+	static uint32_t	n;
+
+	return ((uint64_t)msgid << 32 | ++n);
+}
+
+int
+bsnprintf(char *str, size_t size, const char *format, ...)
+{
+	va_list	ap;
+	int	ret;
+
+	va_start(ap, format);
+	ret = vsnprintf(str, size, format, ap);
+	va_end(ap);
+	return (ret != -1 && (size_t)ret < size);
+}
+
+int
+ckdir(const char *path, mode_t mode, uid_t owner, gid_t group, int create)
+{
+	return (1);
+}
+
+int
+mvpurge(char *from, char *to)
+{
+	return (1);
+}
+
+int
+rmtree(char *path, int keepdir)
+{
+	return (0);
+}
+
+int
+mktmpfile(void)
+{
+	return (-1);
+}
+
+void *
+xmalloc(size_t size, const char *where)
+{
+	void	*r;
+
+	if ((r = malloc(size)) == NULL)
+		err(1, "%s", where);
+	return (r);
+}
+
+void *
+xcalloc(size_t nmemb, size_t size, const char *where)
+{
+	void	*r;
+
+	if ((r = calloc(nmemb, size)) == NULL)
+		err(1, "%s", where);
+	return (r);
+}
+
+void *
+xmemdup(const void *ptr, size_t size, const char *where)
+{
+	return (memcpy(xmalloc(size, where), ptr, size));
+}
+
+void stat_increment(const char *k, size_t v)
+{
+}
+
+void stat_decrement(const char *k, size_t v)
+{
+}
+
+void stat_set(const char *k, const struct stat_value *v)
+{
+}
+
+struct stat_value *
+stat_counter(size_t v)
+{
+	return (NULL);
+}
+
+static uint32_t
+put_message(int size, int nevp)
+{
+	char		 buf[64];
+	uint64_t	 evpid;
+	uint32_t	 msgid;
+	FILE		*f;
+	int		 j;
+
+	if (!message_create(&msgid))
+		errx(1, "message_create failed");
+	if ((f = fopen("/message", "w")) == NULL)
+		err(1, "/message");
+	for (j = 0; j < size / 17; j++)
+		fprintf(f, "message %08" PRIx32 "\n", msgid);
+	fclose(f);
+	for (j = 0; j < nevp; j++) {
+		(void)snprintf(buf, sizeof buf, "envelope %08" PRIx32 " %d",
+		    msgid, j);
+		if (!envelope_create(msgid, buf, strlen(buf), &evpid))
+			errx(1, "envelope_create failed");
+	}
+	if (!message_commit(msgid, "/message"))
+		errx(1, "message_commit failed");
+	unlink("/message");
+
+	return (msgid);
+}
+
+/*
+ * Queue the messages, the first one too large for the memory limit of
+ * the second process, and leave them in the journal.
+ */
+static void
+fill(void)
+{
+	int	i;
+
+	for (i = 0; i < NMSG; i++)
+		put_message(i ? 17 : BIGMSG, NEVP);
+}
+
+/*
+ * Restore the journal, spill a new message, and walk.
+ */
+static void
+walk(void)
+{
+	char		 buf[64], expect[64], path[64];
+	struct stat	 sb;
+	uint64_t	 evpid, seen[NMSG * NEVP];
+	uint32_t	 msgid;
+	int		 i, n, r;
+
+	/* the restored messages are kept until the walk is over */
+	msgid = put_message(BIGMSG, 0);
+	(void)snprintf(path, sizeof path, "/queue/%02x/%08x/message",
+	    (msgid & 0xff000000) >> 24, msgid);
+	if (stat(path, &sb) == -1)
+		errx(1, "new message was not spilled");
+	(void)snprintf(path, sizeof path, "/queue/01/01000000/message");
+	if (stat(path, &sb) != -1)
+		errx(1, "restored message spilled before the walk");
+
+	n = 0;
+	while ((r = envelope_walk(&evpid, buf, sizeof buf)) != -1) {
+		if (r == 0)
+			continue;
+		for (i = 0; i < n; i++)
+			if (seen[i] == evpid)
+				errx(1, "envelope %016" PRIx64 " walked twice",
+				    evpid);
+		if (n == NMSG * NEVP)
+			errx(1, "too many envelopes walked");
+		seen[n++] = evpid;
+
+		msgid = evpid_to_msgid(evpid);
+		(void)snprintf(expect, sizeof expect, "envelope %08" PRIx32,
+		    msgid);
+		if (strncmp(buf, expect, strlen(expect)))
+			errx(1, "envelope %016" PRIx64 ": bad content", evpid);
+	}
+	if (n != NMSG * NEVP)
+		errx(1, "%d envelopes walked, expected %d", n, NMSG * NEVP);
+
+	if (stat(path, &sb) == -1)
+		errx(1, "restored message was not spilled after the walk");
+
+	/* the spilled message must be counted once */
+	if ((uintptr_t)tree_get(&evpcount, 1 << 24) != NEVP)
+		errx(1, "spilled message counts %zu envelopes, expected %d",
+		    (size_t)(uintptr_t)tree_get(&evpcount, 1 << 24), NEVP);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct passwd	 pw;
+	pid_t		 pid;
+	int		 status;
+
+	log_init(1);
+
+	if (mkdtemp(tmpdir) == NULL)
+		err(1, "mkdtemp");
+	if (chroot(tmpdir) == -1)
+		err(1, "chroot");
+	if (chdir("/") == -1)
+		err(1, "chdir");
+	if (mkdir("/queue", 0700) == -1 || mkdir("/corrupt", 0700) == -1 ||
+	    mkdir("/incoming", 0700) == -1)
+		err(1, "mkdir");
+
+	memset(&pw, 0, sizeof pw);
+	env->sc_queue_flags = QUEUE_TIERED | QUEUE_JOURNAL;
+	env->sc_queue_tier_delay = 3600;
+	env->sc_queue_tier_maxmem = 1024 * 1024;
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		event_init();
+		if (!queue_backend_fs.init(&pw, 1))
+			errx(1, "init failed");
+		fill();
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "filling the queue failed");
+
+	lastmsgid = NMSG;
+	env->sc_queue_tier_maxmem = BIGMSG / 2;
+	event_init();
+	if (!queue_backend_fs.init(&pw, 1))
+		errx(1, "init failed");
+	walk();
+
+	printf("ok\n");
+
+	return (0);
+}
@@ -0,0 +1,381 @@
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compare the route selection of mta_index_find() in smtpd/mta_index.c
+ * with the loop mta_find_route() used before, which looked up the route
+ * of each MX in the route tree.  Connections are opened on the selected
+ * routes and closed in order, and both must select the same routes, first
+ * with connection delays on a clock that moves forward, then without
+ * delays to compare their speed.
+ *
+ * usage: routebench [-i iterations] [-m mxs] [-s sources]
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+static int route_cmp(struct mta_route *, struct mta_route *);
+SPLAY_HEAD(routetree, mta_route);
+SPLAY_PROTOTYPE(routetree, mta_route, entry, route_cmp);
+
+static struct routetree		 routes;
+static struct mta_limits	 limits;
+static struct mta_relay		 relay;
+static struct mta_source	*srcs;
+static struct mta_host		*dsts;
+static struct mta_connector	*conns;
+static struct mta_route	**open;
+static long			 nopen, maxopen, first, target;
+static int			 nsrc, nmx;
+static time_t			 clock_now;
+
+void *
+xcalloc(size_t nmemb, size_t size, const char *where)
+{
+	void	*r;
+
+	if ((r = calloc(nmemb, size)) == NULL)
+		err(1, "%s", where);
+	return (r);
+}
+
+const char *
+mta_host_to_text(struct mta_host *h)
+{
+	return ("host");
+}
+
+const char *
+mta_route_to_text(struct mta_route *r)
+{
+	return ("route");
+}
+
+size_t
+mta_host_nconn(struct mta_host *h)
+{
+	return (h->nconn);
+}
+
+static int
+route_cmp(struct mta_route *a, struct mta_route *b)
+{
+	if (a->src < b->src)
+		return (-1);
+	if (a->src > b->src)
+		return (1);
+	if (a->dst < b->dst)
+		return (-1);
+	if (a->dst > b->dst)
+		return (1);
+	return (0);
+}
+
+static struct mta_route *
+route_get(struct mta_source *src, struct mta_host *dst)
+{
+	struct mta_route	key, *r;
+
+	key.src = src;
+	key.dst = dst;
+	if ((r = SPLAY_FIND(routetree, &routes, &key)) == NULL) {
+		r = xcalloc(1, sizeof *r, "route_get");
+		r->src = src;
+		r->dst = dst;
+		TAILQ_INIT(&r->candidates);
+		SPLAY_INSERT(routetree, &routes, r);
+	}
+	r->refcount++;
+	return (r);
+}
+
+/*
+ * The selection loop of mta_find_route() before the index, without
+ * the logging.
+ */
+static struct mta_route *
+find_tree(struct mta_connector *c, time_t now)
+{
+	struct mta_limits	*l = c->relay->limits;
+	struct mta_route	*route, *best;
+	struct mta_host		*host;
+	int			 i, level, limit, tm;
+
+	best = NULL;
+	level = -1;
+	limit = tm = 0;
+	for (i = 0; i < nmx; i++) {
+		host = &dsts[i];
+		if (c->candidates[i].preference > level) {
+			if (best || limit || tm)
+				break;
+			level = c->candidates[i].preference;
+		}
+		if (host->nconn >= l->maxconn_per_host) {
+			limit = 1;
+			continue;
+		}
+		if (host->lastconn + l->conndelay_host > now) {
+			tm = 1;
+			continue;
+		}
+		route = route_get(c->source, host);
+		if (route->flags & ROUTE_DISABLED) {
+			route->refcount--;
+			continue;
+		}
+		if (route->nconn >= l->maxconn_per_route) {
+			limit = 1;
+			route->refcount--;
+			continue;
+		}
+		if (route->lastconn + l->conndelay_route > now ||
+		    route->lastdisc + l->discdelay_route > now) {
+			tm = 1;
+			route->refcount--;
+			continue;
+		}
+		if (best && route->nconn >= best->nconn) {
+			route->refcount--;
+			continue;
+		}
+		if (best)
+			best->refcount--;
+		best = route;
+	}
+	if (best)
+		best->refcount--;
+	return (best);
+}
+
+static struct mta_route *
+find_index(struct mta_connector *c, time_t now)
+{
+	struct mta_search	s;
+
+	return (mta_index_find(c, now, &s));
+}
+
+static void
+route_open(struct mta_route *r)
+{
+	r->nconn++;
+	r->dst->nconn++;
+	r->lastconn = r->dst->lastconn = clock_now;
+	mta_index_update(r);
+	open[(first + nopen++) % maxopen] = r;
+}
+
+static void
+route_close(void)
+{
+	struct mta_route	*r;
+
+	r = open[first];
+	first = (first + 1) % maxopen;
+	nopen--;
+	r->nconn--;
+	r->dst->nconn--;
+	r->lastdisc = clock_now;
+	mta_index_update(r);
+}
+
+/*
+ * Open a connection on the selected route, and close the oldest one
+ * when too many are open or when no route could be found.
+ */
+static struct mta_route *
+step(struct mta_route *(*find)(struct mta_connector *, time_t),
+    struct mta_connector *c, time_t now)
+{
+	struct mta_route	*r;
+
+	if ((r = find(c, now)))
+		route_open(r);
+	if (nopen && (r == NULL || nopen >= target))
+		route_close();
+	return (r);
+}
+
+static void
+reset(void)
+{
+	struct mta_route	*r;
+	int			 i;
+
+	nopen = first = 0;
+	for (i = 0; i < nmx; i++) {
+		dsts[i].nconn = 0;
+		dsts[i].lastconn = 0;
+	}
+	SPLAY_FOREACH(r, routetree, &routes) {
+		r->nconn = 0;
+		r->flags = 0;
+		r->lastconn = r->lastdisc = 0;
+		mta_index_update(r);
+	}
+}
+
+static double
+run(struct mta_route *(*find)(struct mta_connector *, time_t), long iter,
+    time_t now, long *nfound)
+{
+	struct timespec		 t0, t1;
+	long			 i;
+
+	reset();
+	*nfound = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iter; i++) {
+		if (step(find, &conns[i % nsrc], now))
+			(*nfound)++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: routebench [-i iterations] [-m mxs] "
+	    "[-s sources]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct mta_connector	*c;
+	struct mta_route	*a, *b;
+	double			 ttree, tindex;
+	long			 iter, i, ntree, nindex;
+	int			 ch, j, k;
+	time_t			 now;
+
+	iter = 1000000;
+	nmx = 50;
+	nsrc = 32;
+	while ((ch = getopt(argc, argv, "i:m:s:")) != -1) {
+		switch (ch) {
+		case 'i':
+			iter = atol(optarg);
+			break;
+		case 'm':
+			nmx = atoi(optarg);
+			break;
+		case 's':
+			nsrc = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (iter <= 0 || nmx <= 0 || nsrc <= 0)
+		usage();
+
+	log_init(1);
+	log_verbose(0);
+
+	limits.maxconn_per_host = 50;
+	limits.maxconn_per_route = 5;
+	relay.limits = &limits;
+
+	/* fill the first preference level up to its limits, and a bit more */
+	target = (nmx < 10 ? nmx : 10) * limits.maxconn_per_host;
+	if (target > (long)nsrc * (nmx < 10 ? nmx : 10) * 5)
+		target = (long)nsrc * (nmx < 10 ? nmx : 10) * 5;
+	target += target / 10;
+	maxopen = target + 1;
+	open = xcalloc(maxopen, sizeof *open, "main");
+
+	SPLAY_INIT(&routes);
+	srcs = xcalloc(nsrc, sizeof *srcs, "main");
+	dsts = xcalloc(nmx, sizeof *dsts, "main");
+	conns = xcalloc(nsrc, sizeof *conns, "main");
+
+	for (k = 0; k < nmx; k++)
+		TAILQ_INIT(&dsts[k].candidates);
+
+	/* a few preference levels of ten MXs */
+	for (j = 0; j < nsrc; j++) {
+		c = &conns[j];
+		c->source = &srcs[j];
+		c->relay = &relay;
+		c->candidates = xcalloc(nmx, sizeof *c->candidates, "main");
+		for (k = 0; k < nmx; k++) {
+			c->candidates[k].route = route_get(c->source, &dsts[k]);
+			c->candidates[k].preference = 10 * (1 + k / 10);
+		}
+		c->ncandidates = nmx;
+		mta_index_build(c);
+	}
+
+	/* both must pick the same route, with some routes disabled */
+	limits.conndelay_host = 1;
+	limits.conndelay_route = 2;
+	limits.discdelay_route = 3;
+	clock_now = time(NULL);
+	reset();
+	for (i = 0; i < iter / 10; i++) {
+		/* the index places candidates at the real time */
+		if (i % 10 == 0)
+			clock_now++;
+		if (i % 100 == 0) {
+			a = conns[i / 100 % nsrc].candidates[i / 100 % nmx].route;
+			a->flags ^= ROUTE_DISABLED_NET;
+			mta_index_update(a);
+		}
+		c = &conns[i % nsrc];
+		a = find_tree(c, clock_now);
+		b = step(find_index, c, clock_now);
+		if (a != b)
+			errx(1, "selection %ld differs: %p != %p", i, a, b);
+	}
+
+	limits.conndelay_host = 0;
+	limits.conndelay_route = 0;
+	limits.discdelay_route = 0;
+	now = clock_now;
+
+	ttree = run(find_tree, iter, now, &ntree);
+	tindex = run(find_index, iter, now, &nindex);
+	if (ntree != nindex)
+		errx(1, "selection mismatch: %ld != %ld", ntree, nindex);
+
+	printf("%d mxs, %d sources, %ld selections, %ld routes found\n",
+	    nmx, nsrc, iter, nindex);
+	printf("tree lookup: %8.1f ns/selection\n", ttree * 1e9 / iter);
+	printf("index:       %8.1f ns/selection\n", tindex * 1e9 / iter);
+
+	return (0);
+}
+
+SPLAY_GENERATE(routetree, mta_route, entry, route_cmp);
@@ -36,6 +36,19 @@
 
 static int pipes[PROC_COUNT][PROC_COUNT];
 
+/*
+ * Additional mta and smtp workers talk to their peers over their own
+ * pipes, the first one uses the PROC_MTA or PROC_SMTP slot of the table
+ * above.  Index 0 is the worker end, index 1 the peer end.
+ */
+static int mta_pipes[MTA_MAXWORKERS][PROC_COUNT][2];
+static int smtp_pipes[SMTP_MAXWORKERS][PROC_COUNT][2];
+
+static void init_worker_pipes(int [][PROC_COUNT][2], int, int,
+    enum smtp_proc_type);
+static void close_worker_pipes(int [][PROC_COUNT][2], int);
+static struct mproc *config_mproc(enum smtp_proc_type, int);
+
 void
 purge_config(uint8_t what)
 {
@@ -94,6 +107,50 @@ init_pipes(void)
 			session_socket_blockmode(pipes[i][j], BM_NONBLOCK);
 			session_socket_blockmode(pipes[j][i], BM_NONBLOCK);
 		}
+
+	init_worker_pipes(mta_pipes, MTA_MAXWORKERS, env->sc_mta_workers,
+	    PROC_MTA);
+	init_worker_pipes(smtp_pipes, SMTP_MAXWORKERS, env->sc_smtp_workers,
+	    PROC_SMTP);
+}
+
+static void
+init_worker_pipes(int wpipes[][PROC_COUNT][2], int max, int workers,
+    enum smtp_proc_type proc)
+{
+	int	 i, j, sockpair[2];
+
+	for (i = 0; i < max; i++)
+		for (j = 0; j < PROC_COUNT; j++) {
+			wpipes[i][j][0] = -1;
+			wpipes[i][j][1] = -1;
+			if (i == 0 || i >= workers || j == (int)proc)
+				continue;
+			if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC,
+			    sockpair) == -1)
+				fatal("socketpair");
+			wpipes[i][j][0] = sockpair[0];
+			wpipes[i][j][1] = sockpair[1];
+			session_socket_blockmode(sockpair[0], BM_NONBLOCK);
+			session_socket_blockmode(sockpair[1], BM_NONBLOCK);
+		}
+}
+
+static void
+close_worker_pipes(int wpipes[][PROC_COUNT][2], int max)
+{
+	int	i, j, k;
+
+	for (i = 0; i < max; i++) {
+		for (j = 0; j < PROC_COUNT; j++) {
+			for (k = 0; k < 2; k++) {
+				if (wpipes[i][j][k] == -1)
+					continue;
+				close(wpipes[i][j][k]);
+				wpipes[i][j][k] = -1;
+			}
+		}
+	}
 }
 
 void
@@ -103,22 +160,63 @@ config_process(enum smtp_proc_type proc)
 	setproctitle("%s", proc_title(proc));
 }
 
-void
-config_peer(enum smtp_proc_type proc)
+static struct mproc *
+config_mproc(enum smtp_proc_type proc, int fd)
 {
 	struct mproc	*p;
 
-	if (proc == smtpd_process)
-		fatal("config_peers: cannot peer with oneself");
-
 	p = xcalloc(1, sizeof *p, "config_peer");
 	p->proc = proc;
 	p->name = xstrdup(proc_name(proc), "config_peer");
 	p->handler = imsg_dispatch;
 
-	mproc_init(p, pipes[smtpd_process][proc]);
+	mproc_init(p, fd);
 	mproc_enable(p);
-	pipes[smtpd_process][proc] = -1;
+
+	return (p);
+}
+
+void
+config_peer(enum smtp_proc_type proc)
+{
+	struct mproc	*p;
+	int		 i;
+
+	if (proc == smtpd_process)
+		fatal("config_peers: cannot peer with oneself");
+
+	if (smtpd_process == PROC_MTA && mta_worker) {
+		p = config_mproc(proc, mta_pipes[mta_worker][proc][0]);
+		mta_pipes[mta_worker][proc][0] = -1;
+	}
+	else if (smtpd_process == PROC_SMTP && smtp_worker) {
+		p = config_mproc(proc, smtp_pipes[smtp_worker][proc][0]);
+		smtp_pipes[smtp_worker][proc][0] = -1;
+	}
+	else {
+		p = config_mproc(proc, pipes[smtpd_process][proc]);
+		pipes[smtpd_process][proc] = -1;
+	}
+
+	if (proc == PROC_MTA) {
+		p_mta_worker[0] = p;
+		for (i = 1; i < env->sc_mta_workers; i++) {
+			p_mta_worker[i] = config_mproc(proc,
+			    mta_pipes[i][smtpd_process][1]);
+			p_mta_worker[i]->instance = i;
+			mta_pipes[i][smtpd_process][1] = -1;
+		}
+	}
+
+	if (proc == PROC_SMTP) {
+		p_smtp_worker[0] = p;
+		for (i = 1; i < env->sc_smtp_workers; i++) {
+			p_smtp_worker[i] = config_mproc(proc,
+			    smtp_pipes[i][smtpd_process][1]);
+			p_smtp_worker[i]->instance = i;
+			smtp_pipes[i][smtpd_process][1] = -1;
+		}
+	}
 
 	if (proc == PROC_CONTROL)
 		p_control = p;
@@ -160,6 +258,9 @@ config_done(void)
 		}
 	}
 
+	close_worker_pipes(mta_pipes, MTA_MAXWORKERS);
+	close_worker_pipes(smtp_pipes, SMTP_MAXWORKERS);
+
 	if (smtpd_process == PROC_CONTROL)
 		return;
 
@@ -179,9 +280,15 @@ process_stat(struct mproc *p)
 		return;
 
 	value.type = STAT_COUNTER;
-	snprintf(buf, sizeof buf, "buffer.%s.%s",
-	    proc_name(smtpd_process),
-	    proc_name(p->proc));
+	if ((p->proc == PROC_MTA && env->sc_mta_workers > 1) ||
+	    (p->proc == PROC_SMTP && env->sc_smtp_workers > 1))
+		snprintf(buf, sizeof buf, "buffer.%s.%s%d",
+		    proc_name(smtpd_process),
+		    proc_name(p->proc), p->instance);
+	else
+		snprintf(buf, sizeof buf, "buffer.%s.%s",
+		    proc_name(smtpd_process),
+		    proc_name(p->proc));
 	value.u.counter = p->bytes_queued_max;
 	p->bytes_queued_max = p->bytes_queued;
 	stat_set(buf, &value);
@@ -192,16 +299,19 @@ process_stat_event(int fd, short ev, void *arg)
 {
 	struct event	*e = arg;
 	struct timeval	 tv;
+	int		 i;
 
 	process_stat(p_control);
 	process_stat(p_lka);
 	process_stat(p_mda);
 	process_stat(p_mfa);
-	process_stat(p_mda);
 	process_stat(p_parent);
 	process_stat(p_queue);
 	process_stat(p_scheduler);
-	process_stat(p_smtp);
+	for (i = 0; i < env->sc_mta_workers; i++)
+		process_stat(p_mta_worker[i]);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		process_stat(p_smtp_worker[i]);
 
 	tv.tv_sec = 1;
 	tv.tv_usec = 0;
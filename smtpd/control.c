@@ -50,6 +50,7 @@ struct ctl_conn {
 	struct mproc		 mproc;
 	uid_t			 euid;
 	gid_t			 egid;
+	int			 mta_pending;
 };
 
 struct {
@@ -65,12 +66,17 @@ static void control_close(struct ctl_conn *);
 static void control_sig_handler(int, short, void *);
 static void control_dispatch_ext(struct mproc *, struct imsg *);
 static void control_digest_update(const char *, size_t, int);
+static const char *control_worker_key(struct mproc *, const char *);
+static void control_worker_set(struct mproc *, const char *, const char *,
+    struct stat_value *);
+static void control_broadcast_mta(struct ctl_conn *, struct imsg *);
 
 static struct stat_backend *stat_backend = NULL;
 extern const char *backend_stat;
 
 static uint32_t			connid = 0;
 static struct tree		ctl_conns;
+static struct dict		worker_stats;
 static struct stat_digest	digest;
 
 #define	CONTROL_FD_RESERVE	5
@@ -81,7 +87,7 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	struct ctl_conn		*c;
 	struct stat_value	 val;
 	struct msg		 m;
-	const char		*key;
+	const char		*key, *wkey;
 	const void		*data;
 	size_t			 sz;
 
@@ -119,15 +125,16 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	if (p->proc == PROC_MTA) {
 		switch (imsg->hdr.type) {
 		case IMSG_CTL_MTA_SHOW_ROUTES:
-			c = tree_get(&ctl_conns, imsg->hdr.peerid);
-			if (c == NULL)
-				return;
-			m_forward(&c->mproc, imsg);
-			return;
 		case IMSG_CTL_MTA_SHOW_HOSTSTATS:
+		case IMSG_CTL_MTA_SHOW_MXCACHE:
+		case IMSG_CTL_MTA_SHOW_RELAYS:
 			c = tree_get(&ctl_conns, imsg->hdr.peerid);
 			if (c == NULL)
 				return;
+			/* only the last worker ends the list */
+			if (imsg->hdr.len == sizeof(imsg->hdr) &&
+			    --c->mta_pending > 0)
+				return;
 			m_forward(&c->mproc, imsg);
 			return;
 		}
@@ -142,6 +149,8 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 		memmove(&val, data, sz);
 		if (stat_backend)
 			stat_backend->increment(key, val.u.counter);
+		if (stat_backend && (wkey = control_worker_key(p, key)))
+			stat_backend->increment(wkey, val.u.counter);
 		control_digest_update(key, val.u.counter, 1);
 		return;
 	case IMSG_STAT_DECREMENT:
@@ -152,6 +161,8 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 		memmove(&val, data, sz);
 		if (stat_backend)
 			stat_backend->decrement(key, val.u.counter);
+		if (stat_backend && (wkey = control_worker_key(p, key)))
+			stat_backend->decrement(wkey, val.u.counter);
 		control_digest_update(key, val.u.counter, 0);
 		return;
 	case IMSG_STAT_SET:
@@ -160,7 +171,11 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_data(&m, &data, &sz);
 		m_end(&m);
 		memmove(&val, data, sz);
-		if (stat_backend)
+		if (stat_backend == NULL)
+			return;
+		if ((wkey = control_worker_key(p, key)))
+			control_worker_set(p, key, wkey, &val);
+		else
 			stat_backend->set(key, &val);
 		return;
 	}
@@ -169,6 +184,81 @@ control_imsg(struct mproc *p, struct imsg *imsg)
 	    imsg_to_str(imsg->hdr.type));
 }
 
+/*
+ * When several mta or smtp workers are running, their counters are
+ * summed under the usual keys and also kept per worker.
+ */
+static const char *
+control_worker_key(struct mproc *p, const char *key)
+{
+	static char	buf[SMTPD_MAXLINESIZE];
+
+	if (p->proc == PROC_MTA && env->sc_mta_workers <= 1)
+		return (NULL);
+	if (p->proc == PROC_SMTP && env->sc_smtp_workers <= 1)
+		return (NULL);
+	if (p->proc != PROC_MTA && p->proc != PROC_SMTP)
+		return (NULL);
+
+	snprintf(buf, sizeof buf, "worker.%s%d.%s", proc_name(p->proc),
+	    p->instance, key);
+	return (buf);
+}
+
+/*
+ * Values set by the workers would overwrite each other under the usual
+ * key: remember the last one of each worker, and report their sum, or
+ * their mean for averages.
+ */
+static void
+control_worker_set(struct mproc *p, const char *key, const char *wkey,
+    struct stat_value *val)
+{
+	struct stat_value	 sum;
+	size_t			*v, n;
+	char			 buf[SMTPD_MAXLINESIZE];
+	int			 i, nworkers;
+
+	stat_backend->set(wkey, val);
+	if (val->type != STAT_COUNTER) {
+		stat_backend->set(key, val);
+		return;
+	}
+
+	if ((v = dict_get(&worker_stats, wkey)) == NULL) {
+		v = xmalloc(sizeof *v, "control_worker_set");
+		dict_set(&worker_stats, wkey, v);
+	}
+	*v = val->u.counter;
+
+	nworkers = (p->proc == PROC_MTA) ?
+	    env->sc_mta_workers : env->sc_smtp_workers;
+	sum.type = STAT_COUNTER;
+	sum.u.counter = 0;
+	for (i = 0, n = 0; i < nworkers; i++) {
+		snprintf(buf, sizeof buf, "worker.%s%d.%s",
+		    proc_name(p->proc), i, key);
+		if ((v = dict_get(&worker_stats, buf)) == NULL)
+			continue;
+		sum.u.counter += *v;
+		n++;
+	}
+	if (n && strlen(key) > 8 && !strcmp(key + strlen(key) - 8, ".average"))
+		sum.u.counter /= n;
+	stat_backend->set(key, &sum);
+}
+
+static void
+control_broadcast_mta(struct ctl_conn *c, struct imsg *imsg)
+{
+	int	i;
+
+	c->mta_pending = env->sc_mta_workers;
+	for (i = 0; i < env->sc_mta_workers; i++)
+		m_compose(p_mta_worker[i], imsg->hdr.type, c->id, 0, -1,
+		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+}
+
 static void
 control_sig_handler(int sig, short event, void *p)
 {
@@ -265,6 +355,7 @@ control(void)
 	signal(SIGHUP, SIG_IGN);
 
 	tree_init(&ctl_conns);
+	dict_init(&worker_stats);
 
 	bzero(&digest, sizeof digest);
 	digest.startup = time(NULL);
@@ -621,7 +712,9 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp paused");
 		env->sc_flags |= SMTPD_SMTP_PAUSED;
-		m_compose(p_smtp, IMSG_CTL_PAUSE_SMTP, 0, 0, -1, NULL, 0);
+		for (v = 0; v < env->sc_smtp_workers; v++)
+			m_compose(p_smtp_worker[v], IMSG_CTL_PAUSE_SMTP,
+			    0, 0, -1, NULL, 0);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -671,7 +764,8 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 		}
 		log_info("info: smtp resumed");
 		env->sc_flags &= ~SMTPD_SMTP_PAUSED;
-		m_forward(p_smtp, imsg);
+		for (v = 0; v < env->sc_smtp_workers; v++)
+			m_forward(p_smtp_worker[v], imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -680,7 +774,8 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 			goto badcred;
 
 		log_info("info: route resumed");
-		m_forward(p_mta, imsg);
+		for (v = 0; v < env->sc_mta_workers; v++)
+			m_forward(p_mta_worker[v], imsg);
 		m_compose(p, IMSG_CTL_OK, 0, 0, -1, NULL, 0);
 		return;
 
@@ -701,15 +796,25 @@ control_dispatch_ext(struct mproc *p, struct imsg *imsg)
 	case IMSG_CTL_MTA_SHOW_ROUTES:
 		if (c->euid)
 			goto badcred;
-		m_compose(p_mta, IMSG_CTL_MTA_SHOW_ROUTES, c->id, 0, -1,
-		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+		control_broadcast_mta(c, imsg);
 		return;
 
 	case IMSG_CTL_MTA_SHOW_HOSTSTATS:
 		if (c->euid)
 			goto badcred;
-		m_compose(p_mta, IMSG_CTL_MTA_SHOW_HOSTSTATS, c->id, 0, -1,
-		    imsg->data, imsg->hdr.len - sizeof(imsg->hdr));
+		control_broadcast_mta(c, imsg);
+		return;
+
+	case IMSG_CTL_MTA_SHOW_MXCACHE:
+		if (c->euid)
+			goto badcred;
+		control_broadcast_mta(c, imsg);
+		return;
+
+	case IMSG_CTL_MTA_SHOW_RELAYS:
+		if (c->euid)
+			goto badcred;
+		control_broadcast_mta(c, imsg);
 		return;
 
 	case IMSG_CTL_SCHEDULE:
@@ -41,7 +41,10 @@
 
 struct dns_lookup {
 	struct dns_session	*session;
+	char			 host[SMTPD_MAXHOSTNAMELEN];
 	int			 preference;
+	int			 pending;	/* A and AAAA queries */
+	size_t			 found;
 };
 
 struct dns_session {
@@ -52,6 +55,7 @@ struct dns_session {
 	size_t			 mxfound;
 	int			 error;
 	int			 refcount;
+	uint32_t		 ttl;
 };
 
 struct async_event;
@@ -59,10 +63,16 @@ struct async_event * async_run_event(struct async *,
 	void (*)(int, struct async_res *, void *), void *);
 
 static void dns_lookup_host(struct dns_session *, const char *, int);
+static void dns_lookup_addrinfo(struct dns_lookup *);
 static void dns_dispatch_host(int, struct async_res *, void *);
+static void dns_dispatch_addrinfo(int, struct async_res *, void *);
+static void dns_host_found(struct dns_lookup *, const struct sockaddr *);
+static void dns_host_end(struct dns_session *);
+static void dns_ttl(struct dns_session *, uint32_t);
 static void dns_dispatch_ptr(int, struct async_res *, void *);
 static void dns_dispatch_mx(int, struct async_res *, void *);
 static void dns_dispatch_mx_preference(int, struct async_res *, void *);
+static uint32_t dns_negative_ttl(struct async_res *);
 
 #define print_dname(a,b,c) asr_strdname(a, b, c)
 
@@ -160,23 +170,78 @@ dns_imsg(struct mproc *p, struct imsg *imsg)
 	}
 }
 
+/*
+ * The addresses of a host are read from the answers to its A and AAAA
+ * queries, along with their ttl.
+ */
 static void
 dns_dispatch_host(int ev, struct async_res *ar, void *arg)
 {
-	struct dns_session	*s;
 	struct dns_lookup	*lookup = arg;
-	struct addrinfo		*ai;
+	struct dns_session	*s = lookup->session;
+	struct sockaddr_storage	 ss;
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	struct unpack		 pack;
+	struct header		 h;
+	struct query		 q;
+	struct rr		 rr;
 
-	s = lookup->session;
+	if (ar->ar_h_errno == 0) {
+		asr_unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+		asr_unpack_header(&pack, &h);
+		asr_unpack_query(&pack, &q);
+		for (; h.ancount; h.ancount--) {
+			if (asr_unpack_rr(&pack, &rr) == -1)
+				break;
+			memset(&ss, 0, sizeof ss);
+			switch (rr.rr_type) {
+			case T_A:
+				sin = (struct sockaddr_in *)&ss;
+				sin->sin_len = sizeof *sin;
+				sin->sin_family = AF_INET;
+				sin->sin_addr = rr.rr.in_a.addr;
+				break;
+			case T_AAAA:
+				sin6 = (struct sockaddr_in6 *)&ss;
+				sin6->sin6_len = sizeof *sin6;
+				sin6->sin6_family = AF_INET6;
+				sin6->sin6_addr = rr.rr.in_aaaa.addr6;
+				break;
+			case T_CNAME:
+				dns_ttl(s, rr.rr_ttl);
+				continue;
+			default:
+				continue;
+			}
+			dns_ttl(s, rr.rr_ttl);
+			dns_host_found(lookup, (struct sockaddr *)&ss);
+		}
+	}
+	free(ar->ar_data);
 
-	for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next) {
-		s->mxfound++;
-		m_create(s->p, IMSG_DNS_HOST, 0, 0, -1);
-		m_add_id(s->p, s->reqid);
-		m_add_sockaddr(s->p, ai->ai_addr);
-		m_add_int(s->p, lookup->preference);
-		m_close(s->p);
+	if (--lookup->pending)
+		return;
+
+	/* A relay host may be known to the hosts file only */
+	if (lookup->found == 0 && lookup->preference == -1) {
+		dns_lookup_addrinfo(lookup);
+		return;
 	}
+
+	free(lookup);
+	dns_host_end(s);
+}
+
+static void
+dns_dispatch_addrinfo(int ev, struct async_res *ar, void *arg)
+{
+	struct dns_lookup	*lookup = arg;
+	struct dns_session	*s = lookup->session;
+	struct addrinfo		*ai;
+
+	for (ai = ar->ar_addrinfo; ai; ai = ai->ai_next)
+		dns_host_found(lookup, ai->ai_addr);
 	free(lookup);
 	if (ar->ar_addrinfo)
 		freeaddrinfo(ar->ar_addrinfo);
@@ -184,16 +249,50 @@ dns_dispatch_host(int ev, struct async_res *ar, void *arg)
 	if (ar->ar_gai_errno)
 		s->error = ar->ar_gai_errno;
 
+	dns_host_end(s);
+}
+
+static void
+dns_host_found(struct dns_lookup *lookup, const struct sockaddr *sa)
+{
+	struct dns_session	*s = lookup->session;
+
+	lookup->found++;
+	s->mxfound++;
+	m_create(s->p, IMSG_DNS_HOST, 0, 0, -1);
+	m_add_id(s->p, s->reqid);
+	m_add_sockaddr(s->p, sa);
+	m_add_int(s->p, lookup->preference);
+	m_close(s->p);
+}
+
+static void
+dns_host_end(struct dns_session *s)
+{
 	if (--s->refcount)
 		return;
 
 	m_create(s->p, IMSG_DNS_HOST_END, 0, 0, -1);
 	m_add_id(s->p, s->reqid);
 	m_add_int(s->p, s->mxfound ? DNS_OK : DNS_ENOTFOUND);
+	m_add_u32(s->p, s->ttl);
 	m_close(s->p);
 	free(s);
 }
 
+/*
+ * The answer may be cached as long as the record that expires first.  A
+ * ttl of 0 means unknown, so a record with no ttl counts for 1 second.
+ */
+static void
+dns_ttl(struct dns_session *s, uint32_t ttl)
+{
+	if (ttl == 0)
+		ttl = 1;
+	if (s->ttl == 0 || ttl < s->ttl)
+		s->ttl = ttl;
+}
+
 static void
 dns_dispatch_ptr(int ev, struct async_res *ar, void *arg)
 {
@@ -230,6 +329,7 @@ dns_dispatch_mx(int ev, struct async_res *ar, void *arg)
 			m_add_int(s->p, DNS_EINVAL);
 		else
 			m_add_int(s->p, DNS_RETRY);
+		m_add_u32(s->p, dns_negative_ttl(ar));
 		m_close(s->p);
 		free(s);
 		free(ar->ar_data);
@@ -247,6 +347,7 @@ dns_dispatch_mx(int ev, struct async_res *ar, void *arg)
 			continue;
 		print_dname(rr.rr.mx.exchange, buf, sizeof(buf));
 		buf[strlen(buf) - 1] = '\0';
+		dns_ttl(s, rr.rr_ttl);
 		dns_lookup_host(s, buf, rr.rr.mx.preference);
 		found++;
 	}
@@ -306,23 +407,78 @@ dns_dispatch_mx_preference(int ev, struct async_res *ar, void *arg)
 	free(s);
 }
 
+/*
+ * Find how long a negative answer may be cached, from the SOA record in
+ * the authority section (RFC 2308).  Return 0 if unknown.
+ */
+static uint32_t
+dns_negative_ttl(struct async_res *ar)
+{
+	struct unpack	 pack;
+	struct header	 h;
+	struct query	 q;
+	struct rr	 rr;
+
+	if (ar->ar_data == NULL)
+		return (0);
+
+	asr_unpack_init(&pack, ar->ar_data, ar->ar_datalen);
+	asr_unpack_header(&pack, &h);
+	asr_unpack_query(&pack, &q);
+	for (; h.ancount; h.ancount--)
+		asr_unpack_rr(&pack, &rr);
+	for (; h.nscount; h.nscount--) {
+		if (asr_unpack_rr(&pack, &rr) == -1)
+			break;
+		if (rr.rr_type != T_SOA)
+			continue;
+		if (rr.rr.soa.minimum < rr.rr_ttl)
+			return (rr.rr.soa.minimum);
+		return (rr.rr_ttl);
+	}
+
+	return (0);
+}
+
 static void
 dns_lookup_host(struct dns_session *s, const char *host, int preference)
 {
 	struct dns_lookup	*lookup;
-	struct addrinfo		 hints;
 	struct async		*as;
+	struct in6_addr		 in6;
+	struct in_addr		 in;
 
 	lookup = xcalloc(1, sizeof *lookup, "dns_lookup_host");
 	lookup->preference = preference;
 	lookup->session = s;
+	strlcpy(lookup->host, host, sizeof(lookup->host));
 	s->refcount++;
 
+	/* An address is only converted */
+	if (inet_pton(AF_INET, host, &in) == 1 ||
+	    inet_pton(AF_INET6, host, &in6) == 1) {
+		dns_lookup_addrinfo(lookup);
+		return;
+	}
+
+	lookup->pending = 2;
+	as = res_query_async(host, C_IN, T_A, NULL);
+	async_run_event(as, dns_dispatch_host, lookup);
+	as = res_query_async(host, C_IN, T_AAAA, NULL);
+	async_run_event(as, dns_dispatch_host, lookup);
+}
+
+static void
+dns_lookup_addrinfo(struct dns_lookup *lookup)
+{
+	struct addrinfo		 hints;
+	struct async		*as;
+
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	as = getaddrinfo_async(host, NULL, &hints, NULL);
-	async_run_event(as, dns_dispatch_host, lookup);
+	as = getaddrinfo_async(lookup->host, NULL, &hints, NULL);
+	async_run_event(as, dns_dispatch_addrinfo, lookup);
 }
 
 /* Generic libevent glue for asr */
@@ -24,8 +24,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef IO_SSL
 #include <openssl/err.h>
 #include <openssl/ssl.h>
@@ -35,9 +40,26 @@
 
 #define IOBUF_MAX	65536
 #define IOBUFQ_MIN	4096
+#define IOBUFQ_BULK	16384
+#define IOBUF_BODY_LINES	64	/* lines rewritten at once */
+
+/*
+ * Released read buffers of the smtp command line size are kept on a
+ * free list, so that idle sessions can give them back and get them
+ * again cheaply.
+ */
+#define IOBUF_POOL_BUFSIZE	2048
+#define IOBUF_POOL_MAX		256
+
+static void	*iobuf_pool[IOBUF_POOL_MAX];
+static size_t	 iobuf_npool;
+
+static int	iobuf_alloc(struct iobuf *);
+static void	iobuf_free(char *, size_t);
 
 struct ioqbuf	*ioqbuf_alloc(struct iobuf *, size_t);
 void		 iobuf_drain(struct iobuf *, size_t);
+static size_t	 iobuf_scan(const char *, size_t, size_t *, int *);
 
 int
 iobuf_init(struct iobuf *io, size_t size, size_t max)
@@ -53,22 +75,57 @@ iobuf_init(struct iobuf *io, size_t size, size_t max)
 	if (size > max)
 		return (-1);
 
-	if ((io->buf = malloc(size)) == NULL)
+	io->init = size;
+	io->max = max;
+
+	return (iobuf_alloc(io));
+}
+
+static int
+iobuf_alloc(struct iobuf *io)
+{
+	if (io->init == IOBUF_POOL_BUFSIZE && iobuf_npool)
+		io->buf = iobuf_pool[--iobuf_npool];
+	else if ((io->buf = malloc(io->init)) == NULL)
 		return (-1);
 
-	io->size = size;
-	io->max = max;
+	io->size = io->init;
 
 	return (0);
 }
 
+static void
+iobuf_free(char *buf, size_t size)
+{
+	if (size == IOBUF_POOL_BUFSIZE && iobuf_npool < IOBUF_POOL_MAX)
+		iobuf_pool[iobuf_npool++] = buf;
+	else
+		free(buf);
+}
+
+/*
+ * Give back the read buffer if it holds no data.  A buffer of the
+ * initial size is allocated again on the next read.
+ */
+void
+iobuf_release(struct iobuf *io)
+{
+	if (io->buf == NULL || iobuf_len(io))
+		return;
+
+	iobuf_free(io->buf, io->size);
+	io->buf = NULL;
+	io->size = 0;
+	io->rpos = io->wpos = 0;
+}
+
 void
 iobuf_clear(struct iobuf *io)
 {
 	struct ioqbuf	*q;
 
 	if (io->buf)
-		free(io->buf);
+		iobuf_free(io->buf, io->size);
 
 	while ((q = io->outq)) {
 		io->outq = q->next;
@@ -156,33 +213,191 @@ iobuf_drop(struct iobuf *io, size_t n)
 	io->rpos += n;
 }
 
+/*
+ * Return the offset of the first LF in buf, or len if there is none.
+ * The offset of the first CR before it is stored in cr (len if none),
+ * and hibit is set if a byte with the high bit set comes before it.
+ */
+static size_t
+iobuf_scan(const char *buf, size_t len, size_t *cr, int *hibit)
+{
+	size_t		 i = 0;
+#ifdef __SSE2__
+	__m128i		 v, lf, crlf;
+	unsigned int	 mlf, mcr, mhi, below;
+
+	lf = _mm_set1_epi8('\n');
+	crlf = _mm_set1_epi8('\r');
+#endif
+
+	*cr = len;
+	*hibit = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i));
+		mlf = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		mcr = _mm_movemask_epi8(_mm_cmpeq_epi8(v, crlf));
+		mhi = _mm_movemask_epi8(v);
+		if (mlf) {
+			/* only look at the bytes before the LF */
+			below = (mlf & -mlf) - 1;
+			mcr &= below;
+			mhi &= below;
+		}
+		if (mcr && *cr == len)
+			*cr = i + ffs(mcr) - 1;
+		if (mhi)
+			*hibit = 1;
+		if (mlf)
+			return (i + ffs(mlf) - 1);
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (buf[i] == '\n')
+			return (i);
+		if (buf[i] == '\r' && *cr == len)
+			*cr = i;
+		if (buf[i] & 0x80)
+			*hibit = 1;
+	}
+
+	return (len);
+}
+
 char *
 iobuf_getline(struct iobuf *iobuf, size_t *rlen)
 {
 	char	*buf;
-	size_t	 len, i;
+	size_t	 len, i, cr;
+	int	 hibit;
 
 	buf = iobuf_data(iobuf);
 	len = iobuf_len(iobuf);
 
-	for (i = 0; i + 1 <= len; i++)
-		if (buf[i] == '\n') {
-			/* Note: the returned address points into the iobuf
-			 * buffer.  We NUL-end it for convenience, and discard
-			 * the data from the iobuf, so that the caller doesn't
-			 * have to do it.  The data remains "valid" as long
-			 * as the iobuf does not overwrite it, that is until
-			 * the next call to iobuf_normalize() or iobuf_extend().
-			 */
-			iobuf_drop(iobuf, i + 1);
-			len = (i && buf[i - 1] == '\r') ? i - 1 : i;
-			buf[len] = '\0';
-			if (rlen)
-				*rlen = len;
-			return (buf);
+	i = iobuf_scan(buf, len, &cr, &hibit);
+	if (i == len)
+		return (NULL);
+
+	/* Note: the returned address points into the iobuf
+	 * buffer.  We NUL-end it for convenience, and discard
+	 * the data from the iobuf, so that the caller doesn't
+	 * have to do it.  The data remains "valid" as long
+	 * as the iobuf does not overwrite it, that is until
+	 * the next call to iobuf_normalize() or iobuf_extend().
+	 */
+	iobuf_drop(iobuf, i + 1);
+	len = (i && buf[i - 1] == '\r') ? i - 1 : i;
+	buf[len] = '\0';
+	if (rlen)
+		*rlen = len;
+	return (buf);
+}
+
+/*
+ * Find up to n complete lines in the buffer, starting at offset off.
+ * Unlike iobuf_getline(), the data is neither modified nor discarded.
+ * Each line is flagged if it contains a bare CR or LF, or 8-bit bytes.
+ * Return the number of lines found.
+ */
+size_t
+iobuf_getlines(struct iobuf *iobuf, size_t off, struct iobuf_line *lines,
+    size_t n)
+{
+	char	*buf;
+	size_t	 len, i, cr, count;
+	int	 hibit;
+
+	buf = iobuf_data(iobuf) + off;
+	len = iobuf_len(iobuf) - off;
+
+	for (count = 0; count < n; count++) {
+		i = iobuf_scan(buf, len, &cr, &hibit);
+		if (i == len)
+			break;
+
+		lines[count].line = buf;
+		lines[count].size = i + 1;
+		lines[count].flags = hibit ? IOBUF_LINE_8BIT : 0;
+		if (i && buf[i - 1] == '\r') {
+			lines[count].len = i - 1;
+			if (cr != i - 1)
+				lines[count].flags |= IOBUF_LINE_BARECR;
+		}
+		else {
+			lines[count].len = i;
+			lines[count].flags |= IOBUF_LINE_BARELF;
+			if (cr != len)
+				lines[count].flags |= IOBUF_LINE_BARECR;
 		}
 
-	return (NULL);
+		buf += i + 1;
+		len -= i + 1;
+	}
+
+	return (count);
+}
+
+/*
+ * Rewrite in place the lines of an SMTP message body found in the buffer,
+ * dropping the CR of CRLF endings and the dot-stuffing, and with
+ * IOBUF_BODY_7BIT, the high bit of every byte.  The result is packed at
+ * the start of the data and its length stored in *outlen, while *off is
+ * set to the length of the input it was made from, including the
+ * end-of-data marker; the caller drops it once the output is consumed.
+ * The IOBUF_LINE_* flags of the lines are or'ed into *flags.
+ * Return 1 when the end-of-data marker was found, 0 if more input is
+ * needed, or -1 if a line is maxlen bytes or longer.
+ */
+int
+iobuf_getbody(struct iobuf *iobuf, size_t maxlen, int opts, size_t *off,
+    size_t *outlen, int *flags)
+{
+	struct iobuf_line	 lines[IOBUF_BODY_LINES];
+	char			*buf, *line, *out;
+	size_t			 len, n, i, j;
+
+	buf = out = iobuf_data(iobuf);
+	*off = 0;
+
+	while ((n = iobuf_getlines(iobuf, *off, lines, IOBUF_BODY_LINES))) {
+		for (i = 0; i < n; i++) {
+			line = lines[i].line;
+			len = lines[i].len;
+			*off += lines[i].size;
+			*flags |= lines[i].flags;
+
+			if (len >= maxlen)
+				return (-1);
+
+			if (len == 1 && line[0] == '.') {
+				*outlen = out - buf;
+				return (1);
+			}
+
+			if (line[0] == '.') {
+				line += 1;
+				len -= 1;
+			}
+
+			if (opts & IOBUF_BODY_7BIT &&
+			    lines[i].flags & IOBUF_LINE_8BIT)
+				for (j = 0; j < len; ++j)
+					line[j] &= 0x7f;
+
+			if (out != line)
+				memmove(out, line, len);
+			out += len;
+			*out++ = '\n';
+		}
+	}
+
+	if (iobuf_len(iobuf) - *off >= maxlen)
+		return (-1);
+
+	*outlen = out - buf;
+	return (0);
 }
 
 void
@@ -206,6 +421,9 @@ iobuf_read(struct iobuf *io, int fd)
 {
 	ssize_t	n;
 
+	if (io->buf == NULL && iobuf_alloc(io) == -1)
+		return (IOBUF_ERROR);
+
 	n = read(fd, io->buf + io->wpos, iobuf_left(io));
 	if (n == -1) {
 		/* XXX is this really what we want? */
@@ -226,7 +444,13 @@ ioqbuf_alloc(struct iobuf *io, size_t len)
 {
 	struct ioqbuf   *q;
 
-	if (len < IOBUFQ_MIN)
+	/*
+	 * Use larger chunks once a bulk transfer is going on, so that
+	 * fewer and bigger writes (or SSL records) are done.
+	 */
+	if (io->queued >= IOBUFQ_MIN && len < IOBUFQ_BULK)
+		len = IOBUFQ_BULK;
+	else if (len < IOBUFQ_MIN)
 		len = IOBUFQ_MIN;
 
 	if ((q = malloc(sizeof(*q) + len)) == NULL)
@@ -439,6 +663,9 @@ iobuf_read_ssl(struct iobuf *io, void *ssl)
 	ssize_t	n;
 	int	r;
 
+	if (io->buf == NULL && iobuf_alloc(io) == -1)
+		return (IOBUF_ERROR);
+
 	n = SSL_read(ssl, io->buf + io->wpos, iobuf_left(io));
 	if (n < 0) {
 		switch ((r = SSL_get_error(ssl, n))) {
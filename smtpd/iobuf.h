@@ -29,6 +29,7 @@ struct ioqbuf {
 
 struct iobuf {
 	char		*buf;
+	size_t		 init;	/* size allocated on the first read */
 	size_t		 max;
 	size_t		 size;
 	size_t		 wpos;
@@ -39,6 +40,19 @@ struct iobuf {
 	struct ioqbuf	*outqlast;
 };
 
+struct iobuf_line {
+	char		*line;
+	size_t		 len;	/* without the end of line */
+	size_t		 size;	/* with the end of line */
+	int		 flags;
+};
+
+#define IOBUF_LINE_BARECR	0x01	/* CR not followed by LF */
+#define IOBUF_LINE_BARELF	0x02	/* LF not preceded by CR */
+#define IOBUF_LINE_8BIT		0x04	/* byte with the high bit set */
+
+#define IOBUF_BODY_7BIT		0x01	/* clear the high bit of the body */
+
 #define IOBUF_WANT_READ		-1
 #define IOBUF_WANT_WRITE	-2
 #define IOBUF_CLOSED		-3
@@ -47,6 +61,7 @@ struct iobuf {
 
 int	iobuf_init(struct iobuf *, size_t, size_t);
 void	iobuf_clear(struct iobuf *);
+void	iobuf_release(struct iobuf *);
 
 int	iobuf_extend(struct iobuf *, size_t);
 void	iobuf_normalize(struct iobuf *);
@@ -56,6 +71,8 @@ size_t	iobuf_len(struct iobuf *);
 size_t	iobuf_left(struct iobuf *);
 char   *iobuf_data(struct iobuf *);
 char   *iobuf_getline(struct iobuf *, size_t *);
+size_t	iobuf_getlines(struct iobuf *, size_t, struct iobuf_line *, size_t);
+int	iobuf_getbody(struct iobuf *, size_t, int, size_t *, size_t *, int *);
 ssize_t	iobuf_read(struct iobuf *, int);
 ssize_t	iobuf_read_ssl(struct iobuf *, void *);
 
@@ -57,6 +57,7 @@ limit_mta_set_defaults(struct mta_limits *limits)
 	limits->sessdelay_keepalive = 10;
 
 	limits->family = AF_UNSPEC;
+	limits->adaptive = 0;
 }
 
 int
@@ -97,6 +98,59 @@ limit_mta_set(struct mta_limits *limits, const char *key, int64_t value)
 		limits->sessdelay_transaction = value;
 	else if (!strcmp(key, "session-keepalive"))
 		limits->sessdelay_keepalive = value;
+
+	else if (!strcmp(key, "adaptive-concurrency"))
+		limits->adaptive = value ? 1 : 0;
+
+	else if (!strcmp(key, "max-mail-per-second"))
+		limits->maxmail_per_second = value;
+	else if (!strcmp(key, "max-rcpt-per-second"))
+		limits->maxrcpt_per_second = value;
+	else if (!strcmp(key, "max-bytes-per-second"))
+		limits->maxbytes_per_second = value;
+	else
+		return (0);
+
+	return (1);
+}
+
+void
+limit_smtp_set_defaults(struct smtp_limits *limits)
+{
+	memset(limits, 0, sizeof(*limits));
+
+	limits->prefix4 = 24;
+	limits->prefix6 = 64;
+}
+
+int
+limit_smtp_set(struct smtp_limits *limits, const char *key, int64_t value)
+{
+	if (value < 0)
+		return (0);
+
+	if (!strcmp(key, "max-conn-per-second"))
+		limits->source.conn_per_second = value;
+	else if (!strcmp(key, "max-sessions"))
+		limits->source.sessions = value;
+	else if (!strcmp(key, "max-cmd-per-second"))
+		limits->source.cmd_per_second = value;
+	else if (!strcmp(key, "max-rcpt-per-second"))
+		limits->source.rcpt_per_second = value;
+
+	else if (!strcmp(key, "network-max-conn-per-second"))
+		limits->network.conn_per_second = value;
+	else if (!strcmp(key, "network-max-sessions"))
+		limits->network.sessions = value;
+	else if (!strcmp(key, "network-max-cmd-per-second"))
+		limits->network.cmd_per_second = value;
+	else if (!strcmp(key, "network-max-rcpt-per-second"))
+		limits->network.rcpt_per_second = value;
+
+	else if (!strcmp(key, "network-prefix-inet4") && value <= 32)
+		limits->prefix4 = value;
+	else if (!strcmp(key, "network-prefix-inet6") && value <= 128)
+		limits->prefix6 = value;
 	else
 		return (0);
 
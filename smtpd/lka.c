@@ -69,8 +69,10 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	static struct dict	*ssl_dict;
 	static struct dict	*tables_dict;
 	static struct table	*table_last;
-	static struct ca_vrfy_req_msg	*req_ca_vrfy_smtp = NULL;
-	static struct ca_vrfy_req_msg	*req_ca_vrfy_mta = NULL;
+	static struct ca_vrfy_req_msg	*req_ca_vrfy_smtps[SMTP_MAXWORKERS];
+	struct ca_vrfy_req_msg		*req_ca_vrfy_smtp;
+	static struct ca_vrfy_req_msg	*req_ca_vrfy_mtas[MTA_MAXWORKERS];
+	struct ca_vrfy_req_msg		*req_ca_vrfy_mta;
 	struct ca_vrfy_req_msg		*req_ca_vrfy_chain;
 	struct ca_vrfy_resp_msg		resp_ca_vrfy;
 	struct ca_cert_req_msg		*req_ca_cert;
@@ -96,6 +98,9 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	}
 
 	if (p->proc == PROC_SMTP) {
+		/* each smtp worker may have a verification in progress */
+		req_ca_vrfy_smtp = req_ca_vrfy_smtps[p->instance];
+
 		switch (imsg->hdr.type) {
 		case IMSG_LKA_EXPAND_RCPT:
 			m_msg(&m, imsg);
@@ -138,6 +143,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			    sizeof (unsigned char *), "lka:ca_vrfy");
 			req_ca_vrfy_smtp->chain_cert_len = xcalloc(req_ca_vrfy_smtp->n_chain,
 			    sizeof (off_t), "lka:ca_vrfy");
+			req_ca_vrfy_smtps[p->instance] = req_ca_vrfy_smtp;
 			return;
 
 		case IMSG_LKA_SSL_VERIFY_CHAIN:
@@ -170,6 +176,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			free(req_ca_vrfy_smtp->chain_cert_len);
 			free(req_ca_vrfy_smtp->cert);
 			free(req_ca_vrfy_smtp);
+			req_ca_vrfy_smtps[p->instance] = NULL;
 			return;
 
 		case IMSG_LKA_AUTHENTICATE:
@@ -222,6 +229,9 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 	}
 
 	if (p->proc == PROC_MTA) {
+		/* each mta worker may have a verification in progress */
+		req_ca_vrfy_mta = req_ca_vrfy_mtas[p->instance];
+
 		switch (imsg->hdr.type) {
 
 		case IMSG_LKA_SSL_INIT:
@@ -257,6 +267,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			    sizeof (unsigned char *), "lka:ca_vrfy");
 			req_ca_vrfy_mta->chain_cert_len = xcalloc(req_ca_vrfy_mta->n_chain,
 			    sizeof (off_t), "lka:ca_vrfy");
+			req_ca_vrfy_mtas[p->instance] = req_ca_vrfy_mta;
 			return;
 
 		case IMSG_LKA_SSL_VERIFY_CHAIN:
@@ -290,6 +301,7 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			free(req_ca_vrfy_mta->chain_cert_len);
 			free(req_ca_vrfy_mta->cert);
 			free(req_ca_vrfy_mta);
+			req_ca_vrfy_mtas[p->instance] = NULL;
 			return;
 
 		case IMSG_LKA_SECRET:
@@ -496,8 +508,10 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 
 			/* Start fulfilling requests */
 			mproc_enable(p_mda);
-			mproc_enable(p_mta);
-			mproc_enable(p_smtp);
+			for (v = 0; v < env->sc_mta_workers; v++)
+				mproc_enable(p_mta_worker[v]);
+			for (v = 0; v < env->sc_smtp_workers; v++)
+				mproc_enable(p_smtp_worker[v]);
 			return;
 
 		case IMSG_CTL_VERBOSE:
@@ -519,7 +533,16 @@ lka_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 
 		case IMSG_LKA_AUTHENTICATE:
-			m_forward(p_smtp, imsg);
+			m_msg(&m, imsg);
+			m_get_id(&m, &reqid);
+			m_get_int(&m, &ret);
+			m_end(&m);
+
+			p = smtp_worker_for(reqid);
+			m_create(p, IMSG_LKA_AUTHENTICATE, 0, 0, -1);
+			m_add_id(p, reqid);
+			m_add_int(p, ret);
+			m_close(p);
 			return;
 		}
 	}
@@ -577,6 +600,7 @@ lka(void)
 	struct event	 ev_sigint;
 	struct event	 ev_sigterm;
 	struct event	 ev_sigchld;
+	int		 i;
 
 	switch (pid = fork()) {
 	case -1:
@@ -627,8 +651,10 @@ lka(void)
 
 	/* Ignore them until we get our config */
 	mproc_disable(p_mda);
-	mproc_disable(p_mta);
-	mproc_disable(p_smtp);
+	for (i = 0; i < env->sc_mta_workers; i++)
+		mproc_disable(p_mta_worker[i]);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		mproc_disable(p_smtp_worker[i]);
 
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
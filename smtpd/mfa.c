@@ -210,6 +210,7 @@ mfa(void)
 	struct event	 ev_sigint;
 	struct event	 ev_sigterm;
 	struct event	 ev_sigchld;
+	int		 i;
 
 	switch (pid = fork()) {
 	case -1:
@@ -256,7 +257,8 @@ mfa(void)
 	config_peer(PROC_CONTROL);
 	config_done();
 
-	mproc_disable(p_smtp);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		mproc_disable(p_smtp_worker[i]);
 
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
@@ -268,6 +270,9 @@ mfa(void)
 void
 mfa_ready(void)
 {
+	int	i;
+
 	log_debug("debug: mfa ready");
-	mproc_enable(p_smtp);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		mproc_enable(p_smtp_worker[i]);
 }
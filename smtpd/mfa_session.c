@@ -297,10 +297,11 @@ mfa_run_data(struct mfa_filter *f, uint64_t id, const char *line)
 	log_trace(TRACE_MFA,
 	    "filter: sending final data to smtp for %016"PRIx64" on filter %p: %s", id, f, line);
 
-	m_create(p_smtp, IMSG_MFA_SMTP_DATA, 0, 0, -1);
-	m_add_id(p_smtp, id);
-	m_add_string(p_smtp, line);
-	m_close(p_smtp);
+	p = smtp_worker_for(id);
+	m_create(p, IMSG_MFA_SMTP_DATA, 0, 0, -1);
+	m_add_id(p, id);
+	m_add_string(p, line);
+	m_close(p);
 }
 
 static struct mfa_query *
@@ -331,6 +332,7 @@ mfa_drain_query(struct mfa_query *q)
 {
 	struct mfa_filter	*f;
 	struct mfa_query	*prev;
+	struct mproc		*p;
 
 	log_trace(TRACE_MFA, "filter: draining query %s", mfa_query_to_text(q));
 
@@ -392,13 +394,14 @@ mfa_drain_query(struct mfa_query *q)
 			m_close(&f->mproc);
 		}
 
-		m_create(p_smtp, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
-		m_add_id(p_smtp, q->session->id);
-		m_add_int(p_smtp, q->smtp.status);
-		m_add_u32(p_smtp, q->smtp.code);
+		p = smtp_worker_for(q->session->id);
+		m_create(p, IMSG_MFA_SMTP_RESPONSE, 0, 0, -1);
+		m_add_id(p, q->session->id);
+		m_add_int(p, q->smtp.status);
+		m_add_u32(p, q->smtp.code);
 		if (q->smtp.response)
-			m_add_string(p_smtp, q->smtp.response);
-		m_close(p_smtp);
+			m_add_string(p, q->smtp.response);
+		m_close(p);
 
 		free(q->smtp.response);
 	}
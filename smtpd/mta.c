@@ -23,11 +23,16 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <netinet/in.h>
 
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <event.h>
+#include <fcntl.h>
 #include <imsg.h>
 #include <inttypes.h>
 #include <netdb.h>
@@ -53,10 +58,16 @@
 #define DELAY_ROUTE_BASE	200
 #define DELAY_ROUTE_MAX		(3600 * 4)
 
+#define	WINDOW_INITIAL		4	/* connections per domain at start */
+#define	WINDOW_BACKOFF_DELAY	10	/* min delay between two decreases */
+#define	WINDOW_LATENCY_SLACK	2	/* latency jump that stops growth */
+#define	RATE_PERIOD		60
+
 static void mta_imsg(struct mproc *, struct imsg *);
 static void mta_shutdown(void);
 static void mta_sig_handler(int, short, void *);
 
+static void mta_prefetch(struct mta_relay *);
 static void mta_query_mx(struct mta_relay *);
 static void mta_query_secret(struct mta_relay *);
 static void mta_query_preference(struct mta_relay *);
@@ -67,6 +78,12 @@ static void mta_on_preference(struct mta_relay *, int, int);
 static void mta_on_source(struct mta_relay *, struct mta_source *);
 static void mta_on_timeout(struct runq *, void *);
 static void mta_connect(struct mta_connector *);
+static void mta_connector_use(struct mta_connector *, struct mta_route *);
+static void mta_connector_release(struct mta_connector *, struct mta_route *);
+static int mta_strequal(const char *, const char *);
+static size_t mta_domain_window(struct mta_domain *, struct mta_limits *);
+static void mta_domain_rate(struct mta_domain *, time_t);
+static time_t mta_bucket_delay(struct mta_bucket *, size_t, time_t);
 static void mta_route_enable(struct mta_route *);
 static void mta_route_disable(struct mta_route *, int, int);
 static void mta_drain(struct mta_relay *);
@@ -110,13 +127,14 @@ SPLAY_PROTOTYPE(mta_source_tree, mta_source, entry, mta_source_cmp);
 static struct mta_connector *mta_connector(struct mta_relay *,
     struct mta_source *);
 static void mta_connector_free(struct mta_connector *);
+static void mta_connector_index(struct mta_connector *);
+static void mta_connector_unindex(struct mta_connector *);
 static const char *mta_connector_to_text(struct mta_connector *);
 
 SPLAY_HEAD(mta_route_tree, mta_route);
 static struct mta_route *mta_route(struct mta_source *, struct mta_host *);
 static void mta_route_ref(struct mta_route *);
 static void mta_route_unref(struct mta_route *);
-static const char *mta_route_to_text(struct mta_route *);
 static int mta_route_cmp(const struct mta_route *, const struct mta_route *);
 SPLAY_PROTOTYPE(mta_route_tree, mta_route, entry, mta_route_cmp);
 
@@ -143,16 +161,132 @@ static time_t	max_seen_discdelay_route;
 struct hoststat {
 	char			 name[SMTPD_MAXHOSTNAMELEN];
 	time_t			 tm;
+	time_t			 until;
 	char			 error[SMTPD_MAXLINESIZE];
 	struct tree		 deferred;
 };
 static struct dict hoststat;
 
+/*
+ * The host status and the route penalties are saved to a file in the
+ * spool, and restored when the process starts, so that a restart does
+ * not lead to retrying all the destinations known to be down.  The file
+ * is a sequence of records, each followed by its payload: the domain and
+ * error strings for a host status, the source and destination addresses
+ * for a route.  A source with a zero length is the default source.
+ */
+#define	PATH_HOSTSTAT		"/hoststat"
+#define	HOSTSTAT_SAVE_DELAY	60
+
+#define	HOSTSTAT_RECORD_HOST	1
+#define	HOSTSTAT_RECORD_ROUTE	2
+
+struct hoststat_record {
+	uint8_t			 type;
+	uint8_t			 penalty;
+	uint16_t		 len;
+	uint32_t		 flags;
+	int64_t			 tm;
+	int64_t			 until;
+};
+
+static int		hoststat_fd = -1;
+static int		hoststat_dirty;
+static struct event	hoststat_ev;
+
 void mta_hoststat_update(const char *, const char *);
 void mta_hoststat_cache(const char *, uint64_t);
 void mta_hoststat_uncache(const char *, uint64_t);
 void mta_hoststat_reschedule(const char *);
 static void mta_hoststat_remove_entry(struct hoststat *);
+static void mta_hoststat_hold(const char *, time_t);
+static void mta_hoststat_notify(const char *, time_t);
+static void mta_hoststat_open(void);
+static void mta_hoststat_load(void);
+static void mta_hoststat_load_host(struct hoststat_record *, const char *);
+static void mta_hoststat_load_route(struct hoststat_record *, const char *);
+static void mta_hoststat_save(void);
+static void mta_hoststat_changed(void);
+static void mta_hoststat_timeout(int, short, void *);
+static time_t mta_relay_holdtime(struct mta_relay *);
+
+/*
+ * MX lookup results are cached for the whole process, keyed by domain,
+ * so that new relays to a known destination do not have to go through
+ * the lka again.  Positive answers are served for a while after they
+ * expired, and revalidated in the background.
+ */
+#define	MXCACHE_TTL_DEFAULT	300
+#define	MXCACHE_TTL_MIN		30
+#define	MXCACHE_TTL_MAX		(24 * 3600)
+#define	MXCACHE_NEGTTL_DEFAULT	60
+#define	MXCACHE_NEGTTL_MAX	900
+#define	MXCACHE_STALE		3600
+
+struct mxcache_mx {
+	struct sockaddr_storage	 ss;
+	int			 preference;
+};
+
+struct mxcache {
+	char			 key[SMTPD_MAXHOSTNAMELEN + 2];
+	char			*name;
+	int			 flags;
+	int			 error;
+	time_t			 expire;
+	int			 refresh;
+	size_t			 hits;
+	size_t			 nmx;
+	struct mxcache_mx	*mxs;
+	size_t			 npending;
+	struct mxcache_mx	*pending;
+};
+static struct dict mxcache;
+static struct tree wait_mxcache;
+static struct runq *runq_mxcache;
+
+static int mta_mxcache_lookup(struct mta_domain *);
+static void mta_mxcache_update(struct mta_domain *, uint32_t);
+static void mta_mxcache_refreshed(struct mxcache *, int, uint32_t);
+static void mta_mxcache_set(struct mxcache *, int, uint32_t);
+static void mta_mxcache_add(struct mxcache_mx **, size_t *,
+    const struct sockaddr *, int);
+static void mta_mxcache_key(char *, size_t, const char *, int);
+static const char *mta_mxcache_to_text(struct mxcache *);
+static void mta_mx_error(struct mta_relay *, struct mta_domain *);
+
+/*
+ * With several mta workers, the connections to each host and from each
+ * source are counted in memory shared by all the workers, so that the
+ * limits apply to the connections of the whole daemon.  Addresses that
+ * hash to the same slot share a counter, which can only make the limits
+ * stricter.
+ */
+#define	MTA_COUNTERS		16384
+
+struct mta_counters {
+	volatile uint32_t	host[MTA_COUNTERS];
+	volatile uint32_t	source[MTA_COUNTERS];
+};
+static struct mta_counters *counters;
+
+static uint32_t mta_sa_hash(const struct sockaddr *);
+static void mta_counters_add(struct mta_route *, int);
+static size_t mta_source_nconn(struct mta_source *);
+
+/*
+ * The queue remembers the worker in charge of the first MX of recently
+ * seen domains, so that domains sharing their MXs go to the same worker.
+ */
+#define	MTA_AFFINITY		4096
+
+static struct {
+	uint32_t	hash;
+	int		worker;		/* plus one, 0 if unset */
+} affinity[MTA_AFFINITY];
+
+static uint32_t mta_name_hash(const char *);
+static void mta_domain_shard(struct mta_domain *);
 
 
 void
@@ -164,13 +298,16 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 	struct mta_route	*route;
 	struct mta_mx		*mx, *imx;
 	struct hoststat		*hs;
+	struct mxcache		*mxc;
 	struct mta_envelope	*e;
+	struct mta_domain	*d;
 	struct sockaddr_storage	 ss;
 	struct envelope		 evp;
 	struct msg		 m;
 	const char		*secret;
 	const char		*hostname;
 	uint64_t		 reqid;
+	uint32_t		 ttl;
 	time_t			 t;
 	char			 buf[SMTPD_MAXLINESIZE];
 	int			 dnserror, preference, v, status;
@@ -229,6 +366,16 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			mta_relay_unref(relay); /* from here */
 			return;
 
+		case IMSG_MTA_PREFETCH:
+			m_msg(&m, imsg);
+			m_get_envelope(&m, &evp);
+			m_end(&m);
+
+			relay = mta_relay(&evp);
+			mta_prefetch(relay);
+			mta_relay_unref(relay); /* from here */
+			return;
+
 		case IMSG_QUEUE_MESSAGE_FD:
 			mta_session_imsg(p, imsg);
 			return;
@@ -270,10 +417,17 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_get_sockaddr(&m, (struct sockaddr*)&ss);
 			m_get_int(&m, &preference);
 			m_end(&m);
+			if ((mxc = tree_get(&wait_mxcache, reqid))) {
+				mta_mxcache_add(&mxc->pending, &mxc->npending,
+				    (struct sockaddr*)&ss, preference);
+				return;
+			}
 			domain = tree_xget(&wait_mx, reqid);
 			mx = xcalloc(1, sizeof *mx, "mta: mx");
 			mx->host = mta_host((struct sockaddr*)&ss);
 			mx->preference = preference;
+			mx->domain = domain;
+			TAILQ_INSERT_TAIL(&mx->host->mxs, mx, host_entry);
 			TAILQ_FOREACH(imx, &domain->mxs, entry) {
 				if (imx->preference > mx->preference) {
 					TAILQ_INSERT_BEFORE(imx, mx, entry);
@@ -287,9 +441,17 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_get_int(&m, &dnserror);
+			m_get_u32(&m, &ttl);
 			m_end(&m);
+			if ((mxc = tree_pop(&wait_mxcache, reqid))) {
+				mta_mxcache_refreshed(mxc, dnserror, ttl);
+				return;
+			}
 			domain = tree_xpop(&wait_mx, reqid);
 			domain->mxstatus = dnserror;
+			mta_mxcache_update(domain, ttl);
+			domain->mxgen++;
+			mta_domain_shard(domain);
 			if (domain->mxstatus == DNS_OK) {
 				log_debug("debug: MXs for domain %s:",
 				    domain->name);
@@ -372,7 +534,8 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			SPLAY_FOREACH(route, mta_route_tree, &routes) {
 				v = runq_pending(runq_route, NULL, route, &t);
 				snprintf(buf, sizeof(buf),
-				    "%llu. %s %c%c%c%c nconn=%zu penalty=%i timeout=%s",
+				    "%llu. %s %c%c%c%c nconn=%zu penalty=%i timeout=%s"
+				    " tls=%zu resumed=%zu maxsize=%zu",
 				    (unsigned long long)route->id,
 				    mta_route_to_text(route),
 				    route->flags & ROUTE_NEW ? 'N' : '-',
@@ -381,7 +544,10 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 				    route->flags & ROUTE_KEEPALIVE ? 'K' : '-',
 				    route->nconn,
 				    route->penalty,
-				    v ? duration_to_text(t - time(NULL)) : "-");
+				    v ? duration_to_text(t - time(NULL)) : "-",
+				    route->ntls,
+				    route->ntlsresumed,
+				    route->maxsize);
 				m_compose(p, IMSG_CTL_MTA_SHOW_ROUTES,
 				    imsg->hdr.peerid, 0, -1,
 				    buf, strlen(buf) + 1);
@@ -405,6 +571,46 @@ mta_imsg(struct mproc *p, struct imsg *imsg)
 			    imsg->hdr.peerid,
 			    0, -1, NULL, 0);
 			return;
+
+		case IMSG_CTL_MTA_SHOW_MXCACHE:
+			iter = NULL;
+			while (dict_iter(&mxcache, &iter, NULL,
+				(void **)&mxc)) {
+				strlcpy(buf, mta_mxcache_to_text(mxc),
+				    sizeof(buf));
+				m_compose(p, IMSG_CTL_MTA_SHOW_MXCACHE,
+				    imsg->hdr.peerid, 0, -1,
+				    buf, strlen(buf) + 1);
+			}
+			m_compose(p, IMSG_CTL_MTA_SHOW_MXCACHE,
+			    imsg->hdr.peerid, 0, -1, NULL, 0);
+			return;
+
+		case IMSG_CTL_MTA_SHOW_RELAYS:
+			t = time(NULL);
+			SPLAY_FOREACH(relay, mta_relay_tree, &relays) {
+				d = relay->domain;
+				mta_domain_rate(d, t);
+				snprintf(buf, sizeof(buf),
+				    "%s nconn=%zu ntask=%zu window=%zu/%zu"
+				    " latency=%ums rate=%zu/min delivered=%zu"
+				    " throttled=%zu",
+				    mta_relay_to_text(relay),
+				    relay->nconn,
+				    relay->ntask,
+				    mta_domain_window(d, relay->limits),
+				    relay->limits->maxconn_per_domain,
+				    d->latency,
+				    d->rate,
+				    d->ndelivered,
+				    d->nthrottled);
+				m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS,
+				    imsg->hdr.peerid, 0, -1,
+				    buf, strlen(buf) + 1);
+			}
+			m_compose(p, IMSG_CTL_MTA_SHOW_RELAYS,
+			    imsg->hdr.peerid, 0, -1, NULL, 0);
+			return;
 		}
 	}
 
@@ -427,6 +633,8 @@ mta_sig_handler(int sig, short event, void *p)
 static void
 mta_shutdown(void)
 {
+	if (hoststat_dirty)
+		mta_hoststat_save();
 	log_info("info: mail transfer agent exiting");
 	_exit(0);
 }
@@ -453,12 +661,16 @@ mta(void)
 	if ((pw = getpwnam(SMTPD_USER)) == NULL)
 		fatalx("unknown user " SMTPD_USER);
 
+	mta_hoststat_open();
+
 	if (chroot(PATH_CHROOT) == -1)
 		fatal("mta: chroot");
 	if (chdir("/") == -1)
 		fatal("mta: chdir(\"/\")");
 
 	config_process(PROC_MTA);
+	if (env->sc_mta_workers > 1)
+		setproctitle("%s %d", proc_title(PROC_MTA), mta_worker);
 
 	if (setgroups(1, &pw->pw_gid) ||
 	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
@@ -476,6 +688,8 @@ mta(void)
 	tree_init(&wait_preference);
 	tree_init(&wait_source);
 	dict_init(&hoststat);
+	dict_init(&mxcache);
+	tree_init(&wait_mxcache);
 
 	imsg_callback = mta_imsg;
 	event_init();
@@ -484,6 +698,7 @@ mta(void)
 	runq_init(&runq_connector, mta_on_timeout);
 	runq_init(&runq_route, mta_on_timeout);
 	runq_init(&runq_hoststat, mta_on_timeout);
+	runq_init(&runq_mxcache, mta_on_timeout);
 
 	signal_set(&ev_sigint, SIGINT, mta_sig_handler, NULL);
 	signal_set(&ev_sigterm, SIGTERM, mta_sig_handler, NULL);
@@ -498,6 +713,9 @@ mta(void)
 	config_peer(PROC_CONTROL);
 	config_done();
 
+	evtimer_set(&hoststat_ev, mta_hoststat_timeout, NULL);
+	mta_hoststat_load();
+
 	if (event_dispatch() < 0)
 		fatal("event_dispatch");
 	mta_shutdown();
@@ -505,6 +723,193 @@ mta(void)
 	return (0);
 }
 
+/*
+ * Pick the mta worker in charge of the given envelope.  All envelopes
+ * for the same destination go to the same worker.  Once a worker knows
+ * the MXs of the destination, it may ask for its envelopes to be sent to
+ * the worker in charge of those MXs instead.
+ */
+int
+mta_worker_for(const struct envelope *evp)
+{
+	const char	*s;
+	uint32_t	 h;
+
+	if (env->sc_mta_workers <= 1)
+		return (0);
+
+	if (evp->agent.mta.relay.hostname[0])
+		s = evp->agent.mta.relay.hostname;
+	else
+		s = evp->dest.domain;
+
+	h = mta_name_hash(s);
+	if (affinity[h % MTA_AFFINITY].worker &&
+	    affinity[h % MTA_AFFINITY].hash == h)
+		return (affinity[h % MTA_AFFINITY].worker - 1);
+
+	return (h % env->sc_mta_workers);
+}
+
+/*
+ * Called by the queue when a worker tells which worker should handle
+ * the given destination.
+ */
+void
+mta_worker_assign(const char *name, int worker)
+{
+	uint32_t	h;
+
+	if (worker < 0 || worker >= env->sc_mta_workers)
+		return;
+
+	h = mta_name_hash(name);
+	affinity[h % MTA_AFFINITY].hash = h;
+	affinity[h % MTA_AFFINITY].worker = worker + 1;
+}
+
+static uint32_t
+mta_name_hash(const char *s)
+{
+	uint32_t	h;
+
+	/* FNV-1a */
+	h = 2166136261U;
+	for (; *s; s++) {
+		h ^= (unsigned char)tolower((unsigned char)*s);
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+/*
+ * The MXs of the domain are known.  Hand the domain over to the worker
+ * in charge of its first MX, so that it sees all the connections to that
+ * host and can share sessions with the other domains it serves.  The
+ * envelopes already received are still delivered here.
+ */
+static void
+mta_domain_shard(struct mta_domain *domain)
+{
+	struct mta_mx	*mx;
+	uint32_t	 h, min;
+	int		 preference, worker;
+
+	if (env->sc_mta_workers <= 1 || domain->mxstatus != DNS_OK ||
+	    (mx = TAILQ_FIRST(&domain->mxs)) == NULL)
+		return;
+
+	/* The order of MXs of the same preference changes between queries */
+	preference = mx->preference;
+	min = mta_sa_hash(mx->host->sa);
+	while ((mx = TAILQ_NEXT(mx, entry)) && mx->preference == preference)
+		if ((h = mta_sa_hash(mx->host->sa)) < min)
+			min = h;
+
+	worker = min % env->sc_mta_workers;
+	if (worker == mta_worker)
+		return;
+
+	log_debug("debug: mta: handing domain %s over to mta worker %d",
+	    domain->name, worker);
+	m_create(p_queue, IMSG_MTA_SHARD, 0, 0, -1);
+	m_add_string(p_queue, domain->name);
+	m_add_int(p_queue, worker);
+	m_close(p_queue);
+}
+
+/*
+ * Called by the parent before forking the mta workers, and again once
+ * they are forked to release the memory.
+ */
+void
+mta_counters_init(void)
+{
+	if (env->sc_mta_workers <= 1)
+		return;
+
+	counters = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (counters == MAP_FAILED)
+		fatal("mta_counters_init: mmap");
+}
+
+void
+mta_counters_free(void)
+{
+	if (counters == NULL)
+		return;
+
+	munmap(counters, sizeof(*counters));
+	counters = NULL;
+}
+
+static uint32_t
+mta_sa_hash(const struct sockaddr *sa)
+{
+	const unsigned char	*p;
+	size_t			 len;
+	uint32_t		 h;
+
+	/* FNV-1a on the address only */
+	h = 2166136261U;
+	if (sa == NULL)
+		return (h);
+	if (sa->sa_family == AF_INET) {
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in *)sa)->sin_addr;
+		len = sizeof(struct in_addr);
+	}
+	else if (sa->sa_family == AF_INET6) {
+		p = (const unsigned char *)
+		    &((const struct sockaddr_in6 *)sa)->sin6_addr;
+		len = sizeof(struct in6_addr);
+	}
+	else
+		return (h);
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static void
+mta_counters_add(struct mta_route *route, int n)
+{
+	if (counters == NULL)
+		return;
+
+	(void)__sync_add_and_fetch(
+	    &counters->host[mta_sa_hash(route->dst->sa) % MTA_COUNTERS], n);
+	(void)__sync_add_and_fetch(
+	    &counters->source[mta_sa_hash(route->src->sa) % MTA_COUNTERS], n);
+}
+
+/*
+ * Number of connections to the host, made by all the workers.
+ */
+size_t
+mta_host_nconn(struct mta_host *host)
+{
+	if (counters == NULL)
+		return (host->nconn);
+
+	return (counters->host[mta_sa_hash(host->sa) % MTA_COUNTERS]);
+}
+
+static size_t
+mta_source_nconn(struct mta_source *source)
+{
+	if (counters == NULL)
+		return (source->nconn);
+
+	return (counters->source[mta_sa_hash(source->sa) % MTA_COUNTERS]);
+}
+
 /*
  * Local error on the given source.
  */
@@ -544,6 +949,7 @@ mta_route_error(struct mta_relay *relay, struct mta_route *route)
 		log_info("smtp-out: Too many errors on host %s: ignoring this MX",
 		    mta_host_to_text(route->dst));
 		route->dst->flags |= HOST_IGNORE;
+		mta_index_update(route);
 	}
 }
 
@@ -559,6 +965,7 @@ mta_route_ok(struct mta_relay *relay, struct mta_route *route)
 	    mta_route_to_text(route));
 
 	route->flags &= ~ROUTE_NEW;
+	mta_index_update(route);
 
 	c = mta_connector(relay, route->src);
 	mta_connect(c);
@@ -570,6 +977,20 @@ mta_route_down(struct mta_relay *relay, struct mta_route *route)
 	mta_route_disable(route, 2, ROUTE_DISABLED_SMTP);
 }
 
+/*
+ * A connection on this route timed out or was refused.  Only penalize
+ * the route: the other MXs of the domain may be fine.  A new route is
+ * penalized when the session is collected.
+ */
+void
+mta_route_unreachable(struct mta_relay *relay, struct mta_route *route)
+{
+	if (route->flags & ROUTE_NEW)
+		return;
+
+	mta_route_disable(route, 1, ROUTE_DISABLED_NET);
+}
+
 void
 mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 {
@@ -578,38 +999,247 @@ mta_route_collect(struct mta_relay *relay, struct mta_route *route)
 	log_debug("debug: mta_route_collect(%s)",
 	    mta_route_to_text(route));
 
-	relay->nconn -= 1;
-	relay->domain->nconn -= 1;
-	route->nconn -= 1;
-	route->src->nconn -= 1;
-	route->dst->nconn -= 1;
+	c = mta_connector(relay, route->src);
 	route->lastdisc = time(NULL);
+	mta_connector_release(c, route);
 
 	/* First connection failed */
 	if (route->flags & ROUTE_NEW)
 		mta_route_disable(route, 2, ROUTE_DISABLED_NET);
 
-	c = mta_connector(relay, route->src);
-	c->nconn -= 1;
 	mta_connect(c);
 	mta_route_unref(route); /* from mta_find_route() */
 	mta_relay_unref(relay); /* from mta_connect() */
 }
 
+/*
+ * A connection attempt was abandoned because another one won the race.
+ * If it was slower than the winner, the route gets a penalty so that the
+ * next connections do not pick it again right away.
+ */
+void
+mta_route_cancel(struct mta_relay *relay, struct mta_route *route,
+    int penalty)
+{
+	struct mta_connector	*c;
+
+	log_debug("debug: mta_route_cancel(%s)",
+	    mta_route_to_text(route));
+
+	c = mta_connector(relay, route->src);
+	mta_connector_release(c, route);
+	if (penalty)
+		mta_route_disable(route, penalty, ROUTE_DISABLED_NET);
+	mta_connect(c);
+	mta_route_unref(route); /* from mta_route_race() or mta_find_route() */
+	mta_relay_unref(relay); /* from mta_connector_use() */
+}
+
+/*
+ * A message was accepted by the destination.  Open the connection
+ * window by one once a full window of messages went through without
+ * the transaction latency jumping up.
+ */
+void
+mta_relay_delivered(struct mta_relay *relay, uint32_t msec)
+{
+	struct mta_domain	*d = relay->domain;
+	size_t			 window;
+	int			 stable;
+
+	d->ndelivered += 1;
+	d->ratecount += 1;
+	mta_domain_rate(d, time(NULL));
+
+	stable = (d->latency == 0 ||
+	    msec <= d->latency * WINDOW_LATENCY_SLACK);
+	if (d->latency == 0)
+		d->latency = msec;
+	else
+		d->latency = (d->latency * 7 + msec) / 8;
+
+	if (!relay->limits->adaptive)
+		return;
+
+	window = mta_domain_window(d, relay->limits);
+	if (!stable) {
+		d->winsuccess = 0;
+		return;
+	}
+
+	/* Only grow a window that is actually used. */
+	if (d->nconn < window || window >= relay->limits->maxconn_per_domain)
+		return;
+
+	if (++d->winsuccess >= window) {
+		d->window = window + 1;
+		d->winsuccess = 0;
+		log_debug("debug: mta: window for domain %s is now %zu",
+		    d->name, d->window);
+	}
+}
+
+/*
+ * The destination asked us to slow down, or could not be reached.
+ * Halve the connection window, at most once per backoff delay so that
+ * the sessions hit by the same event do not collapse it.
+ */
+void
+mta_relay_throttled(struct mta_relay *relay)
+{
+	struct mta_domain	*d = relay->domain;
+	size_t			 window;
+	time_t			 now;
+
+	d->nthrottled += 1;
+	stat_increment("mta.throttled", 1);
+
+	if (!relay->limits->adaptive)
+		return;
+
+	now = time(NULL);
+	if (d->lastbackoff + WINDOW_BACKOFF_DELAY > now)
+		return;
+	d->lastbackoff = now;
+
+	window = mta_domain_window(d, relay->limits);
+	d->window = window > 1 ? window / 2 : 1;
+	d->winsuccess = 0;
+	log_info("smtp-out: Throttled by domain %s: "
+	    "connection window reduced to %zu", d->name, d->window);
+}
+
+static size_t
+mta_domain_window(struct mta_domain *d, struct mta_limits *l)
+{
+	if (!l->adaptive)
+		return (l->maxconn_per_domain);
+
+	if (d->window == 0)
+		d->window = WINDOW_INITIAL;
+	if (d->window > l->maxconn_per_domain)
+		d->window = l->maxconn_per_domain;
+
+	return (d->window);
+}
+
+static void
+mta_domain_rate(struct mta_domain *d, time_t now)
+{
+	if (d->ratestart == 0) {
+		d->ratestart = now;
+		return;
+	}
+	if (now - d->ratestart < RATE_PERIOD)
+		return;
+
+	d->rate = d->ratecount * 60 / (now - d->ratestart);
+	d->ratecount = 0;
+	d->ratestart = now;
+}
+
 struct mta_task *
 mta_route_next_task(struct mta_relay *relay, struct mta_route *route)
 {
-	struct mta_task	*task;
+	struct mta_task		*task;
+	struct mta_envelope	*e;
+	size_t			 n;
 
 	if ((task = TAILQ_FIRST(&relay->tasks))) {
 		TAILQ_REMOVE(&relay->tasks, task, entry);
 		relay->ntask -= 1;
 		task->relay = NULL;
+
+		n = 0;
+		TAILQ_FOREACH(e, &task->envelopes, entry)
+			n++;
+		mta_relay_charge(relay, 1, n, 0);
 	}
 
 	return (task);
 }
 
+/*
+ * Return the number of seconds to wait before the next message can be
+ * sent to the destination of this relay, or 0 if it can be sent now.
+ */
+time_t
+mta_relay_shaped(struct mta_relay *relay)
+{
+	struct mta_domain	*d = relay->domain;
+	struct mta_limits	*l = relay->limits;
+	time_t			 now, delay, t;
+
+	if (l == NULL)
+		return (0);
+
+	now = time(NULL);
+	delay = mta_bucket_delay(&d->bucket_mail, l->maxmail_per_second, now);
+	t = mta_bucket_delay(&d->bucket_rcpt, l->maxrcpt_per_second, now);
+	if (t > delay)
+		delay = t;
+	t = mta_bucket_delay(&d->bucket_bytes, l->maxbytes_per_second, now);
+	if (t > delay)
+		delay = t;
+
+	return (delay);
+}
+
+/*
+ * Take tokens from the buckets of the destination.  Levels may go
+ * negative, so that a large message or a long recipient list is paid
+ * for by delaying the following ones.
+ */
+void
+mta_relay_charge(struct mta_relay *relay, size_t nmail, size_t nrcpt,
+    size_t nbytes)
+{
+	struct mta_domain	*d = relay->domain;
+	struct mta_limits	*l = relay->limits;
+	time_t			 now;
+
+	if (l == NULL)
+		return;
+
+	now = time(NULL);
+	if (l->maxmail_per_second) {
+		mta_bucket_delay(&d->bucket_mail, l->maxmail_per_second, now);
+		d->bucket_mail.level -= nmail;
+	}
+	if (l->maxrcpt_per_second) {
+		mta_bucket_delay(&d->bucket_rcpt, l->maxrcpt_per_second, now);
+		d->bucket_rcpt.level -= nrcpt;
+	}
+	if (l->maxbytes_per_second) {
+		mta_bucket_delay(&d->bucket_bytes, l->maxbytes_per_second, now);
+		d->bucket_bytes.level -= nbytes;
+	}
+}
+
+/*
+ * Refill the bucket for the time elapsed, allowing a burst of one
+ * second, and return how long to wait until it has a token again.
+ */
+static time_t
+mta_bucket_delay(struct mta_bucket *b, size_t rate, time_t now)
+{
+	if (rate == 0)
+		return (0);
+
+	if (b->last == 0)
+		b->level = rate;
+	else if (now > b->last)
+		b->level += (int64_t)rate * (now - b->last);
+	if (b->level > (int64_t)rate)
+		b->level = rate;
+	b->last = now;
+
+	if (b->level > 0)
+		return (0);
+
+	return (1 + (-b->level) / rate);
+}
+
 void
 mta_delivery_log(struct mta_envelope *e, const char *source, const char *relay,
     int delivery, const char *status)
@@ -658,6 +1288,24 @@ mta_delivery(struct mta_envelope *e, const char *source, const char *relay,
 	mta_delivery_notify(e, delivery, status, penalty);
 }
 
+/*
+ * An envelope for this relay will be scheduled soon.  Resolve the MXs of
+ * the domain now: the answer ends up in the MX cache, and is used when
+ * the envelope is transferred.
+ */
+static void
+mta_prefetch(struct mta_relay *relay)
+{
+	if (relay->domain->lastmxquery)
+		return;
+
+	log_debug("debug: mta: prefetching MX for %s",
+	    mta_relay_to_text(relay));
+	stat_increment("mta.prefetch", 1);
+
+	mta_query_mx(relay);
+}
+
 static void
 mta_query_mx(struct mta_relay *relay)
 {
@@ -666,6 +1314,16 @@ mta_query_mx(struct mta_relay *relay)
 	if (relay->status & RELAY_WAIT_MX)
 		return;
 
+	if (mta_mxcache_lookup(relay->domain)) {
+		log_debug("debug: mta: got cached MX for %s",
+		    mta_relay_to_text(relay));
+		relay->domain->lastmxquery = time(NULL);
+		relay->domain->mxgen++;
+		mta_domain_shard(relay->domain);
+		mta_mx_error(relay, relay->domain);
+		return;
+	}
+
 	log_debug("debug: mta: querying MX for %s...",
 	    mta_relay_to_text(relay));
 
@@ -772,6 +1430,16 @@ mta_on_mx(void *tag, void *arg, void *data)
 	log_debug("debug: mta: ... got mx (%p, %s, %s)",
 	    tag, domain->name, mta_relay_to_text(relay));
 
+	mta_mx_error(relay, domain);
+
+	relay->status &= ~RELAY_WAIT_MX;
+	mta_drain(relay);
+	mta_relay_unref(relay); /* from mta_drain() */
+}
+
+static void
+mta_mx_error(struct mta_relay *relay, struct mta_domain *domain)
+{
 	switch (domain->mxstatus) {
 	case DNS_OK:
 		break;
@@ -799,11 +1467,7 @@ mta_on_mx(void *tag, void *arg, void *data)
 	if (domain->mxstatus)
 		log_info("smtp-out: Failed to resolve MX for %s: %s",
 		    mta_relay_to_text(relay), relay->failstr);
-
-	relay->status &= ~RELAY_WAIT_MX;
-	mta_drain(relay);
-	mta_relay_unref(relay); /* from mta_drain() */
-}
+}
 
 static void
 mta_on_secret(struct mta_relay *relay, const char *secret)
@@ -943,6 +1607,12 @@ mta_connect(struct mta_connector *c)
 		return;
 	}
 
+	/* Existing sessions will wait for the rate limits. */
+	if (c->relay->nconn && mta_relay_shaped(c->relay)) {
+		log_debug("debug: mta: rate limited");
+		return;
+	}
+
 	limits = 0;
 	nextconn = now = time(NULL);
 
@@ -952,8 +1622,10 @@ mta_connect(struct mta_connector *c)
 		    (unsigned long long) c->relay->domain->lastconn + l->conndelay_domain - now);
 		nextconn = c->relay->domain->lastconn + l->conndelay_domain;
 	}
-	if (c->relay->domain->nconn >= l->maxconn_per_domain) {
-		log_debug("debug: mta: hit domain limit");
+	if (c->relay->domain->nconn >=
+	    mta_domain_window(c->relay->domain, l)) {
+		log_debug("debug: mta: hit domain limit (window %zu)",
+		    c->relay->domain->window);
 		limits |= CONNECTOR_LIMIT_DOMAIN;
 	}
 
@@ -963,7 +1635,7 @@ mta_connect(struct mta_connector *c)
 		    (unsigned long long) c->source->lastconn + l->conndelay_source - now);
 		nextconn = c->source->lastconn + l->conndelay_source;
 	}
-	if (c->source->nconn >= l->maxconn_per_source) {
+	if (mta_source_nconn(c->source) >= l->maxconn_per_source) {
 		log_debug("debug: mta: hit source limit");
 		limits |= CONNECTOR_LIMIT_SOURCE;
 	}
@@ -1025,6 +1697,15 @@ mta_connect(struct mta_connector *c)
 	log_debug("debug: mta-routing: spawning new connection on %s",
 		    mta_route_to_text(route));
 
+	mta_connector_use(c, route);
+	mta_session(c->relay, route);	/* this never fails synchronously */
+
+    goto again;
+}
+
+static void
+mta_connector_use(struct mta_connector *c, struct mta_route *route)
+{
 	c->nconn += 1;
 	c->lastconn = time(NULL);
 
@@ -1038,11 +1719,186 @@ mta_connect(struct mta_connector *c)
 	route->src->lastconn = c->lastconn;
 	route->dst->nconn += 1;
 	route->dst->lastconn = c->lastconn;
+	mta_counters_add(route, 1);
+	mta_index_update(route);
 
-	mta_session(c->relay, route);	/* this never fails synchronously */
 	mta_relay_ref(c->relay);
+}
 
-    goto again;
+static void
+mta_connector_release(struct mta_connector *c, struct mta_route *route)
+{
+	c->nconn -= 1;
+	c->relay->nconn -= 1;
+	c->relay->domain->nconn -= 1;
+	route->nconn -= 1;
+	route->src->nconn -= 1;
+	route->dst->nconn -= 1;
+	mta_counters_add(route, -1);
+	mta_index_update(route);
+}
+
+/*
+ * A connection attempt on the given route is slow.  Find another route
+ * of the same connector to try in parallel, preferably to a host of the
+ * other address family, and account for the new connection.
+ */
+struct mta_route *
+mta_route_race(struct mta_relay *relay, struct mta_route *current)
+{
+	struct mta_connector	*c;
+	struct mta_limits	*l = relay->limits;
+	struct mta_route	*route;
+	struct mta_host		*host;
+	size_t			 i;
+	int			 pass;
+
+	c = mta_connector(relay, current->src);
+	if (c->flags & CONNECTOR_ERROR)
+		return (NULL);
+	if (c->indexed != relay->domain->mxgen)
+		mta_connector_index(c);
+
+	if (relay->nconn >= l->maxconn_per_relay ||
+	    relay->domain->nconn >= mta_domain_window(relay->domain, l) ||
+	    c->nconn >= l->maxconn_per_connector ||
+	    mta_source_nconn(c->source) >= l->maxconn_per_source)
+		return (NULL);
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < c->ncandidates; i++) {
+			route = c->candidates[i].route;
+			host = route->dst;
+			if (host == current->dst)
+				continue;
+			if (pass == 0 &&
+			    host->sa->sa_family == current->dst->sa->sa_family)
+				continue;
+			if (host->flags & HOST_IGNORE)
+				continue;
+			if (route->flags & ROUTE_DISABLED)
+				continue;
+			if (route->nconn && (route->flags & ROUTE_NEW))
+				continue;
+			if (mta_host_nconn(host) >= l->maxconn_per_host ||
+			    route->nconn >= l->maxconn_per_route)
+				continue;
+
+			log_debug("debug: mta-routing: racing %s with %s",
+			    mta_route_to_text(current),
+			    mta_route_to_text(route));
+			mta_route_ref(route);
+			mta_connector_use(c, route);
+			return (route);
+		}
+	}
+
+	return (NULL);
+}
+
+static int
+mta_strequal(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+/*
+ * Tell whether a session opened for a relay on the given route could be
+ * used to deliver the tasks of another relay.  Both relays must use the
+ * same connection parameters, the route must lead to one of the MXs of
+ * the other relay, and that relay must be allowed another connection.
+ * The session must not have sent as many messages as the other relay
+ * allows for one session.
+ */
+int
+mta_route_shareable(struct mta_relay *from, struct mta_relay *to,
+    struct mta_route *route, size_t msgcount)
+{
+	struct mta_connector	*c;
+	struct mta_limits	*l = to->limits;
+	struct mta_mx		*mx;
+
+	if (to == from || to->ntask == 0 || to->fail || l == NULL)
+		return (0);
+	if (msgcount >= l->max_mail_per_session)
+		return (0);
+	if (to->status & (RELAY_WAIT_PREFERENCE | RELAY_WAIT_SECRET))
+		return (0);
+
+	if (to->flags != from->flags ||
+	    to->port != from->port ||
+	    !mta_strequal(to->cert, from->cert) ||
+	    !mta_strequal(to->authtable, from->authtable) ||
+	    !mta_strequal(to->authlabel, from->authlabel) ||
+	    !mta_strequal(to->secret, from->secret) ||
+	    !mta_strequal(to->sourcetable, from->sourcetable) ||
+	    !mta_strequal(to->helotable, from->helotable) ||
+	    !mta_strequal(to->heloname, from->heloname))
+		return (0);
+
+	TAILQ_FOREACH(mx, &to->domain->mxs, entry) {
+		if (to->backupname && mx->preference >= to->backuppref)
+			return (0);
+		if (mx->host == route->dst)
+			break;
+	}
+	if (mx == NULL)
+		return (0);
+
+	if (to->nconn >= l->maxconn_per_relay ||
+	    to->domain->nconn >= mta_domain_window(to->domain, l))
+		return (0);
+
+	c = mta_connector(to, route->src);
+	if (c->flags & CONNECTOR_ERROR ||
+	    c->nconn >= l->maxconn_per_connector)
+		return (0);
+
+	if (mta_relay_shaped(to))
+		return (0);
+
+	return (1);
+}
+
+/*
+ * A session on the given route has nothing left to do for its relay.
+ * Find another relay with pending tasks that can use it, among the
+ * relays of the domains that have the host of the route as MX.
+ */
+struct mta_relay *
+mta_route_share(struct mta_relay *relay, struct mta_route *route,
+    size_t msgcount)
+{
+	struct mta_relay	*r;
+	struct mta_mx		*mx;
+
+	TAILQ_FOREACH(mx, &route->dst->mxs, host_entry)
+		TAILQ_FOREACH(r, &mx->domain->relays, domain_entry)
+			if (mta_route_shareable(relay, r, route, msgcount))
+				return (r);
+
+	return (NULL);
+}
+
+/*
+ * Move the accounting of a session on the given route from one relay to
+ * the other.  The reference held on the first relay is dropped.
+ */
+void
+mta_route_transfer(struct mta_relay *from, struct mta_relay *to,
+    struct mta_route *route)
+{
+	log_debug("debug: mta-routing: sharing %s from %s",
+	    mta_route_to_text(route), mta_relay_to_text(from));
+	log_debug("debug: mta-routing: ... to %s", mta_relay_to_text(to));
+
+	mta_connector_release(mta_connector(from, route->src), route);
+	mta_connector_use(mta_connector(to, route->src), route);
+	stat_increment("mta.session.shared", 1);
+
+	mta_relay_unref(from); /* from mta_connector_use() */
 }
 
 static void
@@ -1052,6 +1908,7 @@ mta_on_timeout(struct runq *runq, void *arg)
 	struct mta_relay	*relay = arg;
 	struct mta_route	*route = arg;
 	struct hoststat		*hs = arg;
+	struct mxcache		*mxc;
 
 	if (runq == runq_relay) {
 		log_debug("debug: mta: ... timeout for %s",
@@ -1077,6 +1934,20 @@ mta_on_timeout(struct runq *runq, void *arg)
 		mta_hoststat_remove_entry(hs);
 		free(hs);
 	}
+	else if (runq == runq_mxcache) {
+		mxc = arg;
+		if (mxc->refresh) {
+			runq_schedule(runq_mxcache, time(NULL) + 60, NULL, mxc);
+			return;
+		}
+		log_debug("debug: mta: ... timeout for mxcache %s",
+		    mxc->name);
+		dict_xpop(&mxcache, mxc->key);
+		free(mxc->mxs);
+		free(mxc->name);
+		free(mxc);
+		stat_decrement("mta.mxcache.entry", 1);
+	}
 }
 
 static void
@@ -1101,8 +1972,10 @@ mta_route_disable(struct mta_route *route, int penalty, int reason)
 		mta_route_unref(route); /* from last call to here */
 	}
 	route->flags |= reason & ROUTE_DISABLED;
+	mta_index_update(route);
 	runq_schedule(runq_route, time(NULL) + delay, NULL, route);
 	mta_route_ref(route);
+	mta_hoststat_changed();
 }
 
 static void
@@ -1113,6 +1986,7 @@ mta_route_enable(struct mta_route *route)
 		    mta_route_to_text(route));
 		route->flags &= ~ROUTE_DISABLED;
 		route->flags |= ROUTE_NEW;
+		mta_index_update(route);
 	}
 	
 	if (route->penalty) {
@@ -1122,6 +1996,7 @@ mta_route_enable(struct mta_route *route)
 #else
 		route->penalty = 0;
 #endif
+		mta_hoststat_changed();
 	}
 }
 
@@ -1129,6 +2004,7 @@ static void
 mta_drain(struct mta_relay *r)
 {
 	char			 buf[64];
+	time_t			 delay;
 
 	log_debug("debug: mta: draining %s "
 	    "refcount=%i, ntask=%zu, nconnector=%zu, nconn=%zu", 
@@ -1160,8 +2036,14 @@ mta_drain(struct mta_relay *r)
 		mta_query_preference(r);
 
 	/* Query the domain MXs if needed. */
-	if (r->domain->lastmxquery == 0)
+	if (r->domain->lastmxquery == 0) {
 		mta_query_mx(r);
+		/* the answer may come from the cache */
+		if (r->fail) {
+			mta_flush(r, r->fail, r->failstr);
+			return;
+		}
+	}
 
 	/* Query the limits if needed. */
 	if (r->limits == NULL)
@@ -1185,6 +2067,25 @@ mta_drain(struct mta_relay *r)
 		return;
 	}
 
+	/*
+	 * Do not open new connections until the rate limits allow us to
+	 * send another message.
+	 */
+	if ((delay = mta_relay_shaped(r))) {
+		log_debug("debug: mta: rate limited on relay %s for %llus",
+		    mta_relay_to_text(r), (unsigned long long) delay);
+		runq_schedule(runq_relay, time(NULL) + delay, NULL, r);
+		r->status |= RELAY_WAIT_CONNECTOR;
+		mta_relay_ref(r);
+		return;
+	}
+
+	/*
+	 * Feed the idle sessions opened for other relays to the same MXs.
+	 */
+	while (r->nconn_ready < r->ntask && mta_session_share(r))
+		;
+
 	/*
 	 * We have pending task, and it's maybe time too try a new source.
 	 */
@@ -1210,6 +2111,7 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 	struct mta_connector	*c;
 	size_t			 n;
 	size_t			 r;
+	time_t			 until;
 
 	log_debug("debug: mta_flush(%s, %i, \"%s\")",
 	    mta_relay_to_text(relay), fail, error);
@@ -1217,6 +2119,10 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 	if (fail != IMSG_DELIVERY_TEMPFAIL && fail != IMSG_DELIVERY_PERMFAIL)
 		errx(1, "unexpected delivery status %i", fail);
 
+	until = 0;
+	if (fail == IMSG_DELIVERY_TEMPFAIL)
+		until = mta_relay_holdtime(relay);
+
 	n = 0;
 	while ((task = TAILQ_FIRST(&relay->tasks))) {
 		TAILQ_REMOVE(&relay->tasks, task, entry);
@@ -1238,8 +2144,12 @@ mta_flush(struct mta_relay *relay, int fail, const char *error)
 					if (c->flags & CONNECTOR_ERROR_ROUTE)
 						r++;
 				}
-				if (tree_count(&relay->connectors) == r)
+				if (tree_count(&relay->connectors) == r) {
 					mta_hoststat_cache(domain+1, e->id);
+					if (until)
+						mta_hoststat_hold(domain+1,
+						    until);
+				}
 			}
 
 			free(e->dest);
@@ -1263,184 +2173,49 @@ static struct mta_route *
 mta_find_route(struct mta_connector *c, time_t now, int *limits,
     time_t *nextconn)
 {
-	struct mta_route	*route, *best;
-	struct mta_limits	*l = c->relay->limits;
-	struct mta_mx		*mx;
-	int			 level, limit_host, limit_route;
-	int			 family_mismatch, seen, suspended_route;
-	time_t			 tm;
+	struct mta_route	*best;
+	struct mta_search	 s;
 
 	log_debug("debug: mta-routing: searching new route for %s...",
 	    mta_connector_to_text(c));
 
-	tm = 0;
-	limit_host = 0;
-	limit_route = 0;
-	suspended_route = 0;
-	family_mismatch = 0;
-	level = -1;
-	best = NULL;
-	seen = 0;
+	if (c->indexed != c->relay->domain->mxgen)
+		mta_connector_index(c);
 
-	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
-		/*
-		 * New preference level
-		 */		
-		if (mx->preference > level) {
-#ifndef IGNORE_MX_PREFERENCE
-			/*
-			 * Use the current best MX if found.
-			 */
-			if (best)
-				break;
-
-			/*
-			 * No candidate found.  There are valid MXs at this
-			 * preference level but they reached their limit, or
-			 * we can't connect yet.
-			 */
-			if (limit_host || limit_route || tm)
-				break;
-
-			/*
-			 *  If we are a backup MX, do not relay to MXs with
-			 *  a greater preference value.
-			 */
-			if (c->relay->backuppref >= 0 &&
-			    mx->preference >= c->relay->backuppref)
-				break;
-
-			/*
-			 * Start looking at MXs on this preference level.
-			 */ 
-#endif
-			level = mx->preference;
-		}
-
-		if (mx->host->flags & HOST_IGNORE)
-			continue;
-
-		/* Found a possibly valid mx */
-		seen++;
-
-		if ((c->source->sa &&
-		     c->source->sa->sa_family != mx->host->sa->sa_family) ||
-		    (l->family && l->family != mx->host->sa->sa_family)) {
-			log_debug("debug: mta-routing: skipping host %s: AF mismatch",
-			    mta_host_to_text(mx->host));
-			family_mismatch = 1;
-			continue;
-		}
-
-		if (mx->host->nconn >= l->maxconn_per_host) {
-			log_debug("debug: mta-routing: skipping host %s: too many connections",
-			    mta_host_to_text(mx->host));
-			limit_host = 1;
-			continue;
-		}
-
-		if (mx->host->lastconn + l->conndelay_host > now) {
-			log_debug("debug: mta-routing: skipping host %s: cannot use before %llus",
-			    mta_host_to_text(mx->host),
-			    (unsigned long long) mx->host->lastconn + l->conndelay_host - now);
-			if (tm == 0 || mx->host->lastconn + l->conndelay_host < tm)
-				tm = mx->host->lastconn + l->conndelay_host;
-			continue;
-		}
-
-		route = mta_route(c->source, mx->host);
-
-		if (route->flags & ROUTE_DISABLED) {
-			log_debug("debug: mta-routing: skipping route %s: suspend",
-			    mta_route_to_text(route));
-			suspended_route |= route->flags & ROUTE_DISABLED;
-			mta_route_unref(route); /* from here */
-			continue;
-		}
-
-		if (route->nconn && (route->flags & ROUTE_NEW)) {
-			log_debug("debug: mta-routing: skipping route %s: not validated yet",
-			    mta_route_to_text(route));
-			limit_route = 1;
-			mta_route_unref(route); /* from here */
-			continue;
-		}
-
-		if (route->nconn >= l->maxconn_per_route) {
-			log_debug("debug: mta-routing: skipping route %s: too many connections",
-			    mta_route_to_text(route));
-			limit_route = 1;
-			mta_route_unref(route); /* from here */
-			continue;
-		}
-
-		if (route->lastconn + l->conndelay_route > now) {
-			log_debug("debug: mta-routing: skipping route %s: cannot use before %llus (delay after connect)",
-			    mta_route_to_text(route),
-			    (unsigned long long) route->lastconn + l->conndelay_route - now);
-			if (tm == 0 || route->lastconn + l->conndelay_route < tm)
-				tm = route->lastconn + l->conndelay_route;
-			mta_route_unref(route); /* from here */
-			continue;
-		}
-
-		if (route->lastdisc + l->discdelay_route > now) {
-			log_debug("debug: mta-routing: skipping route %s: cannot use before %llus (delay after disconnect)",
-			    mta_route_to_text(route),
-			    (unsigned long long) route->lastdisc + l->discdelay_route - now);
-			if (tm == 0 || route->lastdisc + l->discdelay_route < tm)
-				tm = route->lastdisc + l->discdelay_route;
-			mta_route_unref(route); /* from here */
-			continue;
-		}
-
-		/* Use the route with the lowest number of connections. */
-		if (best && route->nconn >= best->nconn) {
-			log_debug("debug: mta-routing: skipping route %s: current one is better",
-			    mta_route_to_text(route));
-			mta_route_unref(route); /* from here */
-			continue;
-		}
-
-		if (best)
-			mta_route_unref(best); /* from here */
-		best = route;
-		log_debug("debug: mta-routing: selecting candidate route %s",
-		    mta_route_to_text(route));
-	}
-
-	if (best)
+	if ((best = mta_index_find(c, now, &s))) {
+		mta_route_ref(best);
 		return (best);
+	}
 
 	/* Order is important */
-	if (seen == 0) {
+	if (s.seen == 0 && !c->family_mismatch) {
 		log_info("smtp-out: No MX found for %s",
 		    mta_connector_to_text(c));
 		c->flags |= CONNECTOR_ERROR_MX;
 	}
-	else if (limit_route) {
+	else if (s.limit_route) {
 		log_debug("debug: mta: hit route limit");
 		*limits |= CONNECTOR_LIMIT_ROUTE;
 	}
-	else if (limit_host) {
+	else if (s.limit_host) {
 		log_debug("debug: mta: hit host limit");
 		*limits |= CONNECTOR_LIMIT_HOST;
 	}
-	else if (tm) {
-		if (tm > *nextconn)
-			*nextconn = tm;
+	else if (s.tm) {
+		if (s.tm > *nextconn)
+			*nextconn = s.tm;
 	}
-	else if (family_mismatch) {
+	else if (c->family_mismatch) {
 		log_info("smtp-out: Address family mismatch on %s",
 		    mta_connector_to_text(c));
 		c->flags |= CONNECTOR_ERROR_FAMILY;
 	}
-	else if (suspended_route) {
+	else if (s.suspended) {
 		log_info("smtp-out: No valid route for %s",
 		    mta_connector_to_text(c));
-		if (suspended_route & ROUTE_DISABLED_NET)
+		if (s.suspended & ROUTE_DISABLED_NET)
 			c->flags |= CONNECTOR_ERROR_ROUTE_NET;
-		if (suspended_route & ROUTE_DISABLED_SMTP)
+		if (s.suspended & ROUTE_DISABLED_SMTP)
 			c->flags |= CONNECTOR_ERROR_ROUTE_SMTP;
 	}
 
@@ -1524,6 +2299,7 @@ mta_relay(struct envelope *e)
 			r->helotable = xstrdup(key.helotable,
 			    "mta: helotable");
 		SPLAY_INSERT(mta_relay_tree, &relays, r);
+		TAILQ_INSERT_TAIL(&r->domain->relays, r, domain_entry);
 		stat_increment("mta.relay", 1);
 	} else {
 		mta_domain_unref(key.domain); /* from here */
@@ -1549,6 +2325,7 @@ mta_relay_unref(struct mta_relay *relay)
 
 	log_debug("debug: mta: freeing %s", mta_relay_to_text(relay));
 	SPLAY_REMOVE(mta_relay_tree, &relays, relay);
+	TAILQ_REMOVE(&relay->domain->relays, relay, domain_entry);
 
 	while ((tree_poproot(&relay->connectors, NULL, (void**)&c)))
 		mta_connector_free(c);
@@ -1690,6 +2467,8 @@ mta_host(const struct sockaddr *sa)
 	if (h == NULL) {
 		h = xcalloc(1, sizeof(*h), "mta_host");
 		h->sa = xmemdup(sa, sa->sa_len, "mta_host");
+		TAILQ_INIT(&h->candidates);
+		TAILQ_INIT(&h->mxs);
 		SPLAY_INSERT(mta_host_tree, &hosts, h);
 		stat_increment("mta.host", 1);
 	}
@@ -1757,6 +2536,7 @@ mta_domain(char *name, int flags)
 		d->name = xstrdup(name, "mta_domain");
 		d->flags = flags;
 		TAILQ_INIT(&d->mxs);
+		TAILQ_INIT(&d->relays);
 		SPLAY_INSERT(mta_domain_tree, &domains, d);
 		stat_increment("mta.domain", 1);
 	}
@@ -1783,6 +2563,7 @@ mta_domain_unref(struct mta_domain *d)
 
 	while ((mx = TAILQ_FIRST(&d->mxs))) {
 		TAILQ_REMOVE(&d->mxs, mx, entry);
+		TAILQ_REMOVE(&mx->host->mxs, mx, host_entry);
 		mta_host_unref(mx->host); /* from IMSG_DNS_HOST */
 		free(mx);
 	}
@@ -1906,12 +2687,79 @@ mta_connector_free(struct mta_connector *c)
 		    mta_connector_to_text(c));
 		runq_cancel(runq_connector, NULL, c);
 	}
+	mta_connector_unindex(c);
 	mta_source_unref(c->source); /* from constructor */
 	free(c);
 
 	stat_decrement("mta.connector", 1);
 }
 
+/*
+ * Resolve once the routes this connector may use.  This is done again
+ * only when the MXs of the domain are known again, so that looking for
+ * a route does not need to search the route tree for each MX.
+ */
+static void
+mta_connector_index(struct mta_connector *c)
+{
+	struct mta_limits	*l = c->relay->limits;
+	struct mta_mx		*mx;
+	size_t			 n;
+
+	mta_connector_unindex(c);
+
+	n = 0;
+	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry)
+		n++;
+	if (n)
+		c->candidates = xcalloc(n, sizeof(*c->candidates),
+		    "mta_connector_index");
+
+	TAILQ_FOREACH(mx, &c->relay->domain->mxs, entry) {
+#ifndef IGNORE_MX_PREFERENCE
+		/*
+		 *  If we are a backup MX, do not relay to MXs with
+		 *  a greater preference value.
+		 */
+		if (c->relay->backuppref >= 0 &&
+		    mx->preference >= c->relay->backuppref)
+			break;
+#endif
+		if ((c->source->sa &&
+		     c->source->sa->sa_family != mx->host->sa->sa_family) ||
+		    (l->family && l->family != mx->host->sa->sa_family)) {
+			log_debug("debug: mta-routing: skipping host %s: AF mismatch",
+			    mta_host_to_text(mx->host));
+			c->family_mismatch = 1;
+			continue;
+		}
+		c->candidates[c->ncandidates].route = mta_route(c->source,
+		    mx->host);
+		c->candidates[c->ncandidates].preference = mx->preference;
+		c->ncandidates++;
+	}
+	mta_index_build(c);
+
+	c->indexed = c->relay->domain->mxgen;
+	log_debug("debug: mta-routing: %zu candidate routes on %zu levels "
+	    "for %s", c->ncandidates, c->nlevels, mta_connector_to_text(c));
+}
+
+static void
+mta_connector_unindex(struct mta_connector *c)
+{
+	size_t	i;
+
+	mta_index_clear(c);
+	for (i = 0; i < c->ncandidates; i++)
+		mta_route_unref(c->candidates[i].route);
+	free(c->candidates);
+	c->candidates = NULL;
+	c->ncandidates = 0;
+	c->family_mismatch = 0;
+	c->indexed = 0;
+}
+
 static const char *
 mta_connector_to_text(struct mta_connector *c)
 {
@@ -1940,6 +2788,7 @@ mta_route(struct mta_source *src, struct mta_host *dst)
 		r->dst = dst;
 		r->flags |= ROUTE_NEW;
 		r->id = ++rid;
+		TAILQ_INIT(&r->candidates);
 		SPLAY_INSERT(mta_route_tree, &routes, r);
 		mta_source_ref(src);
 		mta_host_ref(dst);
@@ -2019,7 +2868,7 @@ mta_route_unref(struct mta_route *r)
 	stat_decrement("mta.route", 1);
 }
 
-static const char *
+const char *
 mta_route_to_text(struct mta_route *r)
 {
 	static char	buf[1024];
@@ -2077,6 +2926,7 @@ mta_hoststat_update(const char *host, const char *error)
 
 	runq_cancel(runq_hoststat, NULL, hs);
 	runq_schedule(runq_hoststat, tm+HOSTSTAT_EXPIRE_DELAY, NULL, hs);
+	mta_hoststat_changed();
 }
 
 void
@@ -2125,6 +2975,12 @@ mta_hoststat_reschedule(const char *host)
 	if (hs == NULL)
 		return;
 
+	if (hs->until) {
+		hs->until = 0;
+		mta_hoststat_notify(hs->name, 0);
+		mta_hoststat_changed();
+	}
+
 	while (tree_poproot(&hs->deferred, &evpid, NULL)) {
 		m_compose(p_queue, IMSG_MTA_SCHEDULE, 0, 0, -1,
 		    &evpid, sizeof evpid);
@@ -2138,4 +2994,516 @@ mta_hoststat_remove_entry(struct hoststat *hs)
 		;
 	dict_pop(&hoststat, hs->name);
 	runq_cancel(runq_hoststat, NULL, hs);
+	mta_hoststat_changed();
+}
+
+/*
+ * None of the routes to this host can be used before the given time.
+ * Let the scheduler know, so that it does not retry envelopes for this
+ * host before then.
+ */
+static void
+mta_hoststat_hold(const char *host, time_t until)
+{
+	struct hoststat	*hs = NULL;
+	char		 buf[SMTPD_MAXHOSTNAMELEN];
+
+	if (! lowercase(buf, host, sizeof buf))
+		return;
+
+	hs = dict_get(&hoststat, buf);
+	if (hs == NULL || hs->until == until)
+		return;
+
+	hs->until = until;
+	mta_hoststat_notify(hs->name, until);
+	mta_hoststat_changed();
+}
+
+static void
+mta_hoststat_notify(const char *host, time_t until)
+{
+	m_create(p_queue, IMSG_MTA_HOLD, 0, 0, -1);
+	m_add_string(p_queue, host);
+	m_add_time(p_queue, until);
+	m_close(p_queue);
+}
+
+/*
+ * Return the time at which the first disabled route of this relay will
+ * be enabled again, or 0 if there is none.
+ */
+static time_t
+mta_relay_holdtime(struct mta_relay *relay)
+{
+	struct mta_connector	*c;
+	struct mta_route	*route;
+	void			*iter;
+	time_t			 t, until;
+	size_t			 i;
+
+	until = 0;
+	iter = NULL;
+	while (tree_iter(&relay->connectors, &iter, NULL, (void **)&c)) {
+		for (i = 0; i < c->ncandidates; i++) {
+			route = c->candidates[i].route;
+			if (!(route->flags & ROUTE_DISABLED))
+				continue;
+			if (!runq_pending(runq_route, NULL, route, &t))
+				continue;
+			if (until == 0 || t < until)
+				until = t;
+		}
+	}
+
+	return (until);
+}
+
+static void
+mta_hoststat_open(void)
+{
+	char	path[MAXPATHLEN];
+
+	if (mta_worker)
+		(void)snprintf(path, sizeof path, "%s%s.%d", PATH_SPOOL,
+		    PATH_HOSTSTAT, mta_worker);
+	else
+		(void)snprintf(path, sizeof path, "%s%s", PATH_SPOOL,
+		    PATH_HOSTSTAT);
+
+	if ((hoststat_fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		log_warn("warn: mta: %s", path);
+}
+
+static void
+mta_hoststat_load(void)
+{
+	struct hoststat_record	 rec;
+	struct stat		 sb;
+	char			*buf, *p, *end;
+	size_t			 n;
+
+	if (hoststat_fd == -1)
+		return;
+
+	if (fstat(hoststat_fd, &sb) == -1) {
+		log_warn("warn: mta: hoststat: fstat");
+		return;
+	}
+	if (sb.st_size == 0)
+		return;
+
+	buf = xmalloc(sb.st_size, "mta_hoststat_load");
+	if (pread(hoststat_fd, buf, sb.st_size, 0) != sb.st_size) {
+		log_warn("warn: mta: hoststat: read");
+		free(buf);
+		return;
+	}
+
+	n = 0;
+	end = buf + sb.st_size;
+	for (p = buf; p + sizeof(rec) <= end; p += sizeof(rec) + rec.len) {
+		memmove(&rec, p, sizeof(rec));
+		if (p + sizeof(rec) + rec.len > end) {
+			log_warnx("warn: mta: hoststat: truncated record");
+			break;
+		}
+		n++;
+		switch (rec.type) {
+		case HOSTSTAT_RECORD_HOST:
+			mta_hoststat_load_host(&rec, p + sizeof(rec));
+			break;
+		case HOSTSTAT_RECORD_ROUTE:
+			mta_hoststat_load_route(&rec, p + sizeof(rec));
+			break;
+		default:
+			log_warnx("warn: mta: hoststat: bad record type %d",
+			    rec.type);
+			p = end;
+			break;
+		}
+	}
+	free(buf);
+
+	log_debug("debug: mta: read %zu host status records", n);
+}
+
+static void
+mta_hoststat_load_host(struct hoststat_record *rec, const char *data)
+{
+	struct hoststat	*hs;
+	const char	*name, *error;
+	time_t		 now;
+
+	now = time(NULL);
+	if (rec->tm + HOSTSTAT_EXPIRE_DELAY <= now)
+		return;
+
+	name = data;
+	if ((error = memchr(data, '\0', rec->len)) == NULL)
+		return;
+	error++;
+	if (memchr(error, '\0', data + rec->len - error) == NULL)
+		return;
+	if (dict_check(&hoststat, name))
+		return;
+
+	hs = xcalloc(1, sizeof *hs, "mta_hoststat_load");
+	tree_init(&hs->deferred);
+	strlcpy(hs->name, name, sizeof hs->name);
+	strlcpy(hs->error, error, sizeof hs->error);
+	hs->tm = rec->tm;
+	dict_set(&hoststat, hs->name, hs);
+	runq_schedule(runq_hoststat, hs->tm + HOSTSTAT_EXPIRE_DELAY, NULL, hs);
+
+	if (rec->until > now) {
+		hs->until = rec->until;
+		mta_hoststat_notify(hs->name, hs->until);
+	}
+}
+
+static void
+mta_hoststat_load_route(struct hoststat_record *rec, const char *data)
+{
+	struct sockaddr_storage	 src, dst;
+	struct mta_source	*source;
+	struct mta_host		*host;
+	struct mta_route	*route;
+	size_t			 srclen, dstlen;
+
+	if (rec->len < 1)
+		return;
+	srclen = (uint8_t)data[0];
+	if (srclen == 0)
+		srclen = 1;
+	else if (srclen > sizeof(src))
+		return;
+	if (srclen >= rec->len)
+		return;
+	dstlen = rec->len - srclen;
+	if (dstlen > sizeof(dst) || (uint8_t)data[srclen] != dstlen)
+		return;
+
+	memmove(&dst, data + srclen, dstlen);
+	if (srclen > 1) {
+		memmove(&src, data, srclen);
+		source = mta_source((struct sockaddr *)&src);
+	} else
+		source = mta_source(NULL);
+	host = mta_host((struct sockaddr *)&dst);
+	route = mta_route(source, host);
+	mta_source_unref(source); /* from here */
+	mta_host_unref(host); /* from here */
+
+	if (route->penalty == 0) {
+		route->penalty = rec->penalty;
+		route->lastpenalty = rec->tm;
+		if (rec->flags & ROUTE_DISABLED && rec->until > time(NULL)) {
+			route->flags |= rec->flags & ROUTE_DISABLED;
+			mta_index_update(route);
+			runq_schedule(runq_route, rec->until, NULL, route);
+			mta_route_ref(route);
+		}
+	}
+
+	mta_route_unref(route); /* from here */
+}
+
+static void
+mta_hoststat_save(void)
+{
+	struct hoststat_record	 rec;
+	struct hoststat		*hs;
+	struct mta_route	*route;
+	const char		*name;
+	void			*iter;
+	time_t			 t;
+	FILE			*fp;
+	int			 fd;
+	uint8_t			 nosrc = 0;
+
+	hoststat_dirty = 0;
+	if (hoststat_fd == -1)
+		return;
+
+	if (ftruncate(hoststat_fd, 0) == -1 ||
+	    lseek(hoststat_fd, 0, SEEK_SET) == -1 ||
+	    (fd = dup(hoststat_fd)) == -1) {
+		log_warn("warn: mta: hoststat");
+		return;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		log_warn("warn: mta: hoststat: fdopen");
+		close(fd);
+		return;
+	}
+
+	iter = NULL;
+	while (dict_iter(&hoststat, &iter, &name, (void **)&hs)) {
+		bzero(&rec, sizeof rec);
+		rec.type = HOSTSTAT_RECORD_HOST;
+		rec.len = strlen(hs->name) + strlen(hs->error) + 2;
+		rec.tm = hs->tm;
+		rec.until = hs->until;
+		fwrite(&rec, 1, sizeof rec, fp);
+		fwrite(hs->name, 1, strlen(hs->name) + 1, fp);
+		fwrite(hs->error, 1, strlen(hs->error) + 1, fp);
+	}
+
+	SPLAY_FOREACH(route, mta_route_tree, &routes) {
+		if (route->penalty == 0)
+			continue;
+		bzero(&rec, sizeof rec);
+		rec.type = HOSTSTAT_RECORD_ROUTE;
+		rec.penalty = route->penalty > UINT8_MAX ?
+		    UINT8_MAX : route->penalty;
+		rec.len = (route->src->sa ? route->src->sa->sa_len : 1) +
+		    route->dst->sa->sa_len;
+		rec.tm = route->lastpenalty;
+		if (route->flags & ROUTE_DISABLED &&
+		    runq_pending(runq_route, NULL, route, &t)) {
+			rec.flags = route->flags & ROUTE_DISABLED;
+			rec.until = t;
+		}
+		fwrite(&rec, 1, sizeof rec, fp);
+		if (route->src->sa)
+			fwrite(route->src->sa, 1, route->src->sa->sa_len, fp);
+		else
+			fwrite(&nosrc, 1, 1, fp);
+		fwrite(route->dst->sa, 1, route->dst->sa->sa_len, fp);
+	}
+
+	if (fflush(fp) == EOF || fsync(fd) == -1)
+		log_warn("warn: mta: hoststat: write");
+	fclose(fp);
+}
+
+static void
+mta_hoststat_changed(void)
+{
+	struct timeval	tv;
+
+	if (hoststat_dirty)
+		return;
+	hoststat_dirty = 1;
+
+	tv.tv_sec = HOSTSTAT_SAVE_DELAY;
+	tv.tv_usec = 0;
+	evtimer_add(&hoststat_ev, &tv);
+}
+
+static void
+mta_hoststat_timeout(int fd, short event, void *p)
+{
+	mta_hoststat_save();
+}
+
+static void
+mta_mxcache_key(char *buf, size_t len, const char *name, int flags)
+{
+	size_t	i;
+
+	snprintf(buf, len, "%c%s", flags ? 'H' : 'M', name);
+	for (i = 0; buf[i]; i++)
+		buf[i] = tolower((unsigned char)buf[i]);
+}
+
+static int
+mta_mxcache_lookup(struct mta_domain *domain)
+{
+	struct mxcache	*mxc;
+	struct mta_mx	*mx;
+	char		 key[SMTPD_MAXHOSTNAMELEN + 2];
+	time_t		 now;
+	size_t		 i;
+	uint64_t	 id;
+
+	mta_mxcache_key(key, sizeof(key), domain->name, domain->flags);
+	if ((mxc = dict_get(&mxcache, key)) == NULL) {
+		stat_increment("mta.mxcache.miss", 1);
+		return (0);
+	}
+
+	now = time(NULL);
+	if (now >= mxc->expire) {
+		if (mxc->error || now >= mxc->expire + MXCACHE_STALE) {
+			stat_increment("mta.mxcache.miss", 1);
+			return (0);
+		}
+		/* serve the stale entry, and revalidate it */
+		if (mxc->refresh == 0) {
+			log_debug("debug: mta: revalidating mxcache %s",
+			    mxc->name);
+			id = generate_uid();
+			tree_xset(&wait_mxcache, id, mxc);
+			if (mxc->flags)
+				dns_query_host(id, mxc->name);
+			else
+				dns_query_mx(id, mxc->name);
+			mxc->refresh = 1;
+		}
+		stat_increment("mta.mxcache.stale", 1);
+	}
+	else
+		stat_increment("mta.mxcache.hit", 1);
+
+	mxc->hits++;
+	for (i = 0; i < mxc->nmx; i++) {
+		mx = xcalloc(1, sizeof *mx, "mta: mx");
+		mx->host = mta_host((struct sockaddr*)&mxc->mxs[i].ss);
+		mx->preference = mxc->mxs[i].preference;
+		mx->domain = domain;
+		TAILQ_INSERT_TAIL(&mx->host->mxs, mx, host_entry);
+		TAILQ_INSERT_TAIL(&domain->mxs, mx, entry);
+	}
+	domain->mxstatus = mxc->error;
+
+	return (1);
+}
+
+static void
+mta_mxcache_update(struct mta_domain *domain, uint32_t ttl)
+{
+	struct mxcache	*mxc;
+	struct mta_mx	*mx;
+	char		 key[SMTPD_MAXHOSTNAMELEN + 2];
+
+	/* do not remember temporary failures */
+	if (domain->mxstatus == DNS_RETRY)
+		return;
+
+	mta_mxcache_key(key, sizeof(key), domain->name, domain->flags);
+	if ((mxc = dict_get(&mxcache, key)) == NULL) {
+		mxc = xcalloc(1, sizeof(*mxc), "mta_mxcache_update");
+		strlcpy(mxc->key, key, sizeof(mxc->key));
+		mxc->name = xstrdup(domain->name, "mta_mxcache_update");
+		mxc->flags = domain->flags;
+		dict_xset(&mxcache, mxc->key, mxc);
+		stat_increment("mta.mxcache.entry", 1);
+	}
+
+	free(mxc->pending);
+	mxc->pending = NULL;
+	mxc->npending = 0;
+	TAILQ_FOREACH(mx, &domain->mxs, entry)
+		mta_mxcache_add(&mxc->pending, &mxc->npending, mx->host->sa,
+		    mx->preference);
+	mta_mxcache_set(mxc, domain->mxstatus, ttl);
+}
+
+static void
+mta_mxcache_refreshed(struct mxcache *mxc, int error, uint32_t ttl)
+{
+	mxc->refresh = 0;
+
+	/* keep serving the stale entry for now */
+	if (error == DNS_RETRY) {
+		free(mxc->pending);
+		mxc->pending = NULL;
+		mxc->npending = 0;
+		return;
+	}
+
+	log_debug("debug: mta: mxcache %s revalidated", mxc->name);
+	mta_mxcache_set(mxc, error, ttl);
+}
+
+/*
+ * Make the pending result the current one, and schedule the removal
+ * of the entry.
+ */
+static void
+mta_mxcache_set(struct mxcache *mxc, int error, uint32_t ttl)
+{
+	time_t	now;
+
+	if (error == DNS_OK) {
+		if (ttl == 0)
+			ttl = MXCACHE_TTL_DEFAULT;
+		else if (ttl < MXCACHE_TTL_MIN)
+			ttl = MXCACHE_TTL_MIN;
+		else if (ttl > MXCACHE_TTL_MAX)
+			ttl = MXCACHE_TTL_MAX;
+	}
+	else {
+		if (ttl == 0)
+			ttl = MXCACHE_NEGTTL_DEFAULT;
+		else if (ttl > MXCACHE_NEGTTL_MAX)
+			ttl = MXCACHE_NEGTTL_MAX;
+	}
+
+	free(mxc->mxs);
+	mxc->mxs = mxc->pending;
+	mxc->nmx = mxc->npending;
+	mxc->pending = NULL;
+	mxc->npending = 0;
+	mxc->error = error;
+
+	now = time(NULL);
+	mxc->expire = now + ttl;
+	runq_cancel(runq_mxcache, NULL, mxc);
+	runq_schedule(runq_mxcache, mxc->expire +
+	    (error == DNS_OK ? MXCACHE_STALE : 0), NULL, mxc);
+}
+
+/*
+ * Insert after all entries with the same preference, so that addresses
+ * keep the order in which they were received.
+ */
+static void
+mta_mxcache_add(struct mxcache_mx **mxs, size_t *n, const struct sockaddr *sa,
+    int preference)
+{
+	struct mxcache_mx	*tmp;
+	size_t			 i;
+
+	tmp = realloc(*mxs, (*n + 1) * sizeof(*tmp));
+	if (tmp == NULL)
+		fatal("mta_mxcache_add: realloc");
+	*mxs = tmp;
+
+	for (i = *n; i > 0 && tmp[i - 1].preference > preference; i--)
+		tmp[i] = tmp[i - 1];
+	memset(&tmp[i], 0, sizeof(tmp[i]));
+	memmove(&tmp[i].ss, sa, sa->sa_len);
+	tmp[i].preference = preference;
+	*n += 1;
+}
+
+static const char *
+mta_mxcache_to_text(struct mxcache *mxc)
+{
+	static char	 buf[SMTPD_MAXLINESIZE];
+	char		 tmp[128];
+	const char	*status;
+	size_t		 i;
+
+	switch (mxc->error) {
+	case DNS_OK:
+		status = "ok";
+		break;
+	case DNS_EINVAL:
+		status = "invalid";
+		break;
+	case DNS_ENONAME:
+		status = "noname";
+		break;
+	case DNS_ENOTFOUND:
+		status = "notfound";
+		break;
+	default:
+		status = "error";
+	}
+
+	snprintf(buf, sizeof(buf), "%s|%s|%s|%lld|%zu|",
+	    mxc->flags ? "host" : "mx", mxc->name, status,
+	    (long long)(mxc->expire - time(NULL)), mxc->hits);
+	for (i = 0; i < mxc->nmx; i++) {
+		snprintf(tmp, sizeof(tmp), "%s%i:%s", i ? " " : "",
+		    mxc->mxs[i].preference,
+		    sa_to_text((struct sockaddr*)&mxc->mxs[i].ss));
+		strlcat(buf, tmp, sizeof(buf));
+	}
+
+	return (buf);
 }
@@ -0,0 +1,389 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Candidate routes of a connector.
+ *
+ * The routes a connector may use are grouped by MX preference level.
+ * Each level keeps the routes that are ready in a tree ordered by number
+ * of connections, so the best route of a level is the first one of the
+ * tree.  The routes that must wait for a delay after their last connection
+ * or disconnection, or after the last connection to their host, are kept
+ * in a second tree ordered by the time they become usable, and move to
+ * the first one once that time is reached.  Routes to an ignored host or
+ * to a host that reached its connection limit, disabled routes, and new
+ * routes already in use are left out of both.  Candidates are moved each
+ * time a route or a host opens or closes a connection, or changes state.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+#include <sys/socket.h>
+
+#include <event.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "smtpd.h"
+#include "log.h"
+
+static time_t mta_candidate_readyat(struct mta_candidate *);
+static int mta_candidate_state(struct mta_candidate *, time_t);
+static void mta_candidate_place(struct mta_candidate *, time_t);
+static void mta_candidate_unplace(struct mta_candidate *);
+static int mta_candidate_cmp(struct mta_candidate *, struct mta_candidate *);
+static int mta_waiting_cmp(struct mta_candidate *, struct mta_candidate *);
+
+SPLAY_PROTOTYPE(mta_candidate_tree, mta_candidate, entry, mta_candidate_cmp);
+SPLAY_PROTOTYPE(mta_waiting_tree, mta_candidate, entry, mta_waiting_cmp);
+
+/*
+ * Index the routes set in the candidates array of the connector.  They
+ * must be ordered by MX preference.
+ */
+void
+mta_index_build(struct mta_connector *c)
+{
+	struct mta_candidate	*cd;
+	struct mta_level	*lv;
+	size_t			 i;
+	time_t			 now;
+
+	if (c->ncandidates == 0)
+		return;
+
+	now = time(NULL);
+
+	c->levels = xcalloc(c->ncandidates, sizeof(*c->levels),
+	    "mta_index_build");
+	lv = NULL;
+	for (i = 0; i < c->ncandidates; i++) {
+		cd = &c->candidates[i];
+		if (lv == NULL || cd->preference > lv->preference) {
+			lv = &c->levels[c->nlevels++];
+			lv->preference = cd->preference;
+			SPLAY_INIT(&lv->candidates);
+			SPLAY_INIT(&lv->waiting);
+			TAILQ_INIT(&lv->hostlimit);
+		}
+		cd->connector = c;
+		cd->level = lv;
+		cd->rank = i;
+		TAILQ_INSERT_TAIL(&cd->route->candidates, cd, route_entry);
+		TAILQ_INSERT_TAIL(&cd->route->dst->candidates, cd, host_entry);
+		mta_candidate_place(cd, now);
+	}
+}
+
+void
+mta_index_clear(struct mta_connector *c)
+{
+	struct mta_candidate	*cd;
+	size_t			 i;
+
+	for (i = 0; i < c->ncandidates; i++) {
+		cd = &c->candidates[i];
+		mta_candidate_unplace(cd);
+		TAILQ_REMOVE(&cd->route->candidates, cd, route_entry);
+		TAILQ_REMOVE(&cd->route->dst->candidates, cd, host_entry);
+	}
+	free(c->levels);
+	c->levels = NULL;
+	c->nlevels = 0;
+}
+
+/*
+ * The number of connections or the state of the route changed.  Move it
+ * in the indexes of all the connectors using it, and move the other
+ * routes to its host if the host reached or left its limit, or must
+ * wait after a new connection.
+ */
+void
+mta_index_update(struct mta_route *route)
+{
+	struct mta_candidate	*cd;
+	time_t			 now;
+
+	now = time(NULL);
+
+	TAILQ_FOREACH(cd, &route->candidates, route_entry) {
+		mta_candidate_unplace(cd);
+		mta_candidate_place(cd, now);
+	}
+
+	TAILQ_FOREACH(cd, &route->dst->candidates, host_entry) {
+		if (cd->route == route ||
+		    (cd->state == mta_candidate_state(cd, now) &&
+		    cd->readyat == mta_candidate_readyat(cd)))
+			continue;
+		mta_candidate_unplace(cd);
+		mta_candidate_place(cd, now);
+	}
+}
+
+/*
+ * Return the route with the fewest connections on the first preference
+ * level that has a usable one, or NULL.  In that case, the search
+ * structure tells why no route could be used.
+ */
+struct mta_route *
+mta_index_find(struct mta_connector *c, time_t now, struct mta_search *s)
+{
+	struct mta_limits	*l = c->relay->limits;
+	struct mta_candidate	*cd, *next;
+	struct mta_level	*lv;
+	struct mta_route	*route, *best;
+	size_t			 i;
+
+	memset(s, 0, sizeof(*s));
+	best = NULL;
+
+	for (i = 0; i < c->nlevels; i++) {
+#ifndef IGNORE_MX_PREFERENCE
+		/*
+		 * Use the current best MX if found.
+		 */
+		if (best)
+			break;
+
+		/*
+		 * No candidate found.  There are valid MXs at this
+		 * preference level but they reached their limit, or
+		 * we can't connect yet.
+		 */
+		if (s->limit_host || s->limit_route || s->tm)
+			break;
+#endif
+		lv = &c->levels[i];
+
+		/* The other mta workers may have closed connections. */
+		for (cd = TAILQ_FIRST(&lv->hostlimit); cd; cd = next) {
+			next = TAILQ_NEXT(cd, limit_entry);
+			if (mta_candidate_state(cd, now) == CANDIDATE_HOSTLIMIT)
+				continue;
+			mta_candidate_unplace(cd);
+			mta_candidate_place(cd, now);
+		}
+
+		while ((cd = SPLAY_MIN(mta_waiting_tree, &lv->waiting)) &&
+		    cd->readyat <= now) {
+			mta_candidate_unplace(cd);
+			mta_candidate_place(cd, now);
+		}
+
+		if (lv->nhostlimit) {
+			log_debug("debug: mta-routing: skipping %zu hosts at "
+			    "preference %d: too many connections",
+			    lv->nhostlimit, lv->preference);
+			s->seen += lv->nhostlimit;
+			s->limit_host = 1;
+		}
+
+		if (lv->nnew) {
+			log_debug("debug: mta-routing: skipping %zu routes at "
+			    "preference %d: not validated yet",
+			    lv->nnew, lv->preference);
+			s->seen += lv->nnew;
+			s->limit_route = 1;
+		}
+
+		if ((cd = SPLAY_MIN(mta_waiting_tree, &lv->waiting))) {
+			log_debug("debug: mta-routing: skipping %zu routes at "
+			    "preference %d: cannot use before %llus",
+			    lv->nwaiting, lv->preference,
+			    (unsigned long long) cd->readyat - now);
+			s->seen += lv->nwaiting;
+			if (s->tm == 0 || cd->readyat < s->tm)
+				s->tm = cd->readyat;
+		}
+
+		while ((cd = SPLAY_MIN(mta_candidate_tree, &lv->candidates))) {
+			route = cd->route;
+
+			/* The other mta workers may have connections too. */
+			if (mta_host_nconn(route->dst) >= l->maxconn_per_host) {
+				log_debug("debug: mta-routing: skipping host %s: too many connections",
+				    mta_host_to_text(route->dst));
+				s->seen++;
+				s->limit_host = 1;
+				mta_candidate_unplace(cd);
+				mta_candidate_place(cd, now);
+				continue;
+			}
+
+			/* Found a possibly valid mx */
+			s->seen++;
+
+			/* The next routes of this level have as many. */
+			if (route->nconn >= l->maxconn_per_route) {
+				log_debug("debug: mta-routing: skipping route %s: too many connections",
+				    mta_route_to_text(route));
+				s->limit_route = 1;
+				break;
+			}
+
+			/* The next routes of this level have more. */
+			if (best == NULL || route->nconn < best->nconn) {
+				best = route;
+				log_debug("debug: mta-routing: selecting candidate route %s",
+				    mta_route_to_text(route));
+			}
+			break;
+		}
+	}
+
+	if (best || s->limit_host || s->limit_route || s->tm)
+		return (best);
+
+	/* Tell about the disabled routes that were left out. */
+	for (i = 0; i < c->ncandidates; i++) {
+		cd = &c->candidates[i];
+		if (cd->state != CANDIDATE_DISABLED)
+			continue;
+		s->seen++;
+		s->suspended |= cd->route->flags & ROUTE_DISABLED;
+	}
+
+	return (NULL);
+}
+
+/*
+ * The time at which the delays after the last connections and
+ * disconnection of the route, and the last connection to its host, are
+ * over.
+ */
+static time_t
+mta_candidate_readyat(struct mta_candidate *cd)
+{
+	struct mta_limits	*l = cd->connector->relay->limits;
+	struct mta_route	*route = cd->route;
+	time_t			 t;
+
+	t = route->dst->lastconn + l->conndelay_host;
+	if (route->lastconn + l->conndelay_route > t)
+		t = route->lastconn + l->conndelay_route;
+	if (route->lastdisc + l->discdelay_route > t)
+		t = route->lastdisc + l->discdelay_route;
+
+	return (t);
+}
+
+/*
+ * The checks are done in the order mta_find_route() used to do them.
+ */
+static int
+mta_candidate_state(struct mta_candidate *cd, time_t now)
+{
+	struct mta_limits	*l = cd->connector->relay->limits;
+	struct mta_route	*route = cd->route;
+
+	if (route->dst->flags & HOST_IGNORE)
+		return (CANDIDATE_IGNORED);
+	if (mta_host_nconn(route->dst) >= l->maxconn_per_host)
+		return (CANDIDATE_HOSTLIMIT);
+	if (route->flags & ROUTE_DISABLED)
+		return (CANDIDATE_DISABLED);
+	if (route->nconn && route->flags & ROUTE_NEW)
+		return (CANDIDATE_NEW);
+	if (mta_candidate_readyat(cd) > now)
+		return (CANDIDATE_WAITING);
+	return (CANDIDATE_READY);
+}
+
+static void
+mta_candidate_place(struct mta_candidate *cd, time_t now)
+{
+	struct mta_level	*lv = cd->level;
+
+	cd->nconn = cd->route->nconn;
+	cd->readyat = mta_candidate_readyat(cd);
+	cd->state = mta_candidate_state(cd, now);
+
+	switch (cd->state) {
+	case CANDIDATE_READY:
+		SPLAY_INSERT(mta_candidate_tree, &lv->candidates, cd);
+		break;
+	case CANDIDATE_WAITING:
+		SPLAY_INSERT(mta_waiting_tree, &lv->waiting, cd);
+		lv->nwaiting++;
+		break;
+	case CANDIDATE_HOSTLIMIT:
+		TAILQ_INSERT_TAIL(&lv->hostlimit, cd, limit_entry);
+		lv->nhostlimit++;
+		break;
+	case CANDIDATE_NEW:
+		lv->nnew++;
+		break;
+	}
+}
+
+static void
+mta_candidate_unplace(struct mta_candidate *cd)
+{
+	struct mta_level	*lv = cd->level;
+
+	switch (cd->state) {
+	case CANDIDATE_READY:
+		SPLAY_REMOVE(mta_candidate_tree, &lv->candidates, cd);
+		break;
+	case CANDIDATE_WAITING:
+		SPLAY_REMOVE(mta_waiting_tree, &lv->waiting, cd);
+		lv->nwaiting--;
+		break;
+	case CANDIDATE_HOSTLIMIT:
+		TAILQ_REMOVE(&lv->hostlimit, cd, limit_entry);
+		lv->nhostlimit--;
+		break;
+	case CANDIDATE_NEW:
+		lv->nnew--;
+		break;
+	}
+}
+
+static int
+mta_candidate_cmp(struct mta_candidate *a, struct mta_candidate *b)
+{
+	if (a->nconn < b->nconn)
+		return (-1);
+	if (a->nconn > b->nconn)
+		return (1);
+	if (a->rank < b->rank)
+		return (-1);
+	if (a->rank > b->rank)
+		return (1);
+	return (0);
+}
+
+static int
+mta_waiting_cmp(struct mta_candidate *a, struct mta_candidate *b)
+{
+	if (a->readyat < b->readyat)
+		return (-1);
+	if (a->readyat > b->readyat)
+		return (1);
+	if (a->rank < b->rank)
+		return (-1);
+	if (a->rank > b->rank)
+		return (1);
+	return (0);
+}
+
+SPLAY_GENERATE(mta_candidate_tree, mta_candidate, entry, mta_candidate_cmp);
+SPLAY_GENERATE(mta_waiting_tree, mta_candidate, entry, mta_waiting_cmp);
@@ -23,6 +23,7 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 
 #include <ctype.h>
@@ -48,6 +49,10 @@
 #define MAX_TRYBEFOREDISABLE	10
 
 #define MTA_HIWAT		65535
+#define MTA_CHUNKSIZE		32768
+
+#define MTA_TLSCACHE_MAX	1024
+#define MTA_TLSCACHE_TTL	SSL_SESSION_TIMEOUT
 
 enum mta_state {
 	MTA_INIT,
@@ -62,6 +67,7 @@ enum mta_state {
 	MTA_RCPT,
 	MTA_DATA,
 	MTA_BODY,
+	MTA_BDAT,
 	MTA_EOM,
 	MTA_LMTP_EOM,
 	MTA_RSET,
@@ -85,10 +91,45 @@ enum mta_state {
 #define MTA_LMTP		0x0800
 #define MTA_WAIT		0x1000
 #define MTA_HANGON		0x2000
+#define MTA_PIPELINING		0x4000
+#define MTA_BDATLAST		0x8000
+#define MTA_CONNECTING		0x10000
+#define MTA_ABANDONED		0x20000
+#define MTA_IDLE		0x40000
+#define MTA_SLOW		0x80000
 
 #define MTA_EXT_STARTTLS	0x01
 #define MTA_EXT_AUTH		0x02
 #define MTA_EXT_PIPELINING	0x04
+#define MTA_EXT_CHUNKING	0x08
+#define MTA_EXT_SIZE		0x10
+
+/*
+ * TLS sessions negotiated with a remote host are kept so that further
+ * connections to the same host with the same client certificate can
+ * resume them instead of doing a full handshake.
+ */
+struct mta_tlssession {
+	TAILQ_ENTRY(mta_tlssession)	 entry;
+	char				 key[SMTPD_MAXLINESIZE];
+	SSL_SESSION			*session;
+	time_t				 expire;
+};
+
+/*
+ * Connection attempts to the different MXs of a relay are staggered
+ * (RFC 8305): if a connection is not established after a short delay,
+ * another one is started on a different route, preferably using the
+ * other address family.  The first one to connect wins and the others
+ * are abandoned.
+ */
+#define MTA_RACE_DELAY		250	/* msec */
+#define MTA_RACE_MAX		4
+
+struct mta_race {
+	TAILQ_HEAD(, mta_session)	 sessions;
+	size_t				 count;
+};
 
 struct failed_evp {
 	int			 delivery;
@@ -109,15 +150,30 @@ struct mta_session {
 	int			 use_starttls;
 	int			 use_smtp_tls;
 	int			 ready;
+	SSL_SESSION		*tlssession;	/* until verified */
 
 	struct iobuf		 iobuf;
 	struct io		 io;
 	int			 ext;
+	size_t			 maxsize;
+	size_t			 msgsize;
 
 	size_t			 msgtried;
 	size_t			 msgcount;
 	size_t			 rcptcount;
+	size_t			 skipreply;
+	size_t			 bdatreplies;
+	int			 bdatlastc;
 	int			 hangon;
+	struct timespec		 txstart;
+	uint32_t		 txlatency;
+	struct timespec		 connstart;
+
+	struct mta_race		*race;
+	TAILQ_ENTRY(mta_session) race_entry;
+	struct event		 raceev;
+
+	TAILQ_ENTRY(mta_session) idle_entry;
 
 	enum mta_state		 state;
 	struct mta_task		*task;
@@ -130,6 +186,14 @@ struct mta_session {
 };
 
 static void mta_session_init(void);
+static struct mta_session *mta_session_spawn(struct mta_relay *,
+    struct mta_route *);
+static void mta_race_start(struct mta_session *);
+static void mta_race_timeout(int, short, void *);
+static void mta_race_won(struct mta_session *);
+static void mta_race_leave(struct mta_session *);
+static void mta_switch(struct mta_session *, struct mta_relay *);
+static int mta_shared(struct mta_session *);
 static void mta_start(int fd, short ev, void *arg);
 static void mta_io(struct io *, int);
 static void mta_free(struct mta_session *);
@@ -141,13 +205,22 @@ static void mta_flush_task(struct mta_session *, int, const char *, size_t, int)
 static void mta_error(struct mta_session *, const char *, ...);
 static void mta_send(struct mta_session *, char *, ...);
 static ssize_t mta_queue_data(struct mta_session *);
+static ssize_t mta_queue_chunk(struct mta_session *);
 static void mta_response(struct mta_session *, char *);
 static const char * mta_strstate(int);
 static int mta_check_loop(FILE *);
+static uint32_t mta_elapsed(struct timespec *);
 static void mta_start_tls(struct mta_session *);
 static int mta_verify_certificate(struct mta_session *);
 static struct mta_session *mta_tree_pop(struct tree *, uint64_t);
 static void mta_flush_failedqueue(struct mta_session *);
+static void mta_tls_init(struct mta_session *, SSL *);
+static int mta_tls_new_session(SSL *, SSL_SESSION *);
+static void mta_tls_verified(struct mta_session *);
+static const char *mta_tls_key(struct mta_session *);
+static struct mta_tlssession *mta_tlscache_get(const char *);
+static void mta_tlscache_set(const char *, SSL_SESSION *);
+static void mta_tlscache_remove(struct mta_tlssession *);
 void mta_hoststat_update(const char *, const char *);
 void mta_hoststat_reschedule(const char *);
 void mta_hoststat_cache(const char *, uint64_t);
@@ -161,6 +234,13 @@ static struct tree wait_ssl_verify;
 
 static struct runq *hangon;
 
+/* last sessions of their relay, kept open while waiting for a task */
+static TAILQ_HEAD(, mta_session) idle;
+
+static struct dict tlscache;
+static TAILQ_HEAD(, mta_tlssession) tlscache_lru;
+static size_t tlscache_count;
+
 static void
 mta_session_init(void)
 {
@@ -173,12 +253,21 @@ mta_session_init(void)
 		tree_init(&wait_ssl_init);
 		tree_init(&wait_ssl_verify);
 		runq_init(&hangon, mta_on_timeout);
+		TAILQ_INIT(&idle);
+		dict_init(&tlscache);
+		TAILQ_INIT(&tlscache_lru);
 		init = 1;
 	}
 }
 
 void
 mta_session(struct mta_relay *relay, struct mta_route *route)
+{
+	mta_session_spawn(relay, route);
+}
+
+static struct mta_session *
+mta_session_spawn(struct mta_relay *relay, struct mta_route *route)
 {
 	struct mta_session	*s;
 	struct timeval		 tv;
@@ -190,6 +279,7 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 	s->relay = relay;
 	s->route = route;
 	s->io.sock = -1;
+	evtimer_set(&s->raceev, mta_race_timeout, s);
 
 	if (relay->flags & RELAY_SSL && relay->flags & RELAY_AUTH)
 		s->flags |= MTA_USE_AUTH;
@@ -229,11 +319,15 @@ mta_session(struct mta_relay *relay, struct mta_route *route)
 		tv.tv_usec = 0;
 		evtimer_set(&s->io.ev, mta_start, s);
 		evtimer_add(&s->io.ev, &tv);
-	} else if (waitq_wait(&route->dst->ptrname, mta_on_ptr, s)) {
-		dns_query_ptr(s->id, s->route->dst->sa);
-		tree_xset(&wait_ptr, s->id, s);
+	} else {
+		if (waitq_wait(&route->dst->ptrname, mta_on_ptr, s)) {
+			dns_query_ptr(s->id, s->route->dst->sa);
+			tree_xset(&wait_ptr, s->id, s);
+		}
 		s->flags |= MTA_WAIT;
 	}
+
+	return (s);
 }
 
 void
@@ -244,6 +338,8 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 	struct mta_session	*s;
 	struct mta_host		*h;
 	struct msg		 m;
+	struct stat		 sb;
+	char			 buf[SMTPD_MAXLINESIZE];
 	uint64_t		 reqid;
 	const char		*name;
 	void			*ssl;
@@ -284,7 +380,28 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 			    "Loop detected", 0, 0);
 			mta_enter_state(s, MTA_READY);
 		} else {
-			mta_enter_state(s, MTA_MAIL);
+			s->msgsize = 0;
+			if (fstat(imsg->fd, &sb) == 0)
+				s->msgsize = sb.st_size;
+			if (s->maxsize && s->msgsize > s->maxsize) {
+				/* the peer would refuse it, do not send it */
+				log_debug("debug: mta: message too large");
+				fclose(s->datafp);
+				s->datafp = NULL;
+				(void)snprintf(buf, sizeof buf, "Message too "
+				    "large for destination (%zu bytes, limit "
+				    "is %zu)", s->msgsize, s->maxsize);
+				mta_flush_task(s, IMSG_DELIVERY_PERMFAIL, buf,
+				    0, 0);
+				mta_enter_state(s, MTA_READY);
+			} else {
+				mta_relay_charge(s->relay, 0, 0, s->msgsize);
+				mta_enter_state(s, MTA_MAIL);
+				if (s->flags & MTA_FREE) {
+					mta_free(s);
+					return;
+				}
+			}
 		}
 		io_reload(&s->io);
 		return;
@@ -298,10 +415,8 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		else
 			m_get_string(&m, &name);
 		m_end(&m);
-		s = mta_tree_pop(&wait_ptr, reqid);
-		if (s == NULL)
-			return;
-
+		/* The waiters, including this one, check for MTA_FREE */
+		s = tree_xpop(&wait_ptr, reqid);
 		h = s->route->dst;
 		h->lastptrquery = time(NULL);
 		if (name)
@@ -336,6 +451,7 @@ mta_session_imsg(struct mproc *p, struct imsg *imsg)
 		    resp_ca_cert->key, resp_ca_cert->key_len);
 		if (ssl == NULL)
 			fatal("mta: ssl_mta_init");
+		mta_tls_init(s, ssl);
 		io_start_tls(&s->io, ssl);
 
 		bzero(resp_ca_cert->cert, resp_ca_cert->cert_len);
@@ -409,6 +525,7 @@ mta_free(struct mta_session *s)
 {
 	struct mta_relay *relay;
 	struct mta_route *route;
+	int		  abandoned, slow;
 
 	log_debug("debug: mta: %p: session done", s);
 
@@ -419,11 +536,19 @@ mta_free(struct mta_session *s)
 		log_debug("debug: mta: %p: cancelling hangon timer", s);
 		runq_cancel(hangon, NULL, s);
 	}
+	if (s->flags & MTA_IDLE)
+		TAILQ_REMOVE(&idle, s, idle_entry);
+
+	evtimer_del(&s->raceev);
+	if (s->race)
+		mta_race_leave(s);
 
 	mta_flush_failedqueue(s);
 
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
+	if (s->tlssession)
+		SSL_SESSION_free(s->tlssession);
 
 	if (s->task)
 		fatalx("current task should have been deleted already");
@@ -434,9 +559,14 @@ mta_free(struct mta_session *s)
 
 	relay = s->relay;
 	route = s->route;
+	abandoned = s->flags & MTA_ABANDONED;
+	slow = s->flags & MTA_SLOW;
 	free(s);
 	stat_decrement("mta.session", 1);
-	mta_route_collect(relay, route);
+	if (abandoned)
+		mta_route_cancel(relay, route, slow ? 1 : 0);
+	else
+		mta_route_collect(relay, route);
 }
 
 static void
@@ -446,18 +576,86 @@ mta_on_timeout(struct runq *runq, void *arg)
 
 	log_debug("mta: timeout for session hangon");
 
-	s->flags &= ~MTA_HANGON;
+	if (s->flags & MTA_IDLE)
+		TAILQ_REMOVE(&idle, s, idle_entry);
+	s->flags &= ~(MTA_HANGON | MTA_IDLE);
 	s->hangon++;
 
 	mta_enter_state(s, MTA_READY);
 	io_reload(&s->io);
 }
 
+/*
+ * The relay has pending tasks: hand it an idle session opened for another
+ * relay on a route it can use.
+ */
+int
+mta_session_share(struct mta_relay *relay)
+{
+	struct mta_session	*s;
+
+	mta_session_init();
+
+	TAILQ_FOREACH(s, &idle, idle_entry) {
+		if (!mta_route_shareable(s->relay, relay, s->route,
+		    s->msgcount))
+			continue;
+
+		TAILQ_REMOVE(&idle, s, idle_entry);
+		runq_cancel(hangon, NULL, s);
+		s->flags &= ~(MTA_HANGON | MTA_IDLE);
+
+		mta_switch(s, relay);
+		mta_enter_state(s, MTA_READY);
+		io_reload(&s->io);
+		return (1);
+	}
+
+	return (0);
+}
+
+static void
+mta_switch(struct mta_session *s, struct mta_relay *relay)
+{
+	log_debug("debug: mta: %p: reusing session for %s", s,
+	    mta_relay_to_text(relay));
+
+	if (s->ready)
+		s->relay->nconn_ready -= 1;
+	mta_route_transfer(s->relay, relay, s->route);
+	s->relay = relay;
+	s->hangon = 0;
+	if (s->ready)
+		s->relay->nconn_ready += 1;
+}
+
+/*
+ * Tell whether the host of the session is an MX of another domain, so
+ * that the session may serve other relays.
+ */
+static int
+mta_shared(struct mta_session *s)
+{
+	struct mta_mx	*mx;
+
+	TAILQ_FOREACH(mx, &s->route->dst->mxs, host_entry)
+		if (mx->domain != s->relay->domain)
+			return (1);
+
+	return (0);
+}
+
 static void
 mta_on_ptr(void *tag, void *arg, void *data)
 {
 	struct mta_session *s = arg;
 
+	s->flags &= ~MTA_WAIT;
+	if (s->flags & MTA_FREE) {
+		log_debug("debug: mta: %p: zombie session", s);
+		mta_free(s);
+		return;
+	}
 	mta_connect(s);
 }
 
@@ -497,6 +695,13 @@ mta_connect(struct mta_session *s)
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
 
+	/* the new connection must verify its own certificate */
+	s->flags &= ~MTA_VERIFIED;
+	if (s->tlssession) {
+		SSL_SESSION_free(s->tlssession);
+		s->tlssession = NULL;
+	}
+
 	s->use_smtps = s->use_starttls = s->use_smtp_tls = 0;
 
 	switch (s->attempt) {
@@ -552,6 +757,7 @@ mta_connect(struct mta_session *s)
 	iobuf_xinit(&s->iobuf, 0, 0, "mta_connect");
 	io_init(&s->io, -1, s, mta_io, &s->iobuf);
 	io_set_timeout(&s->io, 300000);
+	clock_gettime(CLOCK_MONOTONIC, &s->connstart);
 	if (io_connect(&s->io, sa, s->route->src->sa) == -1) {
 		/*
 		 * This error is most likely a "no route",
@@ -563,14 +769,125 @@ mta_connect(struct mta_session *s)
 		else
 			mta_error(s, "Connection failed: %s", s->io.error);
 		mta_free(s);
+		return;
+	}
+
+	s->flags |= MTA_CONNECTING;
+	if (s->attempt == 1)
+		mta_race_start(s);
+}
+
+/*
+ * Arm the timer that starts a concurrent connection attempt if this
+ * one takes too long.
+ */
+static void
+mta_race_start(struct mta_session *s)
+{
+	struct timeval	tv;
+
+	if (s->race && s->race->count >= MTA_RACE_MAX)
+		return;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = MTA_RACE_DELAY * 1000;
+	evtimer_add(&s->raceev, &tv);
+}
+
+static void
+mta_race_timeout(int fd, short event, void *arg)
+{
+	struct mta_session	*s = arg, *rs;
+	struct mta_route	*route;
+
+	if (!(s->flags & MTA_CONNECTING))
+		return;
+
+	if ((route = mta_route_race(s->relay, s->route)) == NULL) {
+		log_debug("debug: mta: %p: no other route to race with", s);
+		return;
+	}
+
+	if (s->race == NULL) {
+		s->race = xcalloc(1, sizeof *s->race, "mta_race");
+		TAILQ_INIT(&s->race->sessions);
+		TAILQ_INSERT_TAIL(&s->race->sessions, s, race_entry);
+		s->race->count = 1;
+	}
+
+	rs = mta_session_spawn(s->relay, route);
+	rs->race = s->race;
+	TAILQ_INSERT_TAIL(&rs->race->sessions, rs, race_entry);
+	rs->race->count += 1;
+	stat_increment("mta.race.attempt", 1);
+
+	log_debug("debug: mta: %p: connection to %s is slow, racing %p on %s",
+	    s, mta_route_to_text(s->route), rs, mta_route_to_text(route));
+}
+
+/*
+ * This session connected first: abandon the other attempts.  Those that
+ * had at least as much time to connect are slow, and their route is
+ * penalized so that the next connections try another one.  Those still
+ * waiting for a lookup are freed when the answer comes.
+ */
+static void
+mta_race_won(struct mta_session *s)
+{
+	struct mta_race		*race = s->race;
+	struct mta_session	*rs, *next;
+	uint32_t		 elapsed;
+
+	log_debug("debug: mta: %p: won connection race on %s", s,
+	    mta_route_to_text(s->route));
+
+	elapsed = mta_elapsed(&s->connstart);
+	for (rs = TAILQ_FIRST(&race->sessions); rs; rs = next) {
+		next = TAILQ_NEXT(rs, race_entry);
+		if (rs == s)
+			continue;
+		mta_race_leave(rs);
+		log_debug("debug: mta: %p: abandoning connection to %s",
+		    rs, mta_route_to_text(rs->route));
+		stat_increment("mta.race.abandoned", 1);
+		rs->flags |= MTA_ABANDONED;
+		if (rs->flags & MTA_CONNECTING) {
+			rs->flags &= ~MTA_CONNECTING;
+			if (mta_elapsed(&rs->connstart) >= elapsed)
+				rs->flags |= MTA_SLOW;
+			mta_free(rs);
+		}
+		else if (rs->flags & MTA_WAIT)
+			rs->flags |= MTA_FREE;
+		else
+			mta_free(rs);
 	}
+	mta_race_leave(s);
+}
+
+static void
+mta_race_leave(struct mta_session *s)
+{
+	struct mta_race	*race = s->race;
+
+	evtimer_del(&s->raceev);
+	if (race == NULL)
+		return;
+
+	TAILQ_REMOVE(&race->sessions, s, race_entry);
+	s->race = NULL;
+	if (TAILQ_EMPTY(&race->sessions))
+		free(race);
 }
 
 static void
 mta_enter_state(struct mta_session *s, int newstate)
 {
+	struct mta_envelope	*e;
+	struct mta_relay	*relay;
 	int			 oldstate;
 	ssize_t			 q;
+	time_t			 delay;
 
     again:
 	oldstate = s->state;
@@ -591,6 +908,7 @@ mta_enter_state(struct mta_session *s, int newstate)
 
 	case MTA_EHLO:
 		s->ext = 0;
+		s->maxsize = 0;
 		mta_send(s, "EHLO %s", s->helo);
 		break;
 
@@ -657,20 +975,42 @@ mta_enter_state(struct mta_session *s, int newstate)
 			break;
 		}
 
+		if (s->relay->ntask &&
+		    (delay = mta_relay_shaped(s->relay))) {
+			log_debug("debug: mta: %p: rate limited on relay %s, "
+			    "waiting %llus", s, mta_relay_to_text(s->relay),
+			    (unsigned long long) delay);
+			s->flags |= MTA_HANGON;
+			runq_schedule(hangon, time(NULL) + delay, NULL, s);
+			break;
+		}
+
 		s->task = mta_route_next_task(s->relay, s->route);
 		if (s->task == NULL) {
 			log_debug("debug: mta: %p: no task for relay %s",
 			    s, mta_relay_to_text(s->relay));
 
-			if (s->relay->nconn > 1 ||
+			if ((relay = mta_route_share(s->relay, s->route,
+			    s->msgcount))) {
+				mta_switch(s, relay);
+				mta_enter_state(s, MTA_READY);
+				break;
+			}
+
+			/*
+			 * Keep the last connection of the relay, or one that
+			 * other relays may need, open for a while.
+			 */
+			if ((s->relay->nconn > 1 && !mta_shared(s)) ||
 			    s->hangon >= s->relay->limits->sessdelay_keepalive) {
 				mta_enter_state(s, MTA_QUIT);
 				break;
 			}
 
-			log_debug("mta: debug: last connection: hanging on for %is",
+			log_debug("mta: debug: no task: hanging on for %is",
 			    s->relay->limits->sessdelay_keepalive - s->hangon);
-			s->flags |= MTA_HANGON;
+			s->flags |= MTA_HANGON | MTA_IDLE;
+			TAILQ_INSERT_TAIL(&idle, s, idle_entry);
 			runq_schedule(hangon, time(NULL) + 1, NULL, s);
 			break;
 		}
@@ -692,17 +1032,51 @@ mta_enter_state(struct mta_session *s, int newstate)
 	case MTA_MAIL:
 		s->hangon = 0;
 		s->msgtried++;
-		mta_send(s, "MAIL FROM:<%s>", s->task->sender);
+		s->bdatreplies = 0;
+		s->bdatlastc = '\n';
+		s->flags &= ~MTA_BDATLAST;
+		clock_gettime(CLOCK_MONOTONIC, &s->txstart);
+		fseek(s->datafp, 0, SEEK_SET);
+		if (s->ext & MTA_EXT_SIZE)
+			mta_send(s, "MAIL FROM:<%s> SIZE=%zu", s->task->sender,
+			    s->msgsize);
+		else
+			mta_send(s, "MAIL FROM:<%s>", s->task->sender);
+		if (!(s->ext & MTA_EXT_PIPELINING))
+			break;
+
+		/*
+		 * Send the whole transaction at once, the replies are
+		 * matched in order as they come back.
+		 */
+		s->flags |= MTA_PIPELINING;
+		TAILQ_FOREACH(e, &s->task->envelopes, entry) {
+			mta_send(s, "RCPT TO:<%s>", e->dest);
+			s->rcptcount++;
+		}
+		s->currevp = TAILQ_FIRST(&s->task->envelopes);
+		fseek(s->datafp, 0, SEEK_SET);
+		if (s->ext & MTA_EXT_CHUNKING) {
+			/* never LAST here, see mta_queue_chunk() */
+			if (mta_queue_chunk(s) == -1)
+				s->flags |= MTA_FREE;
+		}
+		else
+			mta_send(s, "DATA");
 		break;
 
 	case MTA_RCPT:
 		if (s->currevp == NULL)
 			s->currevp = TAILQ_FIRST(&s->task->envelopes);
+		if (s->flags & MTA_PIPELINING)
+			break;
 		mta_send(s, "RCPT TO:<%s>", s->currevp->dest);
 		s->rcptcount++;
 		break;
 
 	case MTA_DATA:
+		if (s->flags & MTA_PIPELINING)
+			break;
 		fseek(s->datafp, 0, SEEK_SET);
 		mta_send(s, "DATA");
 		break;
@@ -726,6 +1100,22 @@ mta_enter_state(struct mta_session *s, int newstate)
 		log_trace(TRACE_MTA, "mta: %p: >>> [...%zi bytes...]", s, q);
 		break;
 
+	case MTA_BDAT:
+		/*
+		 * Wait for the replies to the pipelined commands before
+		 * sending more, the transaction may have been aborted.
+		 */
+		if (s->flags & (MTA_PIPELINING | MTA_BDATLAST) ||
+		    s->task == NULL)
+			break;
+		while (!(s->flags & MTA_BDATLAST) &&
+		    iobuf_queued(&s->iobuf) < MTA_HIWAT)
+			if (mta_queue_chunk(s) == -1) {
+				s->flags |= MTA_FREE;
+				break;
+			}
+		break;
+
 	case MTA_EOM:
 		mta_send(s, ".");
 		break;
@@ -768,6 +1158,11 @@ mta_response(struct mta_session *s, char *line)
 	char			 buf[SMTPD_MAXLINESIZE];
 	int			 delivery;
 
+	/* the remote host is closing, or refusing us at greeting */
+	if (strncmp(line, "421", 3) == 0 ||
+	    (s->state == MTA_BANNER && line[0] == '4'))
+		mta_relay_throttled(s->relay);
+
 	switch (s->state) {
 
 	case MTA_BANNER:
@@ -843,10 +1238,27 @@ mta_response(struct mta_session *s, char *line)
 				delivery = IMSG_DELIVERY_PERMFAIL;
 			else
 				delivery = IMSG_DELIVERY_TEMPFAIL;
+			if (s->flags & MTA_PIPELINING) {
+				/* ignore the RCPT replies, wait for DATA's */
+				TAILQ_FOREACH(e, &s->task->envelopes, entry)
+					s->skipreply++;
+				mta_flush_task(s, delivery, line, 0, 0);
+				s->currevp = NULL;
+				if (s->ext & MTA_EXT_CHUNKING)
+					mta_enter_state(s, MTA_BDAT);
+				else
+					mta_enter_state(s, MTA_DATA);
+				return;
+			}
 			mta_flush_task(s, delivery, line, 0, 0);
 			mta_enter_state(s, MTA_RSET);
 			return;
 		}
+		/*
+		 * Only the reply to MAIL FROM measures the destination:
+		 * the end of the transaction depends on the message size.
+		 */
+		s->txlatency = mta_elapsed(&s->txstart);
 		mta_enter_state(s, MTA_RCPT);
 		break;
 
@@ -915,7 +1327,17 @@ mta_response(struct mta_session *s, char *line)
 				mta_flush_failedqueue(s);
 				mta_flush_task(s, IMSG_DELIVERY_TEMPFAIL,
 				    "Host temporarily disabled", 0, 1);
+				s->currevp = NULL;
 				mta_route_down(s->relay, s->route);
+				/*
+				 * DATA is already on the wire and may be
+				 * accepted, the only safe way out is to
+				 * drop the connection.
+				 */
+				if (s->flags & MTA_PIPELINING) {
+					s->flags |= MTA_FREE;
+					break;
+				}
 				mta_enter_state(s, MTA_QUIT);
 				break;
 			}
@@ -926,19 +1348,39 @@ mta_response(struct mta_session *s, char *line)
 			if (TAILQ_EMPTY(&s->task->envelopes)) {
 				mta_flush_task(s, IMSG_DELIVERY_OK,
 				    "No envelope", 0, 0);
-				mta_enter_state(s, MTA_RSET);
+				if (!(s->flags & MTA_PIPELINING))
+					mta_enter_state(s, MTA_RSET);
+				else if (s->ext & MTA_EXT_CHUNKING)
+					mta_enter_state(s, MTA_BDAT);
+				else
+					mta_enter_state(s, MTA_DATA);
 				break;
 			}
 		}
 
-		if (s->currevp == NULL)
-			mta_enter_state(s, MTA_DATA);
+		if (s->currevp == NULL) {
+			if (s->ext & MTA_EXT_CHUNKING)
+				mta_enter_state(s, MTA_BDAT);
+			else
+				mta_enter_state(s, MTA_DATA);
+		}
 		else
 			mta_enter_state(s, MTA_RCPT);
 		break;
 
 	case MTA_DATA:
+		s->flags &= ~MTA_PIPELINING;
 		mta_flush_failedqueue(s);
+		if (s->task == NULL) {
+			/* the pipelined transaction was aborted */
+			if (line[0] == '2' || line[0] == '3') {
+				mta_error(s, "DATA accepted without recipients");
+				s->flags |= MTA_FREE;
+				return;
+			}
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
 		if (line[0] == '2' || line[0] == '3') {
 			mta_enter_state(s, MTA_BODY);
 			break;
@@ -951,12 +1393,43 @@ mta_response(struct mta_session *s, char *line)
 		mta_enter_state(s, MTA_RSET);
 		break;
 
+	case MTA_BDAT:
+		s->flags &= ~MTA_PIPELINING;
+		s->bdatreplies--;
+		mta_flush_failedqueue(s);
+		if (s->task == NULL) {
+			/* the pipelined transaction was aborted */
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
+		if (line[0] != '2') {
+			if (line[0] == '5')
+				delivery = IMSG_DELIVERY_PERMFAIL;
+			else
+				delivery = IMSG_DELIVERY_TEMPFAIL;
+			mta_flush_task(s, delivery, line, 0, 0);
+			s->skipreply = s->bdatreplies;
+			s->bdatreplies = 0;
+			s->flags &= ~MTA_BDATLAST;
+			mta_enter_state(s, MTA_RSET);
+			break;
+		}
+		if (s->bdatreplies || !(s->flags & MTA_BDATLAST)) {
+			mta_enter_state(s, MTA_BDAT);
+			break;
+		}
+		/* the reply to the last chunk is the delivery status */
+		s->flags &= ~MTA_BDATLAST;
+		/* FALLTHROUGH */
+
 	case MTA_LMTP_EOM:
 	case MTA_EOM:
 		if (line[0] == '2') {
 			delivery = IMSG_DELIVERY_OK;
 			s->msgtried = 0;
 			s->msgcount++;
+			if (s->state != MTA_LMTP_EOM)
+				mta_relay_delivered(s->relay, s->txlatency);
 		}
 		else if (line[0] == '5')
 			delivery = IMSG_DELIVERY_PERMFAIL;
@@ -1019,6 +1492,10 @@ mta_io(struct io *io, int evt)
 
 	case IO_CONNECTED:
 		log_info("smtp-out: Connected on session %016"PRIx64, s->id);
+		s->flags &= ~MTA_CONNECTING;
+		evtimer_del(&s->raceev);
+		if (s->race)
+			mta_race_won(s);
 
 		if (s->use_smtps) {
 			io_set_write(io);
@@ -1035,6 +1512,15 @@ mta_io(struct io *io, int evt)
 		    s->id, ssl_to_text(s->io.ssl));
 		s->flags |= MTA_TLS;
 
+		s->route->ntls += 1;
+		if (SSL_session_reused(s->io.ssl)) {
+			log_debug("debug: mta: %p: TLS session resumed", s);
+			s->route->ntlsresumed += 1;
+			stat_increment("mta.ssl.resumed", 1);
+		}
+		else
+			stat_increment("mta.ssl.handshake", 1);
+
 		if (mta_verify_certificate(s)) {
 			io_pause(&s->io, IO_PAUSE_IN);
 			break;
@@ -1046,6 +1532,7 @@ mta_io(struct io *io, int evt)
 			    "on session %016"PRIx64,
 			    (s->flags & MTA_VERIFIED) ? "succeeded" : "failed",
 			    s->id);
+		mta_tls_verified(s);
 
 		if (s->use_smtps) {
 			mta_enter_state(s, MTA_BANNER);
@@ -1084,11 +1571,27 @@ mta_io(struct io *io, int evt)
 				s->ext |= MTA_EXT_AUTH;
 			else if (strcmp(msg, "PIPELINING") == 0)
 				s->ext |= MTA_EXT_PIPELINING;
+			else if (strcmp(msg, "CHUNKING") == 0)
+				s->ext |= MTA_EXT_CHUNKING;
+			else if (strncmp(msg, "SIZE", 4) == 0 &&
+			    (msg[4] == '\0' || msg[4] == ' ')) {
+				s->ext |= MTA_EXT_SIZE;
+				if (msg[4] == ' ')
+					s->maxsize = strtonum(msg + 5, 0,
+					    LLONG_MAX, NULL);
+				s->route->maxsize = s->maxsize;
+			}
 		}
 
 		if (cont)
 			goto nextline;
 
+		if (s->skipreply) {
+			log_trace(TRACE_MTA, "mta: %p: ignoring reply", s);
+			s->skipreply--;
+			goto nextline;
+		}
+
 		if (s->state == MTA_QUIT) {
 			log_info("smtp-out: Closing session %016"PRIx64
 			    ": %zu message%s sent.", s->id, s->msgcount,
@@ -1106,6 +1609,10 @@ mta_io(struct io *io, int evt)
 		iobuf_normalize(&s->iobuf);
 
 		if (iobuf_len(&s->iobuf)) {
+			/* more replies to the pipelined commands */
+			if (s->flags & MTA_PIPELINING || s->skipreply ||
+			    s->bdatreplies)
+				goto nextline;
 			log_debug("debug: mta: remaining data in input buffer");
 			mta_error(s, "Remote host sent too much data");
 			if (s->flags & MTA_WAIT)
@@ -1116,8 +1623,8 @@ mta_io(struct io *io, int evt)
 		break;
 
 	case IO_LOWAT:
-		if (s->state == MTA_BODY) {
-			mta_enter_state(s, MTA_BODY);
+		if (s->state == MTA_BODY || s->state == MTA_BDAT) {
+			mta_enter_state(s, s->state);
 			if (s->flags & MTA_FREE) {
 				mta_free(s);
 				return;
@@ -1129,6 +1636,7 @@ mta_io(struct io *io, int evt)
 		break;
 
 	case IO_TIMEOUT:
+		s->flags &= ~MTA_CONNECTING;
 		log_debug("debug: mta: %p: connection timeout", s);
 		mta_error(s, "Connection timeout");
 		if (!s->ready)
@@ -1138,6 +1646,7 @@ mta_io(struct io *io, int evt)
 		break;
 
 	case IO_ERROR:
+		s->flags &= ~MTA_CONNECTING;
 		log_debug("debug: mta: %p: IO error: %s", s, io->error);
 		mta_error(s, "IO Error: %s", io->error);
 		if (!s->ready)
@@ -1186,18 +1695,29 @@ mta_send(struct mta_session *s, char *fmt, ...)
 static ssize_t
 mta_queue_data(struct mta_session *s)
 {
-	char	*ln;
-	size_t	 len, q;
+	char	*ln, *buf;
+	size_t	 len, q, dot;
 
 	q = iobuf_queued(&s->iobuf);
 
+	/*
+	 * Lines are copied straight from the stdio buffer into the
+	 * output queue, adding the dot-stuffing and the CRLF on the way.
+	 */
 	while (iobuf_queued(&s->iobuf) < MTA_HIWAT) {
 		if ((ln = fgetln(s->datafp, &len)) == NULL)
 			break;
 		if (ln[len - 1] == '\n')
-			ln[len - 1] = '\0';
-		iobuf_xfqueue(&s->iobuf, "mta_queue_data", "%s%s\r\n",
-		    *ln == '.' ? "." : "", ln);
+			len--;
+		dot = (len && ln[0] == '.') ? 1 : 0;
+		buf = iobuf_reserve(&s->iobuf, dot + len + 2);
+		if (buf == NULL)
+			fatal("mta_queue_data: iobuf_reserve");
+		if (dot)
+			*buf++ = '.';
+		memmove(buf, ln, len);
+		buf[len] = '\r';
+		buf[len + 1] = '\n';
 	}
 
 	if (ferror(s->datafp)) {
@@ -1214,6 +1734,83 @@ mta_queue_data(struct mta_session *s)
 	return (iobuf_queued(&s->iobuf) - q);
 }
 
+/*
+ * Queue a BDAT chunk, converting line endings to CRLF.  The last chunk
+ * is never sent while pipelining, so that the transaction can still be
+ * aborted after the replies to RCPT are received: an empty "BDAT 0 LAST"
+ * is sent later in that case.
+ */
+static ssize_t
+mta_queue_chunk(struct mta_session *s)
+{
+	static char	 buf[MTA_CHUNKSIZE];
+	char		*out, *p, *nl;
+	size_t		 n, len, i;
+	int		 last, crlf;
+
+	if (s->datafp == NULL) {
+		mta_send(s, "BDAT 0 LAST");
+		s->flags |= MTA_BDATLAST;
+		s->bdatreplies++;
+		return (0);
+	}
+
+	n = fread(buf, 1, sizeof buf, s->datafp);
+	if (ferror(s->datafp)) {
+		mta_flush_task(s, IMSG_DELIVERY_TEMPFAIL,
+		    "Error reading content file", 0, 0);
+		return (-1);
+	}
+
+	len = n;
+	for (i = 0; i < n; i++)
+		if (buf[i] == '\n')
+			len++;
+	if (n)
+		s->bdatlastc = buf[n - 1];
+
+	last = crlf = 0;
+	if (feof(s->datafp)) {
+		/* make sure the message ends with a CRLF */
+		if (s->bdatlastc != '\n') {
+			s->bdatlastc = '\n';
+			crlf = 1;
+			len += 2;
+		}
+		fclose(s->datafp);
+		s->datafp = NULL;
+		if (!(s->flags & MTA_PIPELINING))
+			last = 1;
+	}
+
+	mta_send(s, "BDAT %zu%s", len, last ? " LAST" : "");
+	if (last)
+		s->flags |= MTA_BDATLAST;
+	s->bdatreplies++;
+	if (len == 0)
+		return (0);
+
+	if ((out = iobuf_reserve(&s->iobuf, len)) == NULL)
+		fatal("mta_queue_chunk: iobuf_reserve");
+	for (p = buf; p < buf + n; p = nl + 1) {
+		if ((nl = memchr(p, '\n', buf + n - p)) == NULL) {
+			memmove(out, p, buf + n - p);
+			out += buf + n - p;
+			break;
+		}
+		memmove(out, p, nl - p);
+		out += nl - p;
+		*out++ = '\r';
+		*out++ = '\n';
+	}
+	if (crlf)
+		memmove(out, "\r\n", 2);
+
+	log_trace(TRACE_MTA, "mta: %p: >>> [...%zu bytes...]", s, len);
+
+	return (len);
+}
+
 static void
 mta_flush_task(struct mta_session *s, int delivery, const char *error, size_t count,
 	int cache)
@@ -1331,6 +1928,7 @@ mta_error(struct mta_session *s, const char *fmt, ...)
 	 */
 	if (s->state == MTA_INIT && 
 	    (errno == ETIMEDOUT || errno == ECONNREFUSED)) {
+		mta_route_unreachable(s->relay, s->route);
 		log_debug("debug: mta: not reporting route error yet");
 		free(error);
 		return;
@@ -1344,6 +1942,16 @@ mta_error(struct mta_session *s, const char *fmt, ...)
 	free(error);
 }
 
+static uint32_t
+mta_elapsed(struct timespec *t0)
+{
+	struct timespec	t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1000 +
+	    (t1.tv_nsec - t0->tv_nsec) / 1000000);
+}
+
 static int
 mta_check_loop(FILE *fp)
 {
@@ -1405,9 +2013,140 @@ mta_start_tls(struct mta_session *s)
 	ssl = ssl_mta_init(NULL, 0, NULL, 0);
 	if (ssl == NULL)
 		fatal("mta: ssl_mta_init");
+	mta_tls_init(s, ssl);
 	io_start_tls(&s->io, ssl);
 }
 
+static void
+mta_tls_init(struct mta_session *s, SSL *ssl)
+{
+	struct mta_tlssession	*ts;
+	SSL_CTX			*ctx;
+
+	/*
+	 * The session cache lives here rather than in the context, which
+	 * is created for each connection: only ask OpenSSL to tell us
+	 * about new sessions.
+	 */
+	ctx = SSL_get_SSL_CTX(ssl);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_session_cache_mode(ctx,
+	    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, mta_tls_new_session);
+	SSL_set_app_data(ssl, s);
+
+	if ((ts = mta_tlscache_get(mta_tls_key(s))) == NULL)
+		return;
+
+	log_debug("debug: mta: %p: trying to resume TLS session", s);
+	if (!SSL_set_session(ssl, ts->session))
+		mta_tlscache_remove(ts);
+}
+
+/*
+ * Only sessions with a verified server certificate are cached, so that
+ * resuming one cannot skip the verification.  A session received before
+ * the certificate is verified is held until then.
+ */
+static int
+mta_tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	struct mta_session	*s;
+
+	if ((s = SSL_get_app_data(ssl)) == NULL)
+		return (0);
+
+	if (s->flags & MTA_VERIFIED) {
+		mta_tlscache_set(mta_tls_key(s), session);
+		return (1);
+	}
+
+	if (s->tlssession)
+		SSL_SESSION_free(s->tlssession);
+	s->tlssession = session;
+	return (1);
+}
+
+static void
+mta_tls_verified(struct mta_session *s)
+{
+	struct mta_tlssession	*ts;
+
+	if (s->flags & MTA_VERIFIED) {
+		if (s->tlssession)
+			mta_tlscache_set(mta_tls_key(s), s->tlssession);
+	}
+	else {
+		if (s->tlssession)
+			SSL_SESSION_free(s->tlssession);
+		if ((ts = dict_get(&tlscache, mta_tls_key(s))))
+			mta_tlscache_remove(ts);
+	}
+	s->tlssession = NULL;
+}
+
+static const char *
+mta_tls_key(struct mta_session *s)
+{
+	static char	buf[SMTPD_MAXLINESIZE];
+
+	snprintf(buf, sizeof buf, "%s|%s", mta_host_to_text(s->route->dst),
+	    s->relay->cert ? s->relay->cert : "");
+
+	return (buf);
+}
+
+static struct mta_tlssession *
+mta_tlscache_get(const char *key)
+{
+	struct mta_tlssession	*ts;
+
+	if ((ts = dict_get(&tlscache, key)) == NULL)
+		return (NULL);
+
+	if (ts->expire <= time(NULL)) {
+		mta_tlscache_remove(ts);
+		return (NULL);
+	}
+
+	return (ts);
+}
+
+static void
+mta_tlscache_set(const char *key, SSL_SESSION *session)
+{
+	struct mta_tlssession	*ts;
+
+	if ((ts = dict_get(&tlscache, key))) {
+		SSL_SESSION_free(ts->session);
+		TAILQ_REMOVE(&tlscache_lru, ts, entry);
+	}
+	else {
+		if (tlscache_count == MTA_TLSCACHE_MAX)
+			mta_tlscache_remove(TAILQ_FIRST(&tlscache_lru));
+		ts = xcalloc(1, sizeof *ts, "mta_tlscache_set");
+		strlcpy(ts->key, key, sizeof ts->key);
+		dict_xset(&tlscache, ts->key, ts);
+		tlscache_count += 1;
+		stat_set("mta.ssl.cache", stat_counter(tlscache_count));
+	}
+
+	ts->session = session;
+	ts->expire = time(NULL) + MTA_TLSCACHE_TTL;
+	TAILQ_INSERT_TAIL(&tlscache_lru, ts, entry);
+}
+
+static void
+mta_tlscache_remove(struct mta_tlssession *ts)
+{
+	dict_xpop(&tlscache, ts->key);
+	TAILQ_REMOVE(&tlscache_lru, ts, entry);
+	SSL_SESSION_free(ts->session);
+	free(ts);
+	tlscache_count -= 1;
+	stat_set("mta.ssl.cache", stat_counter(tlscache_count));
+}
+
 static int
 mta_verify_certificate(struct mta_session *s)
 {
@@ -1491,6 +2230,7 @@ mta_strstate(int state)
 	CASE(MTA_RCPT);
 	CASE(MTA_DATA);
 	CASE(MTA_BODY);
+	CASE(MTA_BDAT);
 	CASE(MTA_EOM);
 	CASE(MTA_LMTP_EOM);
 	CASE(MTA_RSET);
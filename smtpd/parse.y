@@ -123,7 +123,8 @@ typedef struct {
 %token  RELAY BACKUP VIA DELIVER TO LMTP MAILDIR MBOX HOSTNAME HELO
 %token	ACCEPT REJECT INCLUDE ERROR MDA FROM FOR SOURCE MTA
 %token	ARROW AUTH TLS LOCAL VIRTUAL TAG TAGGED ALIAS FILTER KEY
-%token	AUTH_OPTIONAL TLS_REQUIRE USERBASE SENDER
+%token	AUTH_OPTIONAL TLS_REQUIRE USERBASE SENDER DEDUPLICATION
+%token	TIERED SPILLAFTER MAXMEMORY JOURNAL WORKERS PREFETCH SMTP
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
 %type	<v.table>	table
@@ -359,12 +360,53 @@ limits		: opt_limit limits
 		| /* empty */
 		;
 
+opt_smtp_limit	: STRING NUMBER {
+			if (!limit_smtp_set(&conf->sc_smtp_limits, $1, $2)) {
+				yyerror("invalid limit keyword");
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+smtp_limits	: opt_smtp_limit smtp_limits
+		| /* empty */
+		;
+
+opt_tier	: SPILLAFTER STRING {
+			conf->sc_queue_tier_delay = delaytonum($2);
+			if (conf->sc_queue_tier_delay == -1) {
+				yyerror("invalid spill delay: %s", $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		}
+		| MAXMEMORY size {
+			conf->sc_queue_tier_maxmem = $2;
+		}
+		| JOURNAL {
+			conf->sc_queue_flags |= QUEUE_JOURNAL;
+		}
+		;
+
+tier		: opt_tier tier
+		| /* empty */
+		;
+
 main		: BOUNCEWARN {
 			bzero(conf->sc_bounce_warn, sizeof conf->sc_bounce_warn);
 		} bouncedelays
 		| QUEUE COMPRESSION {
 			conf->sc_queue_flags |= QUEUE_COMPRESSION;
 		}
+		| QUEUE DEDUPLICATION {
+			conf->sc_queue_flags |= QUEUE_DEDUP;
+		}
+		| QUEUE TIERED {
+			conf->sc_queue_flags |= QUEUE_TIERED;
+		} tier
 		| QUEUE ENCRYPTION KEY STRING {
 			conf->sc_queue_flags |= QUEUE_ENCRYPTION;
 			conf->sc_queue_key = $4;
@@ -396,6 +438,32 @@ main		: BOUNCEWARN {
 		| LIMIT MTA {
 			limits = dict_get(conf->sc_limits_dict, "default");
 		} limits
+		| LIMIT SMTP smtp_limits
+		| MTA WORKERS NUMBER {
+			if ($3 < 1 || $3 > MTA_MAXWORKERS) {
+				yyerror("invalid number of mta workers: %lld",
+				    $3);
+				YYERROR;
+			}
+			conf->sc_mta_workers = $3;
+		}
+		| SMTP WORKERS NUMBER {
+			if ($3 < 1 || $3 > SMTP_MAXWORKERS) {
+				yyerror("invalid number of smtp workers: %lld",
+				    $3);
+				YYERROR;
+			}
+			conf->sc_smtp_workers = $3;
+		}
+		| MTA PREFETCH STRING {
+			conf->sc_mta_prefetch = delaytonum($3);
+			if (conf->sc_mta_prefetch == -1) {
+				yyerror("invalid prefetch delay: %s", $3);
+				free($3);
+				YYERROR;
+			}
+			free($3);
+		}
 		| LISTEN {
 			bzero(&l, sizeof l);
 		} ON STRING address_family port ssl certificate auth tag listen_helo {
@@ -1012,6 +1080,7 @@ lookup(char *s)
 		{ "bounce-warn",	BOUNCEWARN },
 		{ "certificate",	CERTIFICATE },
 		{ "compression",	COMPRESSION },
+		{ "deduplication",	DEDUPLICATION },
 		{ "deliver",		DELIVER },
 		{ "domain",		DOMAIN },
 		{ "encryption",		ENCRYPTION },
@@ -1024,34 +1093,41 @@ lookup(char *s)
 		{ "include",		INCLUDE },
 		{ "inet4",		INET4 },
 		{ "inet6",		INET6 },
+		{ "journal",		JOURNAL },
 		{ "key",		KEY },
 		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
 		{ "lmtp",		LMTP },
 		{ "local",		LOCAL },
 		{ "maildir",		MAILDIR },
+		{ "max-memory",		MAXMEMORY },
 		{ "max-message-size",  	MAXMESSAGESIZE },
 		{ "mbox",		MBOX },
 		{ "mda",		MDA },
 		{ "mta",		MTA },
 		{ "on",			ON },
 		{ "port",		PORT },
+		{ "prefetch",		PREFETCH },
 		{ "queue",		QUEUE },
 		{ "reject",		REJECT },
 		{ "relay",		RELAY },
 		{ "sender",    		SENDER },
+		{ "smtp",		SMTP },
 		{ "smtps",		SMTPS },
 		{ "source",		SOURCE },
+		{ "spill-after",	SPILLAFTER },
 		{ "ssl",		SSL },
 		{ "table",		TABLE },
 		{ "tag",		TAG },
 		{ "tagged",		TAGGED },
+		{ "tiered",		TIERED },
 		{ "tls",		TLS },
 		{ "tls-require",       	TLS_REQUIRE },
 		{ "to",			TO },
 		{ "userbase",		USERBASE },
 		{ "via",		VIA },
 		{ "virtual",		VIRTUAL },
+		{ "workers",		WORKERS },
 	};
 	const struct keywords	*p;
 
@@ -1434,6 +1510,12 @@ parse_config(struct smtpd *x_conf, const char *filename, int opts)
 	TAILQ_INIT(conf->sc_rules);
 
 	conf->sc_qexpire = SMTPD_QUEUE_EXPIRY;
+	conf->sc_mta_workers = 1;
+	conf->sc_smtp_workers = 1;
+	limit_smtp_set_defaults(&conf->sc_smtp_limits);
+	conf->sc_mta_prefetch = SMTPD_MTA_PREFETCH;
+	conf->sc_queue_tier_delay = SMTPD_QUEUE_TIER_DELAY;
+	conf->sc_queue_tier_maxmem = SMTPD_QUEUE_TIER_MAXMEM;
 	conf->sc_opts = opts;
 
 	if ((file = pushfile(filename, 0)) == NULL) {
@@ -43,6 +43,9 @@
 static void queue_imsg(struct mproc *, struct imsg *);
 static void queue_timeout(int, short, void *);
 static void queue_bounce(struct envelope *, struct delivery_bounce *);
+static int queue_bounce_create(struct envelope *, struct delivery_bounce *);
+static void queue_remove_message(struct imsg *);
+static void queue_expire_message(struct imsg *);
 static void queue_shutdown(void);
 static void queue_sig_handler(int, short, void *);
 static void queue_log(const struct envelope *, const char *, const char *);
@@ -64,7 +67,8 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	struct bounce_req_msg	*req_bounce;
 	struct envelope		 evp;
 	struct msg		 m;
-	const char		*reason;
+	struct mproc		*p_agent;
+	const char		*reason, *domain;
 	uint64_t		 reqid, evpid;
 	uint32_t		 msgid;
 	uint32_t		 penalty;
@@ -160,15 +164,16 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				log_warnx("warn: imsg_queue_submit_envelope: msgid=0, "
 				    "evpid=%016"PRIx64, evp.id);
 			ret = queue_envelope_create(&evp);
-			m_create(p_smtp, IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
-			m_add_id(p_smtp, reqid);
+			p_agent = smtp_worker_for(reqid);
+			m_create(p_agent, IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
+			m_add_id(p_agent, reqid);
 			if (ret == 0)
-				m_add_int(p_smtp, 0);
+				m_add_int(p_agent, 0);
 			else {
-				m_add_int(p_smtp, 1);
-				m_add_evpid(p_smtp, evp.id);
+				m_add_int(p_agent, 1);
+				m_add_evpid(p_agent, evp.id);
 			}
-			m_close(p_smtp);
+			m_close(p_agent);
 			if (ret) {
 				m_create(p_scheduler,
 				    IMSG_QUEUE_SUBMIT_ENVELOPE, 0, 0, -1);
@@ -182,10 +187,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			m_msg(&m, imsg);
 			m_get_id(&m, &reqid);
 			m_end(&m);
-			m_create(p_smtp, IMSG_QUEUE_COMMIT_ENVELOPES, 0, 0, -1);
-			m_add_id(p_smtp, reqid);
-			m_add_int(p_smtp, 1);
-			m_close(p_smtp);
+			p_agent = smtp_worker_for(reqid);
+			m_create(p_agent, IMSG_QUEUE_COMMIT_ENVELOPES, 0, 0, -1);
+			m_add_id(p_agent, reqid);
+			m_add_int(p_agent, 1);
+			m_close(p_agent);
 			return;
 		}
 	}
@@ -193,33 +199,11 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 	if (p->proc == PROC_SCHEDULER) {
 		switch (imsg->hdr.type) {
 		case IMSG_QUEUE_REMOVE:
-			m_msg(&m, imsg);
-			m_get_evpid(&m, &evpid);
-			m_end(&m);
-
-			/* already removed by scheduler */
-			if (queue_envelope_load(evpid, &evp) == 0)
-				return;
-			queue_log(&evp, "Remove", "Removed by administrator");
-			queue_envelope_delete(evpid);
+			queue_remove_message(imsg);
 			return;
 
 		case IMSG_QUEUE_EXPIRE:
-			m_msg(&m, imsg);
-			m_get_evpid(&m, &evpid);
-			m_end(&m);
-
-			/* already removed by scheduler*/
-			if (queue_envelope_load(evpid, &evp) == 0)
-				return;
-
-			bounce.type = B_ERROR;
-			bounce.delay = 0;
-			bounce.expire = 0;
-			envelope_set_errormsg(&evp, "Envelope expired");
-			queue_bounce(&evp, &bounce);
-			queue_log(&evp, "Expire", "Envelope expired");
-			queue_envelope_delete(evpid);
+			queue_expire_message(imsg);
 			return;
 
 		case IMSG_QUEUE_BOUNCE:
@@ -278,9 +262,22 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 				return;
 			}
 			evp.lasttry = time(NULL);
-			m_create(p_mta, IMSG_MTA_TRANSFER, 0, 0, -1);
-			m_add_envelope(p_mta, &evp);
-			m_close(p_mta);
+			p_agent = p_mta_worker[mta_worker_for(&evp)];
+			m_create(p_agent, IMSG_MTA_TRANSFER, 0, 0, -1);
+			m_add_envelope(p_agent, &evp);
+			m_close(p_agent);
+			return;
+
+		case IMSG_MTA_PREFETCH:
+			m_msg(&m, imsg);
+			m_get_evpid(&m, &evpid);
+			m_end(&m);
+			if (queue_envelope_load(evpid, &evp) == 0)
+				return; /* will be reported when scheduled */
+			p_agent = p_mta_worker[mta_worker_for(&evp)];
+			m_create(p_agent, IMSG_MTA_PREFETCH, 0, 0, -1);
+			m_add_envelope(p_agent, &evp);
+			m_close(p_agent);
 			return;
 
 		case IMSG_CTL_LIST_ENVELOPES:
@@ -415,8 +412,17 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 			return;
 
 		case IMSG_MTA_SCHEDULE:
+		case IMSG_MTA_HOLD:
 			m_forward(p_scheduler, imsg);
 			return;
+
+		case IMSG_MTA_SHARD:
+			m_msg(&m, imsg);
+			m_get_string(&m, &domain);
+			m_get_int(&m, &v);
+			m_end(&m);
+			mta_worker_assign(domain, v);
+			return;
 		}
 	}
 
@@ -456,6 +462,21 @@ queue_imsg(struct mproc *p, struct imsg *imsg)
 
 static void
 queue_bounce(struct envelope *e, struct delivery_bounce *d)
+{
+	if (queue_bounce_create(e, d) == 0)
+		return;
+
+	m_create(p_scheduler, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
+	m_add_msgid(p_scheduler, evpid_to_msgid(e->id));
+	m_close(p_scheduler);
+}
+
+/*
+ * Create a bounce envelope for e and submit it to the scheduler.
+ * The caller is responsible for committing the message.
+ */
+static int
+queue_bounce_create(struct envelope *e, struct delivery_bounce *d)
 {
 	struct envelope	b;
 
@@ -486,12 +507,102 @@ queue_bounce(struct envelope *e, struct delivery_bounce *d)
 		m_add_envelope(p_scheduler, &b);
 		m_close(p_scheduler);
 
+		stat_increment("queue.bounce", 1);
+		return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * The scheduler sends removed and expired envelopes grouped by message,
+ * with a flag telling whether it still knows of other envelopes for that
+ * message.  If not, the whole message is dropped at once rather than
+ * unlinking each envelope separately.
+ */
+static void
+queue_remove_message(struct imsg *imsg)
+{
+	struct envelope	evp;
+	struct msg	m;
+	uint64_t	evpid;
+	uint32_t	msgid;
+	int		all;
+
+	m_msg(&m, imsg);
+	m_get_msgid(&m, &msgid);
+	m_get_int(&m, &all);
+	while (!m_is_eom(&m)) {
+		m_get_evpid(&m, &evpid);
+
+		/* already removed by scheduler */
+		if (queue_envelope_load(evpid, &evp) == 0)
+			continue;
+		queue_log(&evp, "Remove", "Removed by administrator");
+		if (!all)
+			queue_envelope_delete(evpid);
+	}
+	m_end(&m);
+
+	if (all) {
+		log_debug("debug: queue: removing msg:%08" PRIx32, msgid);
+		queue_message_delete(msgid);
+	}
+}
+
+static void
+queue_expire_message(struct imsg *imsg)
+{
+	struct delivery_bounce	bounce;
+	struct envelope		evp;
+	struct msg		m;
+	uint64_t		evpid, *evpids;
+	uint32_t		msgid;
+	size_t			i, n, nbounce;
+	int			all;
+
+	bounce.type = B_ERROR;
+	bounce.delay = 0;
+	bounce.expire = 0;
+
+	evpids = xcalloc((imsg->hdr.len - IMSG_HEADER_SIZE) / sizeof(evpid),
+	    sizeof(evpid), "queue_expire_message");
+	n = 0;
+	nbounce = 0;
+
+	m_msg(&m, imsg);
+	m_get_msgid(&m, &msgid);
+	m_get_int(&m, &all);
+	while (!m_is_eom(&m)) {
+		m_get_evpid(&m, &evpid);
+
+		/* already removed by scheduler */
+		if (queue_envelope_load(evpid, &evp) == 0)
+			continue;
+		envelope_set_errormsg(&evp, "Envelope expired");
+		nbounce += queue_bounce_create(&evp, &bounce);
+		queue_log(&evp, "Expire", "Envelope expired");
+		evpids[n++] = evpid;
+	}
+	m_end(&m);
+
+	/* commit all bounces at once, so they end up in the same report */
+	if (nbounce) {
 		m_create(p_scheduler, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
-		m_add_msgid(p_scheduler, evpid_to_msgid(b.id));
+		m_add_msgid(p_scheduler, msgid);
 		m_close(p_scheduler);
+	}
 
-		stat_increment("queue.bounce", 1);
+	/* bounces live in the same message, which must then be kept */
+	if (all && nbounce == 0) {
+		log_debug("debug: queue: expiring msg:%08" PRIx32, msgid);
+		queue_message_delete(msgid);
 	}
+	else
+		for (i = 0; i < n; i++)
+			queue_envelope_delete(evpids[i]);
+
+	free(evpids);
 }
 
 static void
@@ -698,9 +809,11 @@ queue_flow_control(void)
 {
 	size_t	bufsz;
 	int	oldlimit = limit;
-	int	set, unset;
+	int	set, unset, i;
 
-	bufsz = p_mda->bytes_queued + p_mta->bytes_queued;
+	bufsz = p_mda->bytes_queued;
+	for (i = 0; i < env->sc_mta_workers; i++)
+		bufsz += p_mta_worker[i]->bytes_queued;
 	if (bufsz <= flow_agent_lowat)
 		limit &= ~LIMIT_AGENT;
 	else if (bufsz > flow_agent_hiwat)
@@ -717,14 +830,16 @@ queue_flow_control(void)
 	if (set & LIMIT_SCHEDULER) {
 		log_warnx("warn: queue: Hiwat reached on scheduler buffer: "
 		    "suspending transfer, delivery and lookup input");
-		mproc_disable(p_mta);
+		for (i = 0; i < env->sc_mta_workers; i++)
+			mproc_disable(p_mta_worker[i]);
 		mproc_disable(p_mda);
 		mproc_disable(p_lka);
 	}
 	else if (unset & LIMIT_SCHEDULER) {
 		log_warnx("warn: queue: Down to lowat on scheduler buffer: "
 		    "resuming transfer, delivery and lookup input");
-		mproc_enable(p_mta);
+		for (i = 0; i < env->sc_mta_workers; i++)
+			mproc_enable(p_mta_worker[i]);
 		mproc_enable(p_mda);
 		mproc_enable(p_lka);
 	}
@@ -22,7 +22,10 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 
+#include <openssl/sha.h>
+
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <event.h>
@@ -47,14 +50,50 @@ extern struct queue_backend	queue_backend_null;
 extern struct queue_backend	queue_backend_proc;
 extern struct queue_backend	queue_backend_ram;
 
+struct dedup_msg;
+
 static void queue_envelope_cache_add(struct envelope *);
 static void queue_envelope_cache_update(struct envelope *);
 static void queue_envelope_cache_del(uint64_t evpid);
+static int queue_message_process(const char *);
+static int queue_message_unprocess(int);
+static int queue_dedup_commit(uint32_t, const char *);
+static int queue_dedup_fd_r(uint32_t, int);
+static void queue_dedup_uncache(uint32_t, struct dedup_msg *);
+static void queue_dedup_load(void);
+static void queue_dedup_count(uint32_t, int);
+static void queue_dedup_walk(uint32_t);
+static void queue_dedup_sweep(void);
+static void queue_dedup_release(uint32_t);
+static int queue_copy_fd(int, int);
 
 TAILQ_HEAD(evplst, envelope);
 
+/*
+ * With deduplication, the body of a message is stored once in the dedup
+ * directory, named after its hash, and shared by all the messages that
+ * carry it.  The queued message only keeps its headers, after a line
+ * naming the body.  Each message holds a hardlink "<body>-<msgid>" to
+ * the body, which goes away when no such link is left.  The message is
+ * rebuilt in the temporary directory the first time it is read, and that
+ * copy serves the next reads until the message is released.
+ */
+#define	DEDUP_MAGIC	"\001dedup "	/* never starts a received message */
+#define	DEDUP_MINSIZE	1024		/* smaller bodies are not shared */
+#define	DEDUP_NAMELEN	(SHA256_DIGEST_LENGTH * 2 + 4)
+
+struct dedup_msg {
+	size_t	evpcount;
+	int	restored;		/* found at startup */
+	int	cached;			/* rebuilt message in PATH_TEMPORARY */
+	char	blob[DEDUP_NAMELEN];	/* empty if the body is not shared */
+};
+
 static struct tree		evpcache_tree;
 static struct evplst		evpcache_list;
+static struct tree		dedup_tree;	/* msgid -> struct dedup_msg */
+static int			dedup_loaded;
+static size_t			dedup_blobs;
 static struct queue_backend	*backend;
 
 static int (*handler_message_create)(uint32_t *);
@@ -122,6 +161,7 @@ queue_init(const char *name, int server)
 
 	tree_init(&evpcache_tree);
 	TAILQ_INIT(&evpcache_list);
+	tree_init(&dedup_tree);
 
 	if (!strcmp(name, "fs"))
 		backend = &queue_backend_fs;
@@ -149,6 +189,10 @@ queue_init(const char *name, int server)
 
 		if (ckdir(PATH_SPOOL PATH_TEMPORARY, 0700, pwq->pw_uid, 0, 1) == 0)
 			errx(1, "error in purge directory setup");
+
+		if (env->sc_queue_flags & QUEUE_DEDUP &&
+		    ckdir(PATH_SPOOL PATH_DEDUP, 0700, pwq->pw_uid, 0, 1) == 0)
+			errx(1, "error in dedup directory setup");
 	}
 
 	r = backend->init(pwq, server);
@@ -177,8 +221,23 @@ queue_message_create(uint32_t *msgid)
 int
 queue_message_delete(uint32_t msgid)
 {
-	char	msgpath[MAXPATHLEN];
-	int	r;
+	char		 msgpath[MAXPATHLEN];
+	uint64_t	 evpid;
+	void		*iter;
+	int		 r;
+
+	/* drop cached envelopes for this message */
+	if (env->sc_queue_flags & QUEUE_EVPCACHE) {
+		for (;;) {
+			iter = NULL;
+			if (tree_iterfrom(&evpcache_tree, &iter,
+			    (uint64_t)msgid << 32, &evpid, NULL) == 0)
+				break;
+			if (evpid_to_msgid(evpid) != msgid)
+				break;
+			queue_envelope_cache_del(evpid);
+		}
+	}
 
 	profile_enter("queue_message_delete");
 	r = handler_message_delete(msgid);
@@ -188,6 +247,8 @@ queue_message_delete(uint32_t msgid)
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
 	unlink(msgpath);
 
+	queue_dedup_release(msgid);
+
 	log_trace(TRACE_QUEUE,
 	    "queue-backend: queue_message_delete(%08"PRIx32") -> %i", msgid, r);
 
@@ -197,19 +258,46 @@ queue_message_delete(uint32_t msgid)
 int
 queue_message_commit(uint32_t msgid)
 {
-	int	r;
-	char	msgpath[MAXPATHLEN];
-	char	tmppath[MAXPATHLEN];
-	FILE	*ifp = NULL;
-	FILE	*ofp = NULL;
+	int		r;
+	char		msgpath[MAXPATHLEN];
 
 	profile_enter("queue_message_commit");
 
 	queue_message_path(msgid, msgpath, sizeof(msgpath));
 
+	/* on failure, the message is simply stored whole */
+	if (env->sc_queue_flags & QUEUE_DEDUP)
+		(void)queue_dedup_commit(msgid, msgpath);
+
+	if (! queue_message_process(msgpath))
+		return (0);
+
+	r = handler_message_commit(msgid, msgpath);
+	profile_leave();
+
+	/* in case it's not done by the backend */
+	unlink(msgpath);
+
+	log_trace(TRACE_QUEUE,
+	    "queue-backend: queue_message_commit(%08"PRIx32") -> %i",
+	    msgid, r);
+
+	return (r);
+}
+
+/*
+ * Compress and encrypt the file in place, as configured.
+ */
+static int
+queue_message_process(const char *path)
+{
+	char		tmppath[MAXPATHLEN];
+	FILE		*ifp = NULL;
+	FILE		*ofp = NULL;
+
 	if (env->sc_queue_flags & QUEUE_COMPRESSION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.comp", msgpath);
-		ifp = fopen(msgpath, "r");
+		bsnprintf(tmppath, sizeof tmppath, "%s.comp", path);
+		ifp = fopen(path, "r");
 		ofp = fopen(tmppath, "w+");
 		if (ifp == NULL || ofp == NULL)
 			goto err;
@@ -220,7 +308,7 @@ queue_message_commit(uint32_t msgid)
 		ifp = NULL;
 		ofp = NULL;
 
-		if (rename(tmppath, msgpath) == -1) {
+		if (rename(tmppath, path) == -1) {
 			if (errno == ENOSPC)
 				return (0);
 			unlink(tmppath);
@@ -230,8 +318,8 @@ queue_message_commit(uint32_t msgid)
 	}
 
 	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
-		bsnprintf(tmppath, sizeof tmppath, "%s.enc", msgpath);
-		ifp = fopen(msgpath, "r");
+		bsnprintf(tmppath, sizeof tmppath, "%s.enc", path);
+		ifp = fopen(path, "r");
 		ofp = fopen(tmppath, "w+");
 		if (ifp == NULL || ofp == NULL)
 			goto err;
@@ -242,7 +330,7 @@ queue_message_commit(uint32_t msgid)
 		ifp = NULL;
 		ofp = NULL;
 
-		if (rename(tmppath, msgpath) == -1) {
+		if (rename(tmppath, path) == -1) {
 			if (errno == ENOSPC)
 				return (0);
 			unlink(tmppath);
@@ -251,17 +339,7 @@ queue_message_commit(uint32_t msgid)
 		}
 	}
 
-	r = handler_message_commit(msgid, msgpath);
-	profile_leave();
-
-	/* in case it's not done by the backend */
-	unlink(msgpath);
-
-	log_trace(TRACE_QUEUE,
-	    "queue-backend: queue_message_commit(%08"PRIx32") -> %i",
-	    msgid, r);
-
-	return (r);
+	return (1);
 
 err:
 	if (ifp)
@@ -274,12 +352,19 @@ err:
 int
 queue_message_corrupt(uint32_t msgid)
 {
-	int	r;
+	struct dedup_msg	*dm;
+	int			 r;
 
 	profile_enter("queue_message_corrupt");
 	r = handler_message_corrupt(msgid);
 	profile_leave();
 
+	/* a corrupt message keeps its body until the next restart */
+	if ((dm = tree_pop(&dedup_tree, msgid))) {
+		queue_dedup_uncache(msgid, dm);
+		free(dm);
+	}
+
 	log_trace(TRACE_QUEUE,
 	    "queue-backend: queue_message_corrupt(%08"PRIx32") -> %i", msgid, r);
 
@@ -289,9 +374,7 @@ queue_message_corrupt(uint32_t msgid)
 int
 queue_message_fd_r(uint32_t msgid)
 {
-	int	fdin = -1, fdout = -1, fd = -1;
-	FILE	*ifp = NULL;
-	FILE	*ofp = NULL;
+	int	fdin;
 
 	profile_enter("queue_message_fd_r");
 	fdin = handler_message_fd_r(msgid);
@@ -303,6 +386,23 @@ queue_message_fd_r(uint32_t msgid)
 	if (fdin == -1)
 		return (-1);
 
+	if ((fdin = queue_message_unprocess(fdin)) == -1)
+		return (-1);
+
+	return (queue_dedup_fd_r(msgid, fdin));
+}
+
+/*
+ * Return a descriptor on the decrypted and uncompressed content of fdin,
+ * which is consumed.
+ */
+static int
+queue_message_unprocess(int fdin)
+{
+	int	fdout = -1, fd = -1;
+	FILE	*ifp = NULL;
+	FILE	*ofp = NULL;
+
 	if (env->sc_queue_flags & QUEUE_ENCRYPTION) {
 		if ((fdout = mktmpfile()) == -1)
 			goto err;
@@ -437,6 +537,423 @@ queue_envelope_load_buffer(struct envelope *ep, char *evpbuf, size_t evpbufsize)
 	return (envelope_load_buffer(ep, evp, evplen));
 }
 
+/*
+ * Split the message at the end of its headers, and store the body in
+ * the dedup directory if it is not there already.  The message is then
+ * rewritten to only hold the name of the body and the headers.
+ */
+static int
+queue_dedup_commit(uint32_t msgid, const char *msgpath)
+{
+	SHA256_CTX		 ctx;
+	struct dedup_msg	*dm;
+	struct stat		 sb;
+	unsigned char		 md[SHA256_DIGEST_LENGTH];
+	char			 name[DEDUP_NAMELEN];
+	char			 blobpath[MAXPATHLEN];
+	char			 refpath[MAXPATHLEN];
+	char			 tmppath[MAXPATHLEN];
+	char			 buf[8192];
+	FILE			*ifp = NULL;
+	FILE			*ofp = NULL;
+	off_t			 hdrlen;
+	size_t			 n, i, bodylen;
+	int			 c, prev, created = 0;
+
+	if ((ifp = fopen(msgpath, "r")) == NULL)
+		return (0);
+
+	/* the headers end with the first empty line */
+	for (prev = 0, hdrlen = 0; (c = getc(ifp)) != EOF; prev = c) {
+		hdrlen++;
+		if (c == '\n' && prev == '\n')
+			break;
+	}
+	if (c == EOF)
+		goto err;
+
+	SHA256_Init(&ctx);
+	bodylen = 0;
+	while ((n = fread(buf, 1, sizeof buf, ifp)) != 0) {
+		SHA256_Update(&ctx, buf, n);
+		bodylen += n;
+	}
+	if (ferror(ifp) || bodylen < DEDUP_MINSIZE)
+		goto err;
+	SHA256_Final(md, &ctx);
+
+	/* tag the name with the flags that determine how the body is stored */
+	for (i = 0; i < sizeof(md); i++)
+		snprintf(name + i * 2, 3, "%02x", md[i]);
+	snprintf(name + i * 2, 4, ".%02x", env->sc_queue_flags &
+	    (QUEUE_COMPRESSION | QUEUE_ENCRYPTION));
+
+	bsnprintf(blobpath, sizeof blobpath, "%s/%s", PATH_DEDUP, name);
+	bsnprintf(refpath, sizeof refpath, "%s-%08" PRIx32, blobpath, msgid);
+
+	if (stat(blobpath, &sb) == -1) {
+		if (errno != ENOENT) {
+			log_warn("warn: queue: stat: %s", blobpath);
+			goto err;
+		}
+		bsnprintf(tmppath, sizeof tmppath, "%s.body", msgpath);
+		if ((ofp = fopen(tmppath, "w")) == NULL) {
+			log_warn("warn: queue: fopen: %s", tmppath);
+			goto err;
+		}
+		if (fseeko(ifp, hdrlen, SEEK_SET) == -1)
+			goto errtmp;
+		while ((n = fread(buf, 1, sizeof buf, ifp)) != 0)
+			if (fwrite(buf, 1, n, ofp) != n)
+				goto errtmp;
+		if (ferror(ifp) || fclose(ofp) == EOF) {
+			ofp = NULL;
+			goto errtmp;
+		}
+		ofp = NULL;
+		if (! queue_message_process(tmppath) ||
+		    rename(tmppath, blobpath) == -1)
+			goto errtmp;
+		created = 1;
+	}
+	if (link(blobpath, refpath) == -1) {
+		log_warn("warn: queue: link: %s", refpath);
+		goto errblob;
+	}
+
+	bsnprintf(tmppath, sizeof tmppath, "%s.dedup", msgpath);
+	if ((ofp = fopen(tmppath, "w")) == NULL) {
+		log_warn("warn: queue: fopen: %s", tmppath);
+		goto errref;
+	}
+	fprintf(ofp, "%s%s\n", DEDUP_MAGIC, name);
+	rewind(ifp);
+	while (hdrlen) {
+		n = (hdrlen < (off_t)sizeof buf) ? (size_t)hdrlen : sizeof buf;
+		if (fread(buf, 1, n, ifp) != n || fwrite(buf, 1, n, ofp) != n)
+			break;
+		hdrlen -= n;
+	}
+	if (hdrlen || fclose(ofp) == EOF) {
+		if (hdrlen)
+			fclose(ofp);
+		ofp = NULL;
+		unlink(tmppath);
+		goto errref;
+	}
+	ofp = NULL;
+	if (rename(tmppath, msgpath) == -1) {
+		log_warn("warn: queue: rename: %s", tmppath);
+		unlink(tmppath);
+		goto errref;
+	}
+	fclose(ifp);
+
+	if ((dm = tree_get(&dedup_tree, msgid)) == NULL) {
+		dm = xcalloc(1, sizeof *dm, "queue_dedup_commit");
+		tree_xset(&dedup_tree, msgid, dm);
+	}
+	(void)strlcpy(dm->blob, name, sizeof dm->blob);
+
+	if (created) {
+		stat_increment("queue.dedup.miss", 1);
+		stat_set("queue.dedup.blob", stat_counter(++dedup_blobs));
+	}
+	else
+		stat_increment("queue.dedup.hit", 1);
+
+	return (1);
+
+errref:
+	unlink(refpath);
+errblob:
+	if (created)
+		unlink(blobpath);
+	goto err;
+errtmp:
+	if (ofp)
+		fclose(ofp);
+	ofp = NULL;
+	unlink(tmppath);
+err:
+	if (ifp)
+		fclose(ifp);
+	return (0);
+}
+
+/*
+ * If the message only holds its headers, return a descriptor on the
+ * headers followed by the shared body, rebuilt on the first read of the
+ * message and kept for the next ones.  fd is consumed.
+ */
+static int
+queue_dedup_fd_r(uint32_t msgid, int fd)
+{
+	struct dedup_msg	*dm;
+	char			 line[sizeof(DEDUP_MAGIC) + DEDUP_NAMELEN + 1];
+	char			 path[MAXPATHLEN];
+	char			 cachepath[MAXPATHLEN];
+	char			 tmppath[MAXPATHLEN];
+	char			*name, *eol;
+	ssize_t			 n;
+	int			 blob = -1, out = -1;
+
+	n = pread(fd, line, sizeof(line) - 1, 0);
+	if (n < (ssize_t)sizeof(DEDUP_MAGIC) - 1 ||
+	    memcmp(line, DEDUP_MAGIC, sizeof(DEDUP_MAGIC) - 1))
+		return (fd);
+
+	bsnprintf(cachepath, sizeof cachepath, "%s/%08" PRIx32 ".cache",
+	    PATH_TEMPORARY, msgid);
+	dm = tree_get(&dedup_tree, msgid);
+	if (dm && dm->cached) {
+		if ((out = open(cachepath, O_RDONLY)) != -1) {
+			close(fd);
+			stat_increment("queue.dedup.cache.hit", 1);
+			return (out);
+		}
+		log_warn("warn: queue: open: %s", cachepath);
+		dm->cached = 0;
+	}
+
+	line[n] = '\0';
+	if ((eol = strchr(line, '\n')) == NULL)
+		goto err;
+	*eol = '\0';
+	name = line + sizeof(DEDUP_MAGIC) - 1;
+	if (strchr(name, '/') || !bsnprintf(path, sizeof path, "%s/%s",
+	    PATH_DEDUP, name))
+		goto err;
+
+	if ((blob = open(path, O_RDONLY)) == -1) {
+		log_warn("warn: queue: open: %s", path);
+		goto err;
+	}
+	if ((blob = queue_message_unprocess(blob)) == -1)
+		goto err;
+
+	bsnprintf(tmppath, sizeof tmppath, "%s.tmp", cachepath);
+	if ((out = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		log_warn("warn: queue: open: %s", tmppath);
+		goto err;
+	}
+	if (lseek(fd, eol + 1 - line, SEEK_SET) == -1 ||
+	    ! queue_copy_fd(fd, out) ||
+	    ! queue_copy_fd(blob, out) ||
+	    lseek(out, 0, SEEK_SET) == -1)
+		goto errtmp;
+
+	/* without a reference, the copy is not kept */
+	if (dm && rename(tmppath, cachepath) != -1) {
+		dm->cached = 1;
+		stat_increment("queue.dedup.cache.miss", 1);
+	}
+	else
+		unlink(tmppath);
+
+	close(fd);
+	close(blob);
+	return (out);
+
+errtmp:
+	unlink(tmppath);
+err:
+	close(fd);
+	if (blob != -1)
+		close(blob);
+	if (out != -1)
+		close(out);
+	return (-1);
+}
+
+static void
+queue_dedup_uncache(uint32_t msgid, struct dedup_msg *dm)
+{
+	char	path[MAXPATHLEN];
+
+	if (! dm->cached)
+		return;
+
+	bsnprintf(path, sizeof path, "%s/%08" PRIx32 ".cache", PATH_TEMPORARY,
+	    msgid);
+	if (unlink(path) == -1 && errno != ENOENT)
+		log_warn("warn: queue: unlink: %s", path);
+	dm->cached = 0;
+}
+
+static int
+queue_copy_fd(int from, int to)
+{
+	char	 buf[8192];
+	ssize_t	 n, w, off;
+
+	while ((n = read(from, buf, sizeof buf)) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (0);
+		}
+		for (off = 0; off < n; off += w)
+			if ((w = write(to, buf + off, n - off)) == -1)
+				return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Find out which messages hold a reference to a body.  This is done by
+ * the queue process when it walks the envelopes at startup, so that the
+ * references of the messages that were not found can be dropped.
+ */
+static void
+queue_dedup_load(void)
+{
+	struct dedup_msg	*dm;
+	DIR			*dir;
+	struct dirent		*d;
+	struct stat		 sb;
+	char			 path[MAXPATHLEN];
+	char			*sep, *ep;
+	unsigned long		 msgid;
+
+	dedup_loaded = 1;
+
+	if ((dir = opendir(PATH_DEDUP)) == NULL) {
+		log_warn("warn: queue: opendir: %s", PATH_DEDUP);
+		return;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+
+		/* a body, which can go if no message links to it */
+		if ((sep = strchr(d->d_name, '-')) == NULL) {
+			bsnprintf(path, sizeof path, "%s/%s", PATH_DEDUP,
+			    d->d_name);
+			if (stat(path, &sb) == -1)
+				continue;
+			if (sb.st_nlink <= 1)
+				unlink(path);
+			else
+				dedup_blobs++;
+			continue;
+		}
+
+		/* a reference, "<body>-<msgid>" */
+		errno = 0;
+		msgid = strtoul(sep + 1, &ep, 16);
+		if (*ep || errno || msgid == 0 || msgid > UINT32_MAX ||
+		    (size_t)(sep - d->d_name) >= DEDUP_NAMELEN)
+			continue;
+		if (tree_check(&dedup_tree, msgid))
+			continue;
+		dm = xcalloc(1, sizeof *dm, "queue_dedup_load");
+		dm->restored = 1;
+		memcpy(dm->blob, d->d_name, sep - d->d_name);
+		tree_xset(&dedup_tree, msgid, dm);
+	}
+	closedir(dir);
+
+	log_debug("debug: queue: %zu shared bodies, %zu references",
+	    dedup_blobs, tree_count(&dedup_tree));
+	stat_set("queue.dedup.blob", stat_counter(dedup_blobs));
+}
+
+/*
+ * Track the number of envelopes of each message, to release its body
+ * along with the last envelope.
+ */
+static void
+queue_dedup_count(uint32_t msgid, int n)
+{
+	struct dedup_msg	*dm;
+
+	if (!(env->sc_queue_flags & QUEUE_DEDUP))
+		return;
+
+	if ((dm = tree_get(&dedup_tree, msgid)) == NULL) {
+		if (n < 0)
+			return;
+		dm = xcalloc(1, sizeof *dm, "queue_dedup_count");
+		tree_xset(&dedup_tree, msgid, dm);
+	}
+
+	if (n > 0)
+		dm->evpcount++;
+	else if (dm->evpcount && --dm->evpcount == 0)
+		queue_dedup_release(msgid);
+}
+
+/*
+ * The envelopes of the messages found at startup are counted as they are
+ * walked.  The others were counted by queue_envelope_create().
+ */
+static void
+queue_dedup_walk(uint32_t msgid)
+{
+	struct dedup_msg	*dm;
+
+	if ((dm = tree_get(&dedup_tree, msgid)) && dm->restored)
+		dm->evpcount++;
+}
+
+/*
+ * Once all envelopes are walked, the references found at startup for
+ * messages that have none are stale.
+ */
+static void
+queue_dedup_sweep(void)
+{
+	struct dedup_msg	*dm;
+	uint64_t		 msgid;
+	void			*iter;
+
+	msgid = 0;
+	for (;;) {
+		iter = NULL;
+		if (! tree_iterfrom(&dedup_tree, &iter, msgid, &msgid,
+		    (void **)&dm))
+			break;
+		if (dm->restored && dm->evpcount == 0)
+			queue_dedup_release(msgid);
+		else
+			dm->restored = 0;
+		msgid++;
+	}
+}
+
+static void
+queue_dedup_release(uint32_t msgid)
+{
+	struct dedup_msg	*dm;
+	struct stat		 sb;
+	char			 path[MAXPATHLEN];
+	char			 refpath[MAXPATHLEN];
+
+	if ((dm = tree_pop(&dedup_tree, msgid)) == NULL)
+		return;
+
+	if (dm->blob[0]) {
+		bsnprintf(path, sizeof path, "%s/%s", PATH_DEDUP, dm->blob);
+		bsnprintf(refpath, sizeof refpath, "%s-%08" PRIx32, path,
+		    msgid);
+		if (unlink(refpath) == -1 && errno != ENOENT)
+			log_warn("warn: queue: unlink: %s", refpath);
+		if (stat(path, &sb) != -1 && sb.st_nlink <= 1) {
+			log_debug("debug: queue: removing body %s", dm->blob);
+			unlink(path);
+			if (dedup_blobs)
+				dedup_blobs--;
+			stat_set("queue.dedup.blob",
+			    stat_counter(dedup_blobs));
+		}
+	}
+	queue_dedup_uncache(msgid, dm);
+	free(dm);
+}
+
 static void
 queue_envelope_cache_add(struct envelope *e)
 {
@@ -514,6 +1031,9 @@ queue_envelope_create(struct envelope *ep)
 	if (r && env->sc_queue_flags & QUEUE_EVPCACHE)
 		queue_envelope_cache_add(ep);
 
+	if (r)
+		queue_dedup_count(msgid, 1);
+
 	return (r);
 }
 
@@ -533,6 +1053,9 @@ queue_envelope_delete(uint64_t evpid)
 	    "queue-backend: queue_envelope_delete(%016"PRIx64") -> %i",
 	    evpid, r);
 
+	if (r)
+		queue_dedup_count(evpid_to_msgid(evpid), -1);
+
 	return (r);
 }
 
@@ -613,6 +1136,9 @@ queue_envelope_walk(struct envelope *ep)
 	char		 evpbuf[sizeof(struct envelope)];
 	int		 r;
 
+	if (env->sc_queue_flags & QUEUE_DEDUP && !dedup_loaded)
+		queue_dedup_load();
+
 	profile_enter("queue_envelope_walk");
 	r = handler_envelope_walk(&evpid, evpbuf, sizeof evpbuf);
 	profile_leave();
@@ -621,14 +1147,17 @@ queue_envelope_walk(struct envelope *ep)
 	    "queue-backend: queue_envelope_walk() -> %i (%016"PRIx64")",
 	    r, evpid);
 
-	if (r == -1)
+	if (r == -1) {
+		queue_dedup_sweep();
 		return (r);
+	}
 
 	if (r && queue_envelope_load_buffer(ep, evpbuf, (size_t)r)) {
 		if ((e = envelope_validate(ep)) == NULL) {
 			ep->id = evpid;
 			if (env->sc_queue_flags & QUEUE_EVPCACHE)
 				queue_envelope_cache_add(ep);
+			queue_dedup_walk(evpid_to_msgid(evpid));
 			return (1);
 		}
 		log_debug("debug: invalid envelope %016" PRIx64 ": %s",
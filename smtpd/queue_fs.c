@@ -48,6 +48,8 @@
 #define PATH_INCOMING		"/incoming"
 #define PATH_EVPTMP		PATH_INCOMING "/envelope.tmp"
 #define PATH_MESSAGE		"/message"
+#define PATH_JOURNAL		"/journal"
+#define PATH_JOURNALTMP		"/journal.tmp"
 
 /* percentage of remaining space / inodes required to accept new messages */
 #define	MINSPACE		5
@@ -58,6 +60,48 @@ struct qwalk {
 	int	 depth;
 };
 
+/*
+ * When the queue is tiered, committed messages are first kept in memory
+ * and only spilled to the filesystem if they are still queued after a
+ * delay, or when the memory limit is reached.  With the journal enabled,
+ * changes to in-memory messages are appended to a journal, and replayed
+ * on startup.  The journal is synced before a commit is acknowledged,
+ * and every second for other changes.
+ */
+struct tier_envelope {
+	char		*buf;
+	size_t		 len;
+};
+
+struct tier_message {
+	TAILQ_ENTRY(tier_message)	 entry;
+	uint32_t			 msgid;
+	int				 flags;
+	time_t				 commit;
+	char				*buf;
+	size_t				 len;
+	struct tree			 envelopes;
+};
+
+#define	TIER_COMMITTED		0x01
+#define	TIER_RESTORED		0x02
+
+struct journal_record {
+	uint32_t	type;
+	uint32_t	msgid;
+	uint64_t	evpid;
+	uint64_t	len;
+};
+
+enum {
+	JOURNAL_MESSAGE,
+	JOURNAL_MESSAGE_DELETE,
+	JOURNAL_ENVELOPE,
+	JOURNAL_ENVELOPE_DELETE,
+};
+
+#define	JOURNAL_MINSIZE		(1024 * 1024)
+
 static int	fsqueue_check_space(void);
 static void	fsqueue_envelope_path(uint64_t, char *, size_t);
 static void	fsqueue_envelope_incoming_path(uint64_t, char *, size_t);
@@ -68,10 +112,35 @@ static void	fsqueue_message_incoming_path(uint32_t, char *, size_t);
 static void    *fsqueue_qwalk_new(void);
 static int	fsqueue_qwalk(void *, uint64_t *);
 static void	fsqueue_qwalk_close(void *);
+static void	fsqueue_tier_free(struct tier_message *);
+static int	fsqueue_tier_held(struct tier_message *);
+static int	fsqueue_tier_spill(struct tier_message *);
+static void	fsqueue_tier_trim(void);
+static void	fsqueue_tier_schedule(void);
+static void	fsqueue_tier_timeout(int, short, void *);
+static void	fsqueue_tier_restore(void);
+static void	fsqueue_journal_write(int, uint32_t, uint64_t, const char *,
+    size_t);
+static void	fsqueue_journal_message(struct tier_message *);
+static int	fsqueue_journal_open(void);
+static void	fsqueue_journal_sync(void);
 
 struct tree evpcount;
 static struct timespec startup;
 
+static struct tree			tier_messages;
+static TAILQ_HEAD(, tier_message)	tier_committed;
+static struct tree			tier_restored;
+static size_t				tier_memory;
+static struct event			tier_ev;
+static int				tier_evset;
+static int				tier_loaded;
+static int				tier_walked;
+
+static FILE				*journal;
+static size_t				 journal_size;
+static int				 journal_dirty;
+
 static int
 queue_fs_message_create(uint32_t *msgid)
 {
@@ -370,6 +439,268 @@ queue_fs_envelope_walk(uint64_t *evpid, char *buf, size_t len)
 	return (-1);
 }
 
+static int
+queue_fs_tier_message_create(uint32_t *msgid)
+{
+	struct tier_message	*msg;
+	char			 rootdir[SMTPD_MAXPATHLEN];
+	struct stat		 sb;
+
+	if (!tier_loaded)
+		fsqueue_tier_restore();
+
+again:
+	*msgid = queue_generate_msgid();
+	if (tree_check(&tier_messages, *msgid))
+		goto again;
+
+	/* prevent possible collision later when spilling */
+	fsqueue_message_path(*msgid, rootdir, sizeof(rootdir));
+	if (stat(rootdir, &sb) != -1)
+		goto again;
+	if (errno != ENOENT) {
+		*msgid = 0;
+		return 0;
+	}
+
+	msg = xcalloc(1, sizeof(*msg), "queue_fs_tier_message_create");
+	msg->msgid = *msgid;
+	tree_init(&msg->envelopes);
+	tree_xset(&tier_messages, *msgid, msg);
+
+	return (1);
+}
+
+static int
+queue_fs_tier_message_commit(uint32_t msgid, const char *path)
+{
+	struct tier_message	*msg;
+	struct stat		 sb;
+	size_t			 n;
+	FILE			*fp;
+
+	if ((msg = tree_get(&tier_messages, msgid)) == NULL)
+		return (queue_fs_message_commit(msgid, path));
+
+	if ((fp = fopen(path, "rb")) == NULL) {
+		log_warn("warn: queue-fs: fopen: %s", path);
+		return (0);
+	}
+	if (fstat(fileno(fp), &sb) == -1) {
+		log_warn("warn: queue-fs: fstat");
+		fclose(fp);
+		return (0);
+	}
+	msg->len = sb.st_size;
+	msg->buf = xmalloc(msg->len + 1, "queue_fs_tier_message_commit");
+	n = fread(msg->buf, 1, msg->len, fp);
+	if (ferror(fp) || n != msg->len) {
+		log_warnx("warn: queue-fs: bad read");
+		fclose(fp);
+		free(msg->buf);
+		msg->buf = NULL;
+		msg->len = 0;
+		return (0);
+	}
+	fclose(fp);
+
+	msg->flags |= TIER_COMMITTED;
+	msg->commit = time(NULL);
+	TAILQ_INSERT_TAIL(&tier_committed, msg, entry);
+	tier_memory += msg->len;
+
+	/* the message must be on disk before the commit is acknowledged */
+	if (env->sc_queue_flags & QUEUE_JOURNAL) {
+		fsqueue_journal_message(msg);
+		fsqueue_journal_sync();
+		if (journal == NULL && !fsqueue_tier_spill(msg))
+			return (0);
+	}
+	fsqueue_tier_schedule();
+	fsqueue_tier_trim();
+
+	return (1);
+}
+
+static int
+queue_fs_tier_message_delete(uint32_t msgid)
+{
+	struct tier_message	*msg;
+
+	if ((msg = tree_get(&tier_messages, msgid)) == NULL)
+		return (queue_fs_message_delete(msgid));
+
+	if (msg->flags & TIER_COMMITTED)
+		fsqueue_journal_write(JOURNAL_MESSAGE_DELETE, msgid, 0,
+		    NULL, 0);
+	fsqueue_tier_free(msg);
+
+	return (1);
+}
+
+static int
+queue_fs_tier_message_fd_r(uint32_t msgid)
+{
+	struct tier_message	*msg;
+	int			 fd;
+
+	if ((msg = tree_get(&tier_messages, msgid)) == NULL)
+		return (queue_fs_message_fd_r(msgid));
+
+	if ((fd = mktmpfile()) == -1) {
+		log_warn("warn: queue-fs: mktmpfile");
+		return (-1);
+	}
+	if (write(fd, msg->buf, msg->len) != (ssize_t)msg->len) {
+		log_warn("warn: queue-fs: write");
+		close(fd);
+		return (-1);
+	}
+	lseek(fd, 0, SEEK_SET);
+
+	return (fd);
+}
+
+static int
+queue_fs_tier_message_corrupt(uint32_t msgid)
+{
+	struct tier_message	*msg;
+
+	/* keep it around for inspection */
+	if ((msg = tree_get(&tier_messages, msgid)) && !fsqueue_tier_spill(msg))
+		return (0);
+
+	return (queue_fs_message_corrupt(msgid));
+}
+
+static int
+queue_fs_tier_envelope_create(uint32_t msgid, const char *buf, size_t len,
+    uint64_t *evpid)
+{
+	struct tier_message	*msg;
+	struct tier_envelope	*evp;
+
+	if ((msg = tree_get(&tier_messages, msgid)) == NULL)
+		return (queue_fs_envelope_create(msgid, buf, len, evpid));
+
+	do {
+		*evpid = queue_generate_evpid(msgid);
+	} while (tree_check(&msg->envelopes, *evpid));
+
+	evp = xmalloc(sizeof(*evp), "queue_fs_tier_envelope_create");
+	evp->buf = xmemdup(buf, len, "queue_fs_tier_envelope_create");
+	evp->len = len;
+	tree_xset(&msg->envelopes, *evpid, evp);
+	tier_memory += len;
+
+	if (msg->flags & TIER_COMMITTED)
+		fsqueue_journal_write(JOURNAL_ENVELOPE, msgid, *evpid, buf, len);
+
+	return (1);
+}
+
+static int
+queue_fs_tier_envelope_delete(uint64_t evpid)
+{
+	struct tier_message	*msg;
+	struct tier_envelope	*evp;
+	uint32_t		 msgid;
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = tree_get(&tier_messages, msgid)) == NULL)
+		return (queue_fs_envelope_delete(evpid));
+
+	if ((evp = tree_pop(&msg->envelopes, evpid)) == NULL)
+		return (1);
+	tree_pop(&tier_restored, evpid);
+	tier_memory -= evp->len;
+	free(evp->buf);
+	free(evp);
+
+	if (tree_empty(&msg->envelopes))
+		return (queue_fs_tier_message_delete(msgid));
+
+	if (msg->flags & TIER_COMMITTED)
+		fsqueue_journal_write(JOURNAL_ENVELOPE_DELETE, msgid, evpid,
+		    NULL, 0);
+
+	return (1);
+}
+
+static int
+queue_fs_tier_envelope_update(uint64_t evpid, const char *buf, size_t len)
+{
+	struct tier_message	*msg;
+	struct tier_envelope	*evp;
+	uint32_t		 msgid;
+
+	msgid = evpid_to_msgid(evpid);
+	if ((msg = tree_get(&tier_messages, msgid)) == NULL)
+		return (queue_fs_envelope_update(evpid, buf, len));
+
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		return (0);
+	tier_memory -= evp->len;
+	free(evp->buf);
+	evp->buf = xmemdup(buf, len, "queue_fs_tier_envelope_update");
+	evp->len = len;
+	tier_memory += len;
+
+	if (msg->flags & TIER_COMMITTED)
+		fsqueue_journal_write(JOURNAL_ENVELOPE, msgid, evpid, buf, len);
+
+	return (1);
+}
+
+static int
+queue_fs_tier_envelope_load(uint64_t evpid, char *buf, size_t len)
+{
+	struct tier_message	*msg;
+	struct tier_envelope	*evp;
+
+	if ((msg = tree_get(&tier_messages, evpid_to_msgid(evpid))) == NULL)
+		return (queue_fs_envelope_load(evpid, buf, len));
+
+	if ((evp = tree_get(&msg->envelopes, evpid)) == NULL)
+		return (0);
+	if (evp->len >= len) {
+		log_warnx("warn: queue-fs: too large");
+		return (0);
+	}
+	memmove(buf, evp->buf, evp->len);
+	buf[evp->len] = '\0';
+
+	return (evp->len);
+}
+
+static int
+queue_fs_tier_envelope_walk(uint64_t *evpid, char *buf, size_t len)
+{
+	void	*iter;
+	int	 r;
+
+	if (!tier_loaded)
+		fsqueue_tier_restore();
+
+	/* messages restored from the journal come first */
+	for (;;) {
+		iter = NULL;
+		if (tree_iter(&tier_restored, &iter, evpid, NULL) == 0)
+			break;
+		tree_xpop(&tier_restored, *evpid);
+		bzero(buf, len);
+		if ((r = queue_fs_tier_envelope_load(*evpid, buf, len)))
+			return (r);
+	}
+
+	if ((r = queue_fs_envelope_walk(evpid, buf, len)) == -1 &&
+	    !tier_walked) {
+		tier_walked = 1;
+		fsqueue_tier_trim();
+	}
+	return (r);
+}
+
 static int
 fsqueue_check_space(void)
 {
@@ -606,6 +937,398 @@ fsqueue_qwalk(void *hdl, uint64_t *evpid)
 	return (0);
 }
 
+static void
+fsqueue_tier_free(struct tier_message *msg)
+{
+	struct tier_envelope	*evp;
+	uint64_t		 evpid;
+
+	/* deleted before the walk got to them */
+	while (tree_poproot(&msg->envelopes, &evpid, (void**)&evp)) {
+		tree_pop(&tier_restored, evpid);
+		tier_memory -= evp->len;
+		free(evp->buf);
+		free(evp);
+	}
+	if (msg->flags & TIER_COMMITTED)
+		TAILQ_REMOVE(&tier_committed, msg, entry);
+	tier_memory -= msg->len;
+	tree_xpop(&tier_messages, msg->msgid);
+	free(msg->buf);
+	free(msg);
+}
+
+/*
+ * Write a committed message and its envelopes to the incoming directory,
+ * then commit it to the queue as the fs backend would have done.
+ */
+static int
+fsqueue_tier_spill(struct tier_message *msg)
+{
+	struct tier_envelope	*evp;
+	char			 rootdir[SMTPD_MAXPATHLEN];
+	char			 path[SMTPD_MAXPATHLEN];
+	uint64_t		 evpid;
+	uintptr_t		 n;
+	void			*iter;
+	FILE			*fp;
+
+	if (fsqueue_tier_held(msg))
+		return (0);
+
+	if (! fsqueue_check_space())
+		return (0);
+
+	fsqueue_message_incoming_path(msg->msgid, rootdir, sizeof(rootdir));
+	if (mkdir(rootdir, 0700) == -1) {
+		log_warn("warn: queue-fs: mkdir");
+		return (0);
+	}
+
+	n = 0;
+	iter = NULL;
+	while (tree_iter(&msg->envelopes, &iter, &evpid, (void**)&evp)) {
+		fsqueue_envelope_incoming_path(evpid, path, sizeof(path));
+		if (! fsqueue_envelope_dump(path, evp->buf, evp->len, 0, 1))
+			goto fail;
+		n += 1;
+	}
+
+	strlcpy(path, rootdir, sizeof(path));
+	strlcat(path, PATH_MESSAGE, sizeof(path));
+	if ((fp = fopen(path, "w")) == NULL) {
+		log_warn("warn: queue-fs: fopen");
+		goto fail;
+	}
+	if (fwrite(msg->buf, 1, msg->len, fp) != msg->len ||
+	    fflush(fp) || fsync(fileno(fp))) {
+		log_warn("warn: queue-fs: write");
+		fclose(fp);
+		goto fail;
+	}
+	fclose(fp);
+
+	if (! queue_fs_message_commit(msg->msgid, path))
+		goto fail;
+	tree_xset(&evpcount, msg->msgid, (void*)n);
+
+	fsqueue_journal_write(JOURNAL_MESSAGE_DELETE, msg->msgid, 0, NULL, 0);
+	fsqueue_journal_sync();
+
+	log_debug("debug: queue-fs: spilled msg:%08" PRIx32 " (%zu bytes)",
+	    msg->msgid, msg->len);
+	stat_increment("queue.tier.spill", 1);
+
+	fsqueue_tier_free(msg);
+	return (1);
+
+fail:
+	if (rmtree(rootdir, 0) == -1)
+		log_warn("warn: queue-fs: rmtree");
+	return (0);
+}
+
+/*
+ * Messages restored from the journal are reported by the envelope walk
+ * from memory, and must stay there until the walk is over: the fs walk
+ * skips the envelopes written after startup.
+ */
+static int
+fsqueue_tier_held(struct tier_message *msg)
+{
+	return ((msg->flags & TIER_RESTORED) && !tier_walked);
+}
+
+/*
+ * Make room by spilling the oldest messages.
+ */
+static void
+fsqueue_tier_trim(void)
+{
+	struct tier_message	*msg, *next;
+
+	for (msg = TAILQ_FIRST(&tier_committed); msg &&
+	    tier_memory > env->sc_queue_tier_maxmem; msg = next) {
+		next = TAILQ_NEXT(msg, entry);
+		if (fsqueue_tier_held(msg))
+			continue;
+		if (! fsqueue_tier_spill(msg))
+			break;
+	}
+}
+
+static void
+fsqueue_tier_schedule(void)
+{
+	struct timeval	tv;
+
+	if (!tier_evset) {
+		evtimer_set(&tier_ev, fsqueue_tier_timeout, NULL);
+		tier_evset = 1;
+	}
+	if (evtimer_pending(&tier_ev, NULL))
+		return;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&tier_ev, &tv);
+}
+
+static void
+fsqueue_tier_timeout(int fd, short event, void *p)
+{
+	struct tier_message	*msg, *next;
+	time_t			 now;
+
+	now = time(NULL);
+	for (msg = TAILQ_FIRST(&tier_committed); msg; msg = next) {
+		next = TAILQ_NEXT(msg, entry);
+		if (msg->commit + env->sc_queue_tier_delay > now)
+			break;
+		if (fsqueue_tier_held(msg))
+			continue;
+		if (! fsqueue_tier_spill(msg))
+			break;
+	}
+
+	fsqueue_journal_sync();
+
+	stat_set("queue.tier.message",
+	    stat_counter(tree_count(&tier_messages)));
+	stat_set("queue.tier.memory", stat_counter(tier_memory));
+
+	if (!tree_empty(&tier_messages) || journal_dirty)
+		fsqueue_tier_schedule();
+}
+
+/*
+ * Replay the journal left by a previous run.  This is done by the queue
+ * process when it first walks the envelopes, which then reports the
+ * restored messages to the scheduler.
+ */
+static void
+fsqueue_tier_restore(void)
+{
+	struct journal_record	 rec;
+	struct tier_message	*msg, *next;
+	struct tier_envelope	*evp;
+	struct stat		 sb;
+	uint64_t		 evpid;
+	char			 path[SMTPD_MAXPATHLEN];
+	char			*buf;
+	void			*iter;
+	FILE			*fp;
+
+	tier_loaded = 1;
+	if (!(env->sc_queue_flags & QUEUE_JOURNAL))
+		return;
+
+	if ((fp = fopen(PATH_JOURNAL, "rb")) == NULL) {
+		if (errno != ENOENT)
+			fatal("queue-fs: fopen: " PATH_JOURNAL);
+		return;
+	}
+
+	while (fread(&rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+		buf = NULL;
+		if (rec.len) {
+			buf = xmalloc(rec.len + 1, "fsqueue_tier_restore");
+			if (fread(buf, 1, rec.len, fp) != rec.len) {
+				/* truncated record, stop here */
+				free(buf);
+				break;
+			}
+		}
+
+		msg = tree_get(&tier_messages, rec.msgid);
+		switch (rec.type) {
+		case JOURNAL_MESSAGE:
+			if (msg == NULL) {
+				msg = xcalloc(1, sizeof(*msg),
+				    "fsqueue_tier_restore");
+				msg->msgid = rec.msgid;
+				msg->flags = TIER_COMMITTED | TIER_RESTORED;
+				msg->commit = time(NULL);
+				tree_init(&msg->envelopes);
+				tree_xset(&tier_messages, msg->msgid, msg);
+				TAILQ_INSERT_TAIL(&tier_committed, msg, entry);
+			}
+			tier_memory -= msg->len;
+			free(msg->buf);
+			msg->buf = buf;
+			msg->len = rec.len;
+			tier_memory += msg->len;
+			buf = NULL;
+			break;
+
+		case JOURNAL_MESSAGE_DELETE:
+			if (msg)
+				fsqueue_tier_free(msg);
+			break;
+
+		case JOURNAL_ENVELOPE:
+			if (msg == NULL)
+				break;
+			if ((evp = tree_get(&msg->envelopes, rec.evpid))) {
+				tier_memory -= evp->len;
+				free(evp->buf);
+			}
+			else {
+				evp = xmalloc(sizeof(*evp),
+				    "fsqueue_tier_restore");
+				tree_xset(&msg->envelopes, rec.evpid, evp);
+			}
+			evp->buf = buf;
+			evp->len = rec.len;
+			tier_memory += evp->len;
+			buf = NULL;
+			break;
+
+		case JOURNAL_ENVELOPE_DELETE:
+			if (msg == NULL)
+				break;
+			if ((evp = tree_pop(&msg->envelopes, rec.evpid))) {
+				tier_memory -= evp->len;
+				free(evp->buf);
+				free(evp);
+			}
+			if (tree_empty(&msg->envelopes))
+				fsqueue_tier_free(msg);
+			break;
+
+		default:
+			fatalx("queue-fs: " PATH_JOURNAL ": bad journal record");
+		}
+		free(buf);
+	}
+	fclose(fp);
+
+	for (msg = TAILQ_FIRST(&tier_committed); msg; msg = next) {
+		next = TAILQ_NEXT(msg, entry);
+		/* spilled, but the journal did not record it */
+		fsqueue_message_path(msg->msgid, path, sizeof(path));
+		if (stat(path, &sb) != -1) {
+			fsqueue_tier_free(msg);
+			continue;
+		}
+		iter = NULL;
+		while (tree_iter(&msg->envelopes, &iter, &evpid, NULL))
+			tree_xset(&tier_restored, evpid, NULL);
+	}
+
+	log_debug("debug: queue-fs: restored %zu messages from journal",
+	    tree_count(&tier_messages));
+
+	if (!tree_empty(&tier_messages))
+		fsqueue_tier_schedule();
+}
+
+static void
+fsqueue_journal_write(int type, uint32_t msgid, uint64_t evpid,
+    const char *buf, size_t len)
+{
+	struct journal_record	rec;
+
+	if (!(env->sc_queue_flags & QUEUE_JOURNAL))
+		return;
+
+	/* opening the journal dumps the whole state, replay is idempotent */
+	if (journal == NULL && !fsqueue_journal_open())
+		return;
+
+	rec.type = type;
+	rec.msgid = msgid;
+	rec.evpid = evpid;
+	rec.len = len;
+	if (fwrite(&rec, 1, sizeof(rec), journal) != sizeof(rec) ||
+	    (len && fwrite(buf, 1, len, journal) != len)) {
+		log_warn("warn: queue-fs: journal write");
+		fclose(journal);
+		journal = NULL;
+		return;
+	}
+	journal_size += sizeof(rec) + len;
+	journal_dirty = 1;
+	fsqueue_tier_schedule();
+}
+
+static void
+fsqueue_journal_message(struct tier_message *msg)
+{
+	struct tier_envelope	*evp;
+	uint64_t		 evpid;
+	void			*iter;
+
+	fsqueue_journal_write(JOURNAL_MESSAGE, msg->msgid, 0, msg->buf,
+	    msg->len);
+	if (journal == NULL)
+		return;
+
+	iter = NULL;
+	while (tree_iter(&msg->envelopes, &iter, &evpid, (void**)&evp))
+		fsqueue_journal_write(JOURNAL_ENVELOPE, msg->msgid, evpid,
+		    evp->buf, evp->len);
+}
+
+/*
+ * (Re)create the journal with the current set of in-memory messages, so
+ * that it does not grow forever.
+ */
+static int
+fsqueue_journal_open(void)
+{
+	struct tier_message	*msg;
+
+	if (journal)
+		fclose(journal);
+
+	if ((journal = fopen(PATH_JOURNALTMP, "w")) == NULL) {
+		log_warn("warn: queue-fs: fopen: %s", PATH_JOURNALTMP);
+		return (0);
+	}
+	journal_size = 0;
+
+	TAILQ_FOREACH(msg, &tier_committed, entry) {
+		fsqueue_journal_message(msg);
+		if (journal == NULL)
+			return (0);
+	}
+
+	if (fflush(journal) || fsync(fileno(journal)) ||
+	    rename(PATH_JOURNALTMP, PATH_JOURNAL) == -1) {
+		log_warn("warn: queue-fs: journal");
+		fclose(journal);
+		journal = NULL;
+		return (0);
+	}
+	journal_dirty = 0;
+
+	return (1);
+}
+
+static void
+fsqueue_journal_sync(void)
+{
+	if (journal == NULL)
+		return;
+
+	if (journal_size > JOURNAL_MINSIZE && journal_size > 2 * tier_memory) {
+		fsqueue_journal_open();
+		return;
+	}
+
+	if (!journal_dirty)
+		return;
+
+	if (fflush(journal) || fsync(fileno(journal))) {
+		log_warn("warn: queue-fs: journal sync");
+		fclose(journal);
+		journal = NULL;
+		return;
+	}
+	journal_dirty = 0;
+}
+
 static int
 queue_fs_init(struct passwd *pw, int server)
 {
@@ -636,6 +1359,25 @@ queue_fs_init(struct passwd *pw, int server)
 
 	tree_init(&evpcount);
 
+	if (server && env->sc_queue_flags & QUEUE_TIERED) {
+		tree_init(&tier_messages);
+		tree_init(&tier_restored);
+		TAILQ_INIT(&tier_committed);
+
+		queue_api_on_message_create(queue_fs_tier_message_create);
+		queue_api_on_message_commit(queue_fs_tier_message_commit);
+		queue_api_on_message_delete(queue_fs_tier_message_delete);
+		queue_api_on_message_fd_r(queue_fs_tier_message_fd_r);
+		queue_api_on_message_corrupt(queue_fs_tier_message_corrupt);
+		queue_api_on_envelope_create(queue_fs_tier_envelope_create);
+		queue_api_on_envelope_delete(queue_fs_tier_envelope_delete);
+		queue_api_on_envelope_update(queue_fs_tier_envelope_update);
+		queue_api_on_envelope_load(queue_fs_tier_envelope_load);
+		queue_api_on_envelope_walk(queue_fs_tier_envelope_walk);
+
+		return (ret);
+	}
+
 	queue_api_on_message_create(queue_fs_message_create);
 	queue_api_on_message_commit(queue_fs_message_commit);
 	queue_api_on_message_delete(queue_fs_message_delete);
@@ -145,7 +145,7 @@ queue_ram_message_delete(uint32_t msgid)
 		log_warnx("warn: queue-ram: not found");
 		return (0);
 	}
-	while (tree_poproot(&messages, &evpid, (void**)&evp)) {
+	while (tree_poproot(&msg->envelopes, &evpid, (void**)&evp)) {
 		stat_decrement("queue.ram.envelope.size", evp->len);
 		free(evp->buf);
 		free(evp);
@@ -153,7 +153,7 @@ queue_ram_message_delete(uint32_t msgid)
 	stat_decrement("queue.ram.message.size", msg->len);
 	free(msg->buf);
 	free(msg);
-	return (0);
+	return (1);
 }
 
 static int
@@ -51,13 +51,36 @@ static void scheduler_reset_events(void);
 static void scheduler_timeout(int, short, void *);
 static void scheduler_process_remove(struct scheduler_batch *);
 static void scheduler_process_expire(struct scheduler_batch *);
+static void scheduler_process_drop(struct scheduler_batch *, int, const char *);
+static int scheduler_evpid_cmp(const void *, const void *);
 static void scheduler_process_bounce(struct scheduler_batch *);
 static void scheduler_process_mda(struct scheduler_batch *);
 static void scheduler_process_mta(struct scheduler_batch *);
+static void scheduler_process_prefetch(void);
+static void scheduler_prefetch(struct scheduler_info *, struct envelope *);
+static void scheduler_hold(const char *, time_t);
+static void scheduler_held(struct scheduler_info *, struct envelope *);
 
 static struct scheduler_backend *backend = NULL;
 static struct event		 ev;
 
+/* hosts that the mta will not be able to reach before a given time */
+static struct dict		 holds;
+
+/*
+ * The first envelope to be scheduled for each mta destination, whose
+ * MXs are resolved shortly before it is due.
+ */
+struct prefetch {
+	struct prefetch		*next;
+	uint64_t		 evpid;
+	time_t			 sched;
+	char			 dest[SMTPD_MAXHOSTNAMELEN];
+};
+static struct dict		 prefetches;
+static time_t			 prefetch_next;	/* next one due, 0 if none */
+static time_t			 prefetch_last;
+
 extern const char *backend_scheduler;
 
 #define	MSGBATCHSIZE	1024
@@ -79,6 +102,7 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 	uint32_t       		 penalty;
 	size_t			 n, i;
 	time_t			 timestamp;
+	const char		*host;
 	int			 v;
 
 	switch (imsg->hdr.type) {
@@ -90,6 +114,8 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		log_trace(TRACE_SCHEDULER,
 		    "scheduler: inserting evp:%016" PRIx64, evp.id);
 		scheduler_info(&si, &evp, 0);
+		scheduler_held(&si, &evp);
+		scheduler_prefetch(&si, &evp);
 		stat_increment("scheduler.envelope.incoming", 1);
 		backend->insert(&si);
 		return;
@@ -155,6 +181,8 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		log_trace(TRACE_SCHEDULER,
 		    "scheduler: updating evp:%016" PRIx64, evp.id);
 		scheduler_info(&si, &evp, penalty);
+		scheduler_held(&si, &evp);
+		scheduler_prefetch(&si, &evp);
 		backend->update(&si);
 		stat_increment("scheduler.delivery.tempfail", 1);
 		stat_decrement("scheduler.envelope.inflight", 1);
@@ -273,6 +301,14 @@ scheduler_imsg(struct mproc *p, struct imsg *imsg)
 		scheduler_reset_events();
 		return;
 
+	case IMSG_MTA_HOLD:
+		m_msg(&m, imsg);
+		m_get_string(&m, &host);
+		m_get_time(&m, &timestamp);
+		m_end(&m);
+		scheduler_hold(host, timestamp);
+		return;
+
 	case IMSG_CTL_REMOVE:
 		id = *(uint64_t *)(imsg->data);
 		if (id <= 0xffffffffL)
@@ -377,6 +413,8 @@ scheduler(void)
 	fdlimit(1.0);
 
 	backend->init();
+	dict_init(&holds);
+	dict_init(&prefetches);
 
 	if (chroot(PATH_CHROOT) == -1)
 		fatal("scheduler: chroot");
@@ -436,6 +474,9 @@ scheduler_timeout(int fd, short event, void *p)
 
 	backend->batch(typemask, &batch);
 
+	if (typemask & SCHED_MTA)
+		scheduler_process_prefetch();
+
 	switch (batch.type) {
 	case SCHED_NONE:
 		log_trace(TRACE_SCHEDULER, "scheduler: SCHED_NONE");
@@ -445,6 +486,13 @@ scheduler_timeout(int fd, short event, void *p)
 		tv.tv_sec = batch.delay;
 		log_trace(TRACE_SCHEDULER,
 		    "scheduler: SCHED_DELAY %s", duration_to_text(tv.tv_sec));
+		/* wake up in time to prefetch the next destination */
+		if (typemask & SCHED_MTA && prefetch_next &&
+		    prefetch_next < time(NULL) + tv.tv_sec) {
+			tv.tv_sec = prefetch_next - time(NULL);
+			if (tv.tv_sec < 1)
+				tv.tv_sec = 1;
+		}
 		break;
 
 	case SCHED_REMOVE:
@@ -487,15 +535,7 @@ scheduler_timeout(int fd, short event, void *p)
 static void
 scheduler_process_remove(struct scheduler_batch *batch)
 {
-	size_t	i;
-
-	for (i = 0; i < batch->evpcount; i++) {
-		log_debug("debug: scheduler: evp:%016" PRIx64 " removed",
-		    batch->evpids[i]);
-		m_create(p_queue, IMSG_QUEUE_REMOVE, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
-		m_close(p_queue);
-	}
+	scheduler_process_drop(batch, IMSG_QUEUE_REMOVE, "removed");
 
 	stat_decrement("scheduler.envelope", batch->evpcount);
 	stat_increment("scheduler.envelope.removed", batch->evpcount);
@@ -504,18 +544,59 @@ scheduler_process_remove(struct scheduler_batch *batch)
 static void
 scheduler_process_expire(struct scheduler_batch *batch)
 {
-	size_t	i;
+	scheduler_process_drop(batch, IMSG_QUEUE_EXPIRE, "expired");
 
-	for (i = 0; i < batch->evpcount; i++) {
-		log_debug("debug: scheduler: evp:%016" PRIx64 " expired",
-		    batch->evpids[i]);
-		m_create(p_queue, IMSG_QUEUE_EXPIRE, 0, 0, -1);
-		m_add_evpid(p_queue, batch->evpids[i]);
+	stat_decrement("scheduler.envelope", batch->evpcount);
+	stat_increment("scheduler.envelope.expired", batch->evpcount);
+}
+
+/*
+ * Send removed or expired envelopes to the queue grouped by message,
+ * so that it can handle them in one go.  The queue is also told when
+ * the scheduler holds no other envelope for that message, in which
+ * case it may drop the whole message at once.
+ */
+static void
+scheduler_process_drop(struct scheduler_batch *batch, int type,
+    const char *what)
+{
+	uint32_t	msgid, m;
+	size_t		i, j;
+	int		all;
+
+	qsort(batch->evpids, batch->evpcount, sizeof(*batch->evpids),
+	    scheduler_evpid_cmp);
+
+	for (i = 0; i < batch->evpcount; i = j) {
+		msgid = evpid_to_msgid(batch->evpids[i]);
+		all = (backend->messages(msgid, &m, 1) == 0 || m != msgid);
+
+		log_debug("debug: scheduler: msg:%08" PRIx32 " %s%s", msgid,
+		    what, all ? " (all envelopes)" : "");
+
+		m_create(p_queue, type, 0, 0, -1);
+		m_add_msgid(p_queue, msgid);
+		m_add_int(p_queue, all);
+		for (j = i; j < batch->evpcount; j++) {
+			if (evpid_to_msgid(batch->evpids[j]) != msgid)
+				break;
+			log_debug("debug: scheduler: evp:%016" PRIx64 " %s",
+			    batch->evpids[j], what);
+			m_add_evpid(p_queue, batch->evpids[j]);
+		}
 		m_close(p_queue);
 	}
+}
 
-	stat_decrement("scheduler.envelope", batch->evpcount);
-	stat_increment("scheduler.envelope.expired", batch->evpcount);
+static int
+scheduler_evpid_cmp(const void *a, const void *b)
+{
+	uint64_t	x = *(const uint64_t *)a;
+	uint64_t	y = *(const uint64_t *)b;
+
+	if (x < y)
+		return (-1);
+	return (x > y);
 }
 
 static void
@@ -565,3 +646,136 @@ scheduler_process_mta(struct scheduler_batch *batch)
 
 	stat_increment("scheduler.envelope.inflight", batch->evpcount);
 }
+
+/*
+ * Remember the first envelope to be scheduled for the destination of
+ * this one.  Envelopes scheduled right away are not worth it: the mta
+ * resolves their destination when it gets them.
+ */
+static void
+scheduler_prefetch(struct scheduler_info *si, struct envelope *evp)
+{
+	struct prefetch	*p;
+	char		 buf[SMTPD_MAXHOSTNAMELEN];
+	const char	*dest;
+	time_t		 sched;
+
+	if (si->type != D_MTA || env->sc_mta_prefetch == 0)
+		return;
+
+	sched = scheduler_compute_schedule(si);
+	if (sched <= time(NULL))
+		return;
+
+	if (evp->agent.mta.relay.hostname[0])
+		dest = evp->agent.mta.relay.hostname;
+	else
+		dest = evp->dest.domain;
+	if (! lowercase(buf, dest, sizeof buf))
+		return;
+
+	if ((p = dict_get(&prefetches, buf)) == NULL) {
+		p = xcalloc(1, sizeof *p, "scheduler_prefetch");
+		(void)strlcpy(p->dest, buf, sizeof p->dest);
+		dict_set(&prefetches, p->dest, p);
+	}
+	else if (p->sched <= sched)
+		return;
+
+	p->evpid = evp->id;
+	p->sched = sched;
+	if (prefetch_next == 0 || sched - env->sc_mta_prefetch < prefetch_next)
+		prefetch_next = sched - env->sc_mta_prefetch;
+}
+
+/*
+ * Let the mta resolve the destinations that are about to be scheduled,
+ * so that their envelopes can be sent as soon as they are due.  A single
+ * envelope is sent for each destination.
+ */
+static void
+scheduler_process_prefetch(void)
+{
+	struct prefetch	*p, *done;
+	void		*iter;
+	const char	*key;
+	time_t		 now;
+
+	now = time(NULL);
+	if (prefetch_next == 0 || prefetch_next > now || prefetch_last == now)
+		return;
+	prefetch_last = now;
+
+	done = NULL;
+	prefetch_next = 0;
+	iter = NULL;
+	while (dict_iter(&prefetches, &iter, &key, (void **)&p)) {
+		if (p->sched > now + env->sc_mta_prefetch) {
+			if (prefetch_next == 0 ||
+			    p->sched - env->sc_mta_prefetch < prefetch_next)
+				prefetch_next = p->sched - env->sc_mta_prefetch;
+			continue;
+		}
+		if (p->sched > now) {
+			log_trace(TRACE_SCHEDULER, "scheduler: evp:%016" PRIx64
+			    " prefetch %s (mta)", p->evpid, p->dest);
+			m_create(p_queue, IMSG_MTA_PREFETCH, 0, 0, -1);
+			m_add_evpid(p_queue, p->evpid);
+			m_close(p_queue);
+		}
+		p->next = done;
+		done = p;
+	}
+
+	while ((p = done)) {
+		done = p->next;
+		dict_xpop(&prefetches, p->dest);
+		free(p);
+	}
+}
+
+static void
+scheduler_hold(const char *host, time_t until)
+{
+	time_t	*t;
+
+	log_trace(TRACE_SCHEDULER, "scheduler: hold %s until %lld", host,
+	    (long long)until);
+
+	if (until == 0) {
+		free(dict_pop(&holds, host));
+		return;
+	}
+
+	if ((t = dict_get(&holds, host)) == NULL) {
+		t = xmalloc(sizeof *t, "scheduler_hold");
+		dict_set(&holds, host, t);
+	}
+	*t = until;
+}
+
+/*
+ * The destination of this envelope is known to be unreachable for now:
+ * add a penalty so that it is not scheduled before the mta can retry.
+ */
+static void
+scheduler_held(struct scheduler_info *si, struct envelope *evp)
+{
+	char	 buf[SMTPD_MAXHOSTNAMELEN];
+	time_t	*t;
+
+	if (si->type != D_MTA)
+		return;
+	if (! lowercase(buf, evp->dest.domain, sizeof buf))
+		return;
+	if ((t = dict_get(&holds, buf)) == NULL)
+		return;
+
+	if (*t <= time(NULL)) {
+		free(dict_xpop(&holds, buf));
+		return;
+	}
+
+	while (si->penalty < UINT8_MAX && scheduler_compute_schedule(si) < *t)
+		si->penalty++;
+}
@@ -22,6 +22,9 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+
+#include <netinet/in.h>
 
 #include <err.h>
 #include <errno.h>
@@ -33,6 +36,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <openssl/ssl.h>
@@ -50,10 +54,72 @@ static void smtp_resume(void);
 static void smtp_accept(int, short, void *);
 static int smtp_enqueue(uid_t *);
 static int smtp_can_accept(void);
+static int smtp_source_connect(const struct sockaddr_storage *,
+    struct smtp_source **);
+static struct smtp_source *smtp_source_get(const struct sockaddr_storage *,
+    int);
+static int smtp_source_take(struct smtp_source *, int);
+static int smtp_limits_enabled(void);
+static size_t smtp_limit_rate(const struct smtp_limit *, int);
+static int smtp_counter_open(volatile uint32_t *, size_t);
+static int smtp_counter_take(volatile uint64_t *, size_t, time_t);
+static uint32_t smtp_source_hash(const struct smtp_source *);
+static void smtp_source_grow(void);
+static void smtp_source_expire(int, short, void *);
 
 #define	SMTP_FD_RESERVE	5
 static size_t	sessions;
 
+/*
+ * Connections, sessions, commands and recipients can be limited for
+ * each source address and for each network.  The state is kept in a
+ * hash table of small entries, keyed by address family, prefix length
+ * and masked address.  Entries go away once they are unused and their
+ * buckets are full again.
+ */
+enum {
+	SMTP_BUCKET_CONN = 0,
+	SMTP_BUCKET_CMD,
+	SMTP_BUCKET_RCPT,
+	SMTP_BUCKET_COUNT
+};
+
+/*
+ * With several smtp workers, the counters of the entries live in memory
+ * shared by the workers, in a slot chosen by hashing the key, so that
+ * the limits apply to all the sessions of the daemon.  Entries hashing
+ * to the same slot share their counters, which can only make the limits
+ * stricter.  Each bucket packs the second it was last refilled with its
+ * level, so that it can be updated at once.
+ */
+struct smtp_counter {
+	volatile uint32_t	 sessions;
+	volatile uint64_t	 bucket[SMTP_BUCKET_COUNT];
+};
+
+struct smtp_source {
+	struct smtp_source	*next;
+	struct smtp_source	*network;	/* NULL for a network entry */
+	uint8_t			 family;
+	uint8_t			 prefixlen;
+	uint8_t			 addr[16];
+	uint32_t		 sessions;	/* in this process */
+	uint32_t		 refs;		/* address entries */
+	time_t			 last;		/* used in this process */
+	struct smtp_counter	*counter;
+	struct smtp_counter	 own;		/* with a single worker */
+};
+
+#define	SMTP_SOURCE_HASHSIZE	1024	/* initial size */
+#define	SMTP_SOURCE_EXPIRE	10	/* seconds between sweeps */
+#define	SMTP_COUNTERS		16384	/* shared slots */
+
+static struct smtp_source	**sources;
+static size_t			  sources_size;
+static size_t			  sources_count;
+static struct event		  sources_ev;
+static struct smtp_counter	 *counters;
+
 static void
 smtp_imsg(struct mproc *p, struct imsg *imsg)
 {
@@ -181,6 +247,10 @@ smtp_imsg(struct mproc *p, struct imsg *imsg)
 			m_end(&m);
 			profiling = v;
 			return;
+
+		case IMSG_SMTP_TICKET_KEY:
+			ssl_smtp_ticket_key(imsg->data);
+			return;
 		}
 	}
 
@@ -256,6 +326,8 @@ smtp(void)
 		fatal("smtp: chdir(\"/\")");
 
 	config_process(PROC_SMTP);
+	if (env->sc_smtp_workers > 1)
+		setproctitle("%s %d", proc_title(PROC_SMTP), smtp_worker);
 
 	if (setgroups(1, &pw->pw_gid) ||
 	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
@@ -288,6 +360,38 @@ smtp(void)
 	return (0);
 }
 
+/*
+ * Session and request ids carry the index of the smtp worker that
+ * generated them in their top bits, so that the other processes can
+ * route their answers back to it.
+ */
+#define	SMTP_WORKER_SHIFT	60
+
+uint64_t
+smtp_generate_id(void)
+{
+	uint64_t	id;
+
+	do {
+		id = generate_uid() & ((1ULL << SMTP_WORKER_SHIFT) - 1);
+		id |= (uint64_t)smtp_worker << SMTP_WORKER_SHIFT;
+	} while (id == 0);
+
+	return (id);
+}
+
+struct mproc *
+smtp_worker_for(uint64_t id)
+{
+	int	i;
+
+	i = id >> SMTP_WORKER_SHIFT;
+	if (i >= env->sc_smtp_workers)
+		fatalx("smtp_worker_for: bad worker in id");
+
+	return (p_smtp_worker[i]);
+}
+
 static void
 smtp_setup_events(void)
 {
@@ -317,6 +421,7 @@ smtp_setup_events(void)
 			fatal("smtp_setup_events: certificate tree corrupted");
 		if (! ssl_setup((SSL_CTX **)&l->ssl_ctx, ssl))
 			fatal("smtp_setup_events: ssl_setup failure");
+		ssl_smtp_session_cache(l->ssl_ctx);
 	}
 
 	purge_config(PURGE_SSL);
@@ -381,7 +486,8 @@ smtp_enqueue(uid_t *euid)
 		hostname = buf;
 	}
 
-	if ((smtp_session(listener, fd[0], &listener->ss, hostname)) == -1) {
+	if ((smtp_session(listener, fd[0], &listener->ss, hostname, NULL))
+	    == -1) {
 		close(fd[0]);
 		close(fd[1]);
 		return (-1);
@@ -397,7 +503,10 @@ smtp_enqueue(uid_t *euid)
 static void
 smtp_accept(int fd, short event, void *p)
 {
+	static const char	 refused[] =
+	    "421 4.7.0 Too many connections, try again later\r\n";
 	struct listener		*listener = p;
+	struct smtp_source	*source;
 	struct sockaddr_storage	 ss;
 	socklen_t		 len;
 	int			 sock;
@@ -423,8 +532,20 @@ smtp_accept(int fd, short event, void *p)
 		fatal("smtp_accept");
 	}
 
-	if (smtp_session(listener, sock, &ss, NULL) == -1) {
+	/* Turn the client away before doing any work for it */
+	if (! smtp_source_connect(&ss, &source)) {
+		log_debug("debug: smtp: refusing connection from %s",
+		    ss_to_text(&ss));
+		/* Do not talk in clear to a client expecting TLS */
+		if (!(listener->flags & F_SMTPS))
+			(void)write(sock, refused, sizeof(refused) - 1);
+		close(sock);
+		return;
+	}
+
+	if (smtp_session(listener, sock, &ss, NULL, source) == -1) {
 		log_warn("warn: Failed to create SMTP session");
+		smtp_source_disconnect(source);
 		close(sock);
 		return;
 	}
@@ -472,3 +593,364 @@ smtp_collect(void)
 		smtp_resume();
 	}
 }
+
+/*
+ * Called by the parent before forking the smtp workers, and again once
+ * they are forked to release the memory.
+ */
+void
+smtp_counters_init(void)
+{
+	if (env->sc_smtp_workers <= 1 || !smtp_limits_enabled())
+		return;
+
+	counters = mmap(NULL, SMTP_COUNTERS * sizeof(*counters),
+	    PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (counters == MAP_FAILED)
+		fatal("smtp_counters_init: mmap");
+}
+
+void
+smtp_counters_free(void)
+{
+	if (counters == NULL)
+		return;
+
+	munmap(counters, SMTP_COUNTERS * sizeof(*counters));
+	counters = NULL;
+}
+
+/*
+ * Account for a new connection from the given address.  Return 0 if
+ * it must be refused.  Otherwise, the source entry to use for the
+ * session is set, NULL if no limits apply.
+ */
+static int
+smtp_source_connect(const struct sockaddr_storage *ss,
+    struct smtp_source **sourcep)
+{
+	struct smtp_limits	*l = &env->sc_smtp_limits;
+	struct smtp_source	*src, *net;
+
+	*sourcep = NULL;
+
+	if (ss->ss_family != AF_INET && ss->ss_family != AF_INET6)
+		return (1);
+	if (!smtp_limits_enabled())
+		return (1);
+
+	src = smtp_source_get(ss, 0);
+	net = src->network;
+	src->last = net->last = time(NULL);
+
+	if (!smtp_counter_open(&src->counter->sessions, l->source.sessions)) {
+		stat_increment("smtp.limit.session", 1);
+		return (0);
+	}
+	if (!smtp_counter_open(&net->counter->sessions, l->network.sessions)) {
+		(void)__sync_sub_and_fetch(&src->counter->sessions, 1);
+		stat_increment("smtp.limit.session", 1);
+		return (0);
+	}
+	if (!smtp_source_take(src, SMTP_BUCKET_CONN)) {
+		(void)__sync_sub_and_fetch(&src->counter->sessions, 1);
+		(void)__sync_sub_and_fetch(&net->counter->sessions, 1);
+		stat_increment("smtp.limit.connection", 1);
+		return (0);
+	}
+
+	src->sessions++;
+	net->sessions++;
+	*sourcep = src;
+
+	return (1);
+}
+
+void
+smtp_source_disconnect(struct smtp_source *src)
+{
+	if (src == NULL)
+		return;
+
+	src->sessions--;
+	src->network->sessions--;
+	(void)__sync_sub_and_fetch(&src->counter->sessions, 1);
+	(void)__sync_sub_and_fetch(&src->network->counter->sessions, 1);
+}
+
+/*
+ * Return 0 if the session has sent commands faster than allowed.
+ */
+int
+smtp_source_command(struct smtp_source *src)
+{
+	if (smtp_source_take(src, SMTP_BUCKET_CMD))
+		return (1);
+
+	stat_increment("smtp.limit.command", 1);
+	return (0);
+}
+
+/*
+ * Return 0 if the session has sent recipients faster than allowed.
+ */
+int
+smtp_source_rcpt(struct smtp_source *src)
+{
+	if (smtp_source_take(src, SMTP_BUCKET_RCPT))
+		return (1);
+
+	stat_increment("smtp.limit.rcpt", 1);
+	return (0);
+}
+
+/*
+ * Take one from the bucket of the address and from the one of its
+ * network.  What was taken from the address is not given back when the
+ * network is over its limit.
+ */
+static int
+smtp_source_take(struct smtp_source *src, int bucket)
+{
+	struct smtp_limits	*l = &env->sc_smtp_limits;
+	struct smtp_source	*net;
+	time_t			 now;
+
+	if (src == NULL)
+		return (1);
+
+	now = time(NULL);
+	net = src->network;
+	src->last = net->last = now;
+
+	if (!smtp_counter_take(&src->counter->bucket[bucket],
+	    smtp_limit_rate(&l->source, bucket), now) ||
+	    !smtp_counter_take(&net->counter->bucket[bucket],
+	    smtp_limit_rate(&l->network, bucket), now))
+		return (0);
+
+	return (1);
+}
+
+static int
+smtp_limits_enabled(void)
+{
+	struct smtp_limits	*l = &env->sc_smtp_limits;
+
+	return (l->source.conn_per_second || l->source.sessions ||
+	    l->source.cmd_per_second || l->source.rcpt_per_second ||
+	    l->network.conn_per_second || l->network.sessions ||
+	    l->network.cmd_per_second || l->network.rcpt_per_second);
+}
+
+static size_t
+smtp_limit_rate(const struct smtp_limit *l, int bucket)
+{
+	switch (bucket) {
+	case SMTP_BUCKET_CONN:
+		return (l->conn_per_second);
+	case SMTP_BUCKET_CMD:
+		return (l->cmd_per_second);
+	case SMTP_BUCKET_RCPT:
+		return (l->rcpt_per_second);
+	}
+	return (0);
+}
+
+/*
+ * Count one more session, unless it would go over the limit.
+ */
+static int
+smtp_counter_open(volatile uint32_t *sessions, size_t max)
+{
+	if (__sync_add_and_fetch(sessions, 1) <= max || max == 0)
+		return (1);
+
+	(void)__sync_sub_and_fetch(sessions, 1);
+	return (0);
+}
+
+/*
+ * Refill the bucket for the time elapsed, allowing a burst of one
+ * second, and take one from it.  Return 0 if it is empty.  Unlimited
+ * rates are not accounted.
+ */
+static int
+smtp_counter_take(volatile uint64_t *bucket, size_t rate, time_t now)
+{
+	uint64_t	old, new;
+	int64_t		level;
+	uint32_t	last;
+
+	if (rate == 0 || rate > INT32_MAX)
+		return (1);
+
+	do {
+		old = *bucket;
+		last = old >> 32;
+		level = (int32_t)(uint32_t)old;
+		if (last == 0)
+			level = rate;
+		else if ((uint32_t)now > last)
+			level += (int64_t)rate * ((uint32_t)now - last);
+		if (level > (int64_t)rate)
+			level = rate;
+		if (level <= 0)
+			return (0);
+		new = (uint64_t)(uint32_t)now << 32 | (uint32_t)(level - 1);
+	} while (!__sync_bool_compare_and_swap(bucket, old, new));
+
+	return (1);
+}
+
+/*
+ * Find or create the entry for the address or, if network is set,
+ * for its network.  Address entries hold a reference on the entry of
+ * their network.
+ */
+static struct smtp_source *
+smtp_source_get(const struct sockaddr_storage *ss, int network)
+{
+	struct smtp_source	 key, *src;
+	const uint8_t		*addr;
+	uint32_t		 h;
+	size_t			 i, len;
+	int			 bits;
+
+	memset(&key, 0, sizeof key);
+	key.family = ss->ss_family;
+	if (ss->ss_family == AF_INET) {
+		addr = (const uint8_t *)
+		    &((const struct sockaddr_in *)ss)->sin_addr;
+		len = 4;
+		key.prefixlen = network ? env->sc_smtp_limits.prefix4 : 32;
+	}
+	else {
+		addr = (const uint8_t *)
+		    &((const struct sockaddr_in6 *)ss)->sin6_addr;
+		len = 16;
+		key.prefixlen = network ? env->sc_smtp_limits.prefix6 : 128;
+	}
+
+	memcpy(key.addr, addr, len);
+	for (i = 0, bits = key.prefixlen; i < len; i++, bits -= 8) {
+		if (bits <= 0)
+			key.addr[i] = 0;
+		else if (bits < 8)
+			key.addr[i] &= 0xff << (8 - bits);
+	}
+
+	h = smtp_source_hash(&key);
+
+	if (sources == NULL) {
+		sources_size = SMTP_SOURCE_HASHSIZE;
+		sources = xcalloc(sources_size, sizeof(*sources),
+		    "smtp_source_get");
+		evtimer_set(&sources_ev, smtp_source_expire, NULL);
+	}
+
+	for (src = sources[h % sources_size]; src; src = src->next)
+		if (src->family == key.family &&
+		    src->prefixlen == key.prefixlen &&
+		    !memcmp(src->addr, key.addr, sizeof key.addr))
+			return (src);
+
+	src = xmemdup(&key, sizeof key, "smtp_source_get");
+	if (counters)
+		src->counter = &counters[h % SMTP_COUNTERS];
+	else
+		src->counter = &src->own;
+	if (!network) {
+		src->network = smtp_source_get(ss, 1);
+		src->network->refs++;
+	}
+	src->next = sources[h % sources_size];
+	sources[h % sources_size] = src;
+	sources_count++;
+
+	if (sources_count > 2 * sources_size)
+		smtp_source_grow();
+
+	if (!evtimer_pending(&sources_ev, NULL)) {
+		struct timeval	tv;
+
+		tv.tv_sec = SMTP_SOURCE_EXPIRE;
+		tv.tv_usec = 0;
+		evtimer_add(&sources_ev, &tv);
+	}
+
+	return (src);
+}
+
+/* FNV-1a over the key */
+static uint32_t
+smtp_source_hash(const struct smtp_source *src)
+{
+	uint32_t	h;
+	size_t		i, len;
+
+	len = (src->family == AF_INET) ? 4 : 16;
+	h = 2166136261U;
+	h = (h ^ src->family) * 16777619U;
+	h = (h ^ src->prefixlen) * 16777619U;
+	for (i = 0; i < len; i++)
+		h = (h ^ src->addr[i]) * 16777619U;
+
+	return (h);
+}
+
+static void
+smtp_source_grow(void)
+{
+	struct smtp_source	**table, *src;
+	uint32_t		  h;
+	size_t			  i, size;
+
+	size = sources_size * 2;
+	table = xcalloc(size, sizeof(*table), "smtp_source_grow");
+	for (i = 0; i < sources_size; i++) {
+		while ((src = sources[i])) {
+			sources[i] = src->next;
+			h = smtp_source_hash(src);
+			src->next = table[h % size];
+			table[h % size] = src;
+		}
+	}
+	free(sources);
+	sources = table;
+	sources_size = size;
+}
+
+static void
+smtp_source_expire(int fd, short event, void *p)
+{
+	struct smtp_source	**srcp, *src;
+	struct timeval		  tv;
+	time_t			  now;
+	size_t			  i;
+
+	now = time(NULL);
+	for (i = 0; i < sources_size; i++) {
+		srcp = &sources[i];
+		while ((src = *srcp)) {
+			/* Buckets are full again after one second */
+			if (src->sessions || src->refs || now - src->last < 2) {
+				srcp = &src->next;
+				continue;
+			}
+			*srcp = src->next;
+			if (src->network)
+				src->network->refs--;
+			free(src);
+			sources_count--;
+		}
+	}
+
+	stat_set("smtp.limit.sources", stat_counter(sources_count));
+
+	if (sources_count == 0)
+		return;
+	tv.tv_sec = SMTP_SOURCE_EXPIRE;
+	tv.tv_usec = 0;
+	evtimer_add(&sources_ev, &tv);
+}
@@ -32,6 +32,7 @@
 #include <event.h>
 #include <imsg.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <openssl/ssl.h>
 #include <resolv.h>
 #include <stdio.h>
@@ -49,6 +50,9 @@
 #define SMTP_KICK_CMD		5
 #define SMTP_KICK_RCPTFAIL	50
 
+#define SMTP_BODY_BUFSIZE	65536	/* input buffer size for message data */
+#define SMTP_EVP_POOL		64	/* free envelopes kept around */
+
 enum smtp_phase {
 	PHASE_INIT = 0,
 	PHASE_SETUP,
@@ -65,6 +69,7 @@ enum smtp_state {
 	STATE_AUTH_PASSWORD,
 	STATE_AUTH_FINALIZE,
 	STATE_BODY,
+	STATE_BDAT,
 	STATE_QUIT,
 };
 
@@ -78,10 +83,16 @@ enum session_flags {
 	SF_VERIFIED		= 0x0040,
 	SF_MFACONNSENT		= 0x0080,
 	SF_BADINPUT		= 0x0100,
+	SF_BDATSKIP		= 0x0200,
 };
 
 enum message_flags {
 	MF_QUEUE_ENVELOPE_FAIL	= 0x0001,
+	MF_BDAT			= 0x0002,
+	MF_BDAT_LAST		= 0x0004,
+	MF_BDAT_CR		= 0x0008,
+	MF_BDAT_EOL		= 0x0010,
+	MF_BAREEOL		= 0x0020,
 	MF_ERROR_SIZE		= 0x1000,
 	MF_ERROR_IO		= 0x2000,
 	MF_ERROR_MFA		= 0x4000,
@@ -95,6 +106,7 @@ enum smtp_command {
 	CMD_MAIL_FROM,
 	CMD_RCPT_TO,
 	CMD_DATA,
+	CMD_BDAT,
 	CMD_RSET,
 	CMD_QUIT,
 	CMD_HELP,
@@ -107,11 +119,26 @@ struct smtp_rcpt {
 	size_t			 destcount;
 };
 
+/*
+ * A RCPT command received while recipient lookups are running.  Its
+ * reply is held until the commands received before it are answered.
+ */
+struct smtp_pending {
+	TAILQ_ENTRY(smtp_pending) entry;
+	struct smtp_session	*session;
+	uint64_t		 reqid;
+	struct mailaddr		 maddr;
+	size_t			 destcount;
+	char			*cmd;
+	char			*reply;	/* NULL while the lookup is running */
+};
+
 struct smtp_session {
 	uint64_t		 id;
 	struct iobuf		 iobuf;
 	struct io		 io;
 	struct listener		*listener;
+	struct smtp_source	*source;	/* NULL if not limited */
 	struct sockaddr_storage	 ss;
 	char			 hostname[SMTPD_MAXHOSTNAMELEN];
 
@@ -121,11 +148,12 @@ struct smtp_session {
 
 	enum imsg_type		 mfa_imsg; /* last send */
 
-	char			 helo[SMTPD_MAXLINESIZE];
-	char			 cmd[SMTPD_MAXLINESIZE];
+	char			 helo[SMTPD_MAXHOSTNAMELEN];
+	char			*cmd;
 	char			 username[SMTPD_MAXLOGNAME];
 
-	struct envelope		 evp;
+	struct envelope		*evp;	/* only during a transaction */
+	size_t			 memory;
 
 	size_t			 kickcount;
 	size_t			 mailcount;
@@ -133,15 +161,16 @@ struct smtp_session {
 	int			 msgflags;
 	int			 msgcode;
 	size_t			 rcptcount;
-	size_t			 destcount;
 	size_t			 rcptfail;
 	TAILQ_HEAD(, smtp_rcpt)	 rcpts;
-
+	TAILQ_HEAD(, smtp_pending) pending;
 
 	size_t			 datalen;
+	size_t			 chunklen;
 	FILE			*ofile;
 
 	struct event		 pause;
+	struct event		 throttle;
 };
 
 #define ADVERTISE_TLS(s) \
@@ -159,19 +188,35 @@ static void smtp_mfa_response(struct smtp_session *, int, uint32_t,
 static void smtp_io(struct io *, int);
 static void smtp_enter_state(struct smtp_session *, int);
 static void smtp_reply(struct smtp_session *, char *, ...);
+static void smtp_send_reply(struct smtp_session *, const char *,
+    const char *);
+static struct smtp_pending *smtp_pending_add(struct smtp_session *);
+static void smtp_pending_flush(struct smtp_session *);
+static int smtp_pending_ready(struct smtp_session *);
+static int smtp_pending_next(struct smtp_session *);
 static void smtp_command(struct smtp_session *, char *);
 static int smtp_parse_mail_args(struct smtp_session *, char *);
 static void smtp_rfc4954_auth_plain(struct smtp_session *, char *);
 static void smtp_rfc4954_auth_login(struct smtp_session *, char *);
 static void smtp_message_write(struct smtp_session *, const char *);
+static int smtp_message_body(struct smtp_session *);
+static void smtp_message_append(struct smtp_session *, const char *, size_t);
+static void smtp_message_chunk(struct smtp_session *, const char *, size_t);
 static void smtp_message_end(struct smtp_session *);
 static void smtp_message_reset(struct smtp_session *, int);
 static void smtp_wait_mfa(struct smtp_session *s, int);
 static void smtp_free(struct smtp_session *, const char *);
 static const char *smtp_strstate(int);
 static int smtp_verify_certificate(struct smtp_session *);
+static void smtp_throttle(struct smtp_session *);
+static void smtp_throttle_resume(int, short, void *);
 static void smtp_auth_failure_pause(struct smtp_session *);
 static void smtp_auth_failure_resume(int, short, void *);
+static struct envelope *smtp_envelope_alloc(void);
+static void smtp_envelope_free(struct envelope *);
+static size_t smtp_session_memory(struct smtp_session *);
+static void smtp_memory_update(struct smtp_session *, size_t);
+static void smtp_memory_stat(int, short, void *);
 
 static struct { int code; const char *cmd; } commands[] = {
 	{ CMD_HELO,		"HELO" },
@@ -181,6 +226,7 @@ static struct { int code; const char *cmd; } commands[] = {
 	{ CMD_MAIL_FROM,	"MAIL FROM" },
 	{ CMD_RCPT_TO,		"RCPT TO" },
 	{ CMD_DATA,		"DATA" },
+	{ CMD_BDAT,		"BDAT" },
 	{ CMD_RSET,		"RSET" },
 	{ CMD_QUIT,		"QUIT" },
 	{ CMD_HELP,		"HELP" },
@@ -199,12 +245,21 @@ static struct tree wait_queue_commit;
 static struct tree wait_ssl_init;
 static struct tree wait_ssl_verify;
 
+static TAILQ_HEAD(, envelope)	evp_pool;
+static size_t			evp_npool;
+
+static size_t			smtp_memory;	/* held by all sessions */
+static size_t			smtp_nsessions;
+static struct event		smtp_memory_ev;
+
 static void
 smtp_session_init(void)
 {
 	static int	init = 0;
 
 	if (!init) {
+		TAILQ_INIT(&evp_pool);
+		evtimer_set(&smtp_memory_ev, smtp_memory_stat, NULL);
 		tree_init(&wait_lka_ptr);
 		tree_init(&wait_lka_rcpt);
 		tree_init(&wait_mfa_response);
@@ -221,7 +276,8 @@ smtp_session_init(void)
 
 int
 smtp_session(struct listener *listener, int sock,
-    const struct sockaddr_storage *ss, const char *hostname)
+    const struct sockaddr_storage *ss, const char *hostname,
+    struct smtp_source *source)
 {
 	struct smtp_session	*s;
 
@@ -231,19 +287,24 @@ smtp_session(struct listener *listener, int sock,
 
 	if ((s = calloc(1, sizeof(*s))) == NULL)
 		return (-1);
-	if (iobuf_init(&s->iobuf, SMTPD_MAXLINESIZE, SMTPD_MAXLINESIZE) == -1) {
+	if (iobuf_init(&s->iobuf, SMTPD_MAXLINESIZE, SMTP_BODY_BUFSIZE) == -1) {
 		free(s);
 		return (-1);
 	}
 	TAILQ_INIT(&s->rcpts);
+	TAILQ_INIT(&s->pending);
 
-	s->id = generate_uid();
+	s->id = smtp_generate_id();
 	s->listener = listener;
+	s->source = source;
 	memmove(&s->ss, ss, sizeof(*ss));
 	io_init(&s->io, sock, s, smtp_io, &s->iobuf);
 	io_set_timeout(&s->io, SMTPD_SESSION_TIMEOUT * 1000);
 	io_set_write(&s->io);
 
+	smtp_nsessions++;
+	smtp_memory_update(s, smtp_session_memory(s));
+
 	s->state = STATE_NEW;
 	s->phase = PHASE_INIT;
 
@@ -270,6 +331,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 	struct ca_vrfy_resp_msg       	*resp_ca_vrfy;
 	struct smtp_session		*s;
 	struct smtp_rcpt		*rcpt;
+	struct smtp_pending		*pending;
 	void				*ssl;
 	char				 user[SMTPD_MAXLOGNAME];
 	struct msg			 m;
@@ -299,12 +361,16 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_get_int(&m, &status);
 		m_get_string(&m, &line);
 		m_end(&m);
-		s = tree_xpop(&wait_lka_rcpt, reqid);
+		/* The session may be gone */
+		if ((pending = tree_pop(&wait_lka_rcpt, reqid)) == NULL)
+			return;
+		s = pending->session;
+		pending->reply = xstrdup(line, "smtp_session_imsg");
+		s->rcptcount--;
 		switch (status) {
 		case LKA_OK:
 			fatalx("unexpected ok");
 		case LKA_PERMFAIL:
-			smtp_reply(s, "%s", line);
 			s->rcptfail += 1;
 			if (s->rcptfail >= SMTP_KICK_RCPTFAIL) {
 				log_info("smtp-in: Ending session %016"PRIx64
@@ -313,9 +379,9 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 			}
 			break;
 		case LKA_TEMPFAIL:
-			smtp_reply(s, "%s", line);
+			break;
 		}
-		io_reload(&s->io);
+		smtp_pending_flush(s);
 		return;
 
 	case IMSG_MFA_SMTP_DATA:
@@ -348,7 +414,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		s = tree_xpop(&wait_queue_msg, reqid);
 		if (success) {
 			m_get_msgid(&m, &msgid);
-			s->evp.id = msgid_to_evpid(msgid);
+			s->evp->id = msgid_to_evpid(msgid);
 			s->rcptcount = 0;
 			s->phase = PHASE_TRANSACTION;
 			smtp_reply(s, "250 Ok");
@@ -380,7 +446,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		fprintf(s->ofile,
 		    "Received: from %s (%s [%s]);\n"
 		    "\tby %s (%s) with %sSMTP%s%s id %08x;\n",
-		    s->evp.helo,
+		    s->evp->helo,
 		    s->hostname,
 		    ss_to_text(&s->ss),
 		    s->listener->helo[0] ? s->listener->helo : env->sc_hostname,
@@ -388,7 +454,7 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		    s->flags & SF_EHLO ? "E" : "",
 		    s->flags & SF_SECURE ? "S" : "",
 		    s->flags & SF_AUTHENTICATED ? "A" : "",
-		    evpid_to_msgid(s->evp.id));
+		    evpid_to_msgid(s->evp->id));
 
 		if (s->flags & SF_SECURE) {
 			fprintf(s->ofile,
@@ -401,18 +467,33 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		}
 
 		if (s->rcptcount == 1) {
+			rcpt = TAILQ_FIRST(&s->rcpts);
 			fprintf(s->ofile, "\tfor <%s@%s>;\n",
-			    s->evp.rcpt.user,
-			    s->evp.rcpt.domain);
+			    rcpt->maddr.user,
+			    rcpt->maddr.domain);
 		}
 
 		fprintf(s->ofile, "\t%s\n", time_to_text(time(NULL)));
 
+		tree_xset(&wait_mfa_data, s->id, s);
+
+		/* Read the message data in large blocks */
+		if (s->iobuf.size < SMTP_BODY_BUFSIZE)
+			iobuf_extend(&s->iobuf,
+			    SMTP_BODY_BUFSIZE - s->iobuf.size);
+		smtp_memory_update(s, smtp_session_memory(s));
+
+		/* Read the first chunk */
+		if (s->msgflags & MF_BDAT) {
+			smtp_enter_state(s, STATE_BDAT);
+			io_set_read(&s->io);
+			smtp_io(&s->io, IO_DATAIN);
+			return;
+		}
+
 		smtp_enter_state(s, STATE_BODY);
 		smtp_reply(s, "354 Enter mail, end with \".\""
 		    " on a line by itself");
-
-		tree_xset(&wait_mfa_data, s->id, s);
 		io_reload(&s->io);
 		return;
 
@@ -420,13 +501,14 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_msg(&m, imsg);
 		m_get_id(&m, &reqid);
 		m_get_int(&m, &success);
-		s = tree_xget(&wait_lka_rcpt, reqid);
+		if ((pending = tree_get(&wait_lka_rcpt, reqid)) == NULL)
+			return;
 		if (success) {
 			m_get_evpid(&m, &evpid);
-			s->destcount++;
+			pending->destcount++;
 		}
 		else
-			s->msgflags |= MF_QUEUE_ENVELOPE_FAIL;
+			pending->session->msgflags |= MF_QUEUE_ENVELOPE_FAIL;
 		m_end(&m);
 		return;
 
@@ -437,28 +519,23 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_end(&m);
 		if (!success)
 			fatalx("commit evp failed: not supposed to happen");
-		s = tree_xpop(&wait_lka_rcpt, reqid);
+		if ((pending = tree_pop(&wait_lka_rcpt, reqid)) == NULL)
+			return;
+		s = pending->session;
 		if (s->msgflags & MF_QUEUE_ENVELOPE_FAIL) {
 			/*
 			 * If an envelope failed, we can't cancel the last
 			 * RCPT only so we must cancel the whole transaction
 			 * and close the connection.
 			 */
-			smtp_reply(s, "421 Temporary failure");
+			pending->reply = xstrdup("421 Temporary failure",
+			    "smtp_session_imsg");
 			smtp_enter_state(s, STATE_QUIT);
 		}
-		else {
-			rcpt = xcalloc(1, sizeof(*rcpt), "smtp_rcpt");
-			rcpt->destcount = s->destcount;
-			rcpt->maddr = s->evp.rcpt;
-			TAILQ_INSERT_TAIL(&s->rcpts, rcpt, entry);
-
-			s->destcount = 0;
-			s->rcptcount++;
-			s->kickcount--;
-			smtp_reply(s, "250 Recipient ok");
-		}
-		io_reload(&s->io);
+		else
+			pending->reply = xstrdup("250 Recipient ok",
+			    "smtp_session_imsg");
+		smtp_pending_flush(s);
 		return;
 
 	case IMSG_QUEUE_COMMIT_MESSAGE:
@@ -482,17 +559,17 @@ smtp_session_imsg(struct mproc *p, struct imsg *imsg)
 		m_close(p_mfa);
 
 		smtp_reply(s, "250 %08x Message accepted for delivery",
-		    evpid_to_msgid(s->evp.id));
+		    evpid_to_msgid(s->evp->id));
 
 		TAILQ_FOREACH(rcpt, &s->rcpts, entry) {
 			log_info("smtp-in: Accepted message %08x "
 			    "on session %016"PRIx64
 			    ": from=<%s%s%s>, to=<%s%s%s>, size=%zu, ndest=%zu, proto=%s",
-			    evpid_to_msgid(s->evp.id),
+			    evpid_to_msgid(s->evp->id),
 			    s->id,
-			    s->evp.sender.user,
-			    s->evp.sender.user[0] == '\0' ? "" : "@",
-			    s->evp.sender.domain,
+			    s->evp->sender.user,
+			    s->evp->sender.user[0] == '\0' ? "" : "@",
+			    s->evp->sender.domain,
 			    rcpt->maddr.user,
 			    rcpt->maddr.user[0] == '\0' ? "" : "@",
 			    rcpt->maddr.domain,
@@ -596,13 +673,14 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
     const char *line)
 {
 	struct ca_cert_req_msg		 req_ca_cert;
+	struct smtp_pending		*pending;
 
 	if (status == MFA_CLOSE) {
 		code = code ? code : 421;
 		line = line ? line : "Temporary failure";
 		smtp_reply(s, "%d %s", code, line);
 		smtp_enter_state(s, STATE_QUIT);
-		io_reload(&s->io);
+		smtp_pending_flush(s);
 		return;
 	}
 
@@ -645,13 +723,15 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 		smtp_reply(s, "250%c%s Hello %s [%s], pleased to meet you",
 		    (s->flags & SF_EHLO) ? '-' : ' ',
 		    env->sc_hostname,
-		    s->evp.helo,
+		    s->helo,
 		    ss_to_text(&s->ss));
 
 		if (s->flags & SF_EHLO) {
 			smtp_reply(s, "250-8BITMIME");
 			smtp_reply(s, "250-ENHANCEDSTATUSCODES");
 			smtp_reply(s, "250-SIZE %zu", env->sc_maxsize);
+			smtp_reply(s, "250-PIPELINING");
+			smtp_reply(s, "250-CHUNKING");
 			if (ADVERTISE_TLS(s))
 				smtp_reply(s, "250-STARTTLS");
 			if (ADVERTISE_AUTH(s))
@@ -690,15 +770,25 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 				    ": too many failed RCPT", s->id);
 				smtp_enter_state(s, STATE_QUIT);
 			}
-			io_reload(&s->io);
+			if (!smtp_pending_next(s))
+				smtp_pending_flush(s);
 			return;
 		}
 
+		pending = smtp_pending_add(s);
+		pending->reqid = smtp_generate_id();
+		pending->maddr = s->evp->rcpt;
+		s->rcptcount++;
+		s->kickcount--;
+
 		m_create(p_lka, IMSG_LKA_EXPAND_RCPT, 0, 0, -1);
-		m_add_id(p_lka, s->id);
-		m_add_envelope(p_lka, &s->evp);
+		m_add_id(p_lka, pending->reqid);
+		m_add_envelope(p_lka, s->evp);
 		m_close(p_lka);
-		tree_xset(&wait_lka_rcpt, s->id, s);
+		tree_xset(&wait_lka_rcpt, pending->reqid, pending);
+
+		/* Look up the next pipelined recipient right away */
+		smtp_pending_next(s);
 		return;
 
 	case IMSG_MFA_REQ_DATA:
@@ -706,12 +796,21 @@ smtp_mfa_response(struct smtp_session *s, int status, uint32_t code,
 			code = code ? code : 530;
 			line = line ? line : "Message rejected";
 			smtp_reply(s, "%d %s", code, line);
+			if (s->msgflags & MF_BDAT) {
+				/* The chunk must still be read */
+				s->msgflags &= ~(MF_BDAT | MF_BDAT_LAST);
+				s->flags |= SF_BDATSKIP;
+				smtp_enter_state(s, STATE_BDAT);
+				io_set_read(&s->io);
+				smtp_io(&s->io, IO_DATAIN);
+				return;
+			}
 			io_reload(&s->io);
 			return;
 		}
 		m_create(p_queue, IMSG_QUEUE_MESSAGE_FILE, 0, 0, -1);
 		m_add_id(p_queue, s->id);
-		m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+		m_add_msgid(p_queue, evpid_to_msgid(s->evp->id));
 		m_close(p_queue);
 		tree_xset(&wait_queue_fd, s->id, s);
 		return;
@@ -738,7 +837,7 @@ smtp_io(struct io *io, int evt)
 	struct ca_cert_req_msg	req_ca_cert;
 	struct smtp_session    *s = io->arg;
 	char		       *line;
-	size_t			len, i;
+	size_t			len;
 
 	log_trace(TRACE_IO, "smtp: %p: %s %s", s, io_strevent(evt),
 	    io_strio(io));
@@ -753,6 +852,11 @@ smtp_io(struct io *io, int evt)
 		s->kickcount = 0;
 		s->phase = PHASE_INIT;
 
+		if (SSL_session_reused(s->io.ssl))
+			stat_increment("smtp.ssl.resumed", 1);
+		else
+			stat_increment("smtp.ssl.handshake", 1);
+
 		if (smtp_verify_certificate(s)) {
 			io_pause(&s->io, IO_PAUSE_IN);
 			break;
@@ -779,68 +883,119 @@ smtp_io(struct io *io, int evt)
 		break;
 
 	case IO_DATAIN:
+		/* The read buffer may have been allocated again */
+		smtp_memory_update(s, smtp_session_memory(s));
+
 	    nextline:
-		line = iobuf_getline(&s->iobuf, &len);
-		if ((line == NULL && iobuf_len(&s->iobuf) >= SMTPD_MAXLINESIZE) ||
-		    (line && len >= SMTPD_MAXLINESIZE)) {
-			s->flags |= SF_BADINPUT;
-			smtp_reply(s, "500 Line too long");
-			smtp_enter_state(s, STATE_QUIT);
+		/* BDAT chunk */
+		if (s->state == STATE_BDAT) {
+			len = iobuf_len(&s->iobuf);
+			if (len > s->chunklen)
+				len = s->chunklen;
+			if (!(s->flags & SF_BDATSKIP))
+				smtp_message_chunk(s, iobuf_data(&s->iobuf), len);
+			iobuf_drop(&s->iobuf, len);
+			s->chunklen -= len;
+			if (s->chunklen) {
+				iobuf_normalize(&s->iobuf);
+				return;
+			}
+
+			smtp_enter_state(s, STATE_HELO);
 			io_set_write(io);
-			return;
-		}
 
-		/* No complete line received */
-		if (line == NULL) {
-			iobuf_normalize(&s->iobuf);
+			/* The error was already replied */
+			if (s->flags & SF_BDATSKIP) {
+				s->flags &= ~SF_BDATSKIP;
+				return;
+			}
+
+			if (!(s->msgflags & MF_BDAT_LAST)) {
+				smtp_reply(s, "250 2.0.0 Chunk accepted");
+				return;
+			}
+
+			smtp_message_chunk(s, NULL, 0);
+
+			m_create(p_mfa, IMSG_MFA_REQ_EOM, 0, 0, -1);
+			m_add_id(p_mfa, s->id);
+			m_close(p_mfa);
+			smtp_wait_mfa(s, IMSG_MFA_REQ_EOM);
 			return;
 		}
 
 		/* Message body */
-		if (s->state == STATE_BODY && strcmp(line, ".")) {
-
-			if (line[0] == '.') {
-				line += 1;
-				len -= 1;
+		if (s->state == STATE_BODY) {
+			switch (smtp_message_body(s)) {
+			case -1:
+				goto toolong;
+			case 0:
+				/* No end of data yet */
+				iobuf_normalize(&s->iobuf);
+				return;
 			}
 
-			if (!(s->flags & SF_8BITMIME))
-				for (i = 0; i < len; ++i)
-					if (line[i] & 0x80)
-						line[i] = line[i] & 0x7f;
+			iobuf_normalize(&s->iobuf);
+			io_set_write(io);
 
-			smtp_message_write(s, line);
-			goto nextline;
+			m_create(p_mfa, IMSG_MFA_REQ_EOM, 0, 0, -1);
+			m_add_id(p_mfa, s->id);
+			m_close(p_mfa);
+			smtp_wait_mfa(s, IMSG_MFA_REQ_EOM);
+			return;
 		}
 
-		/* Pipelining not supported */
-		if (iobuf_len(&s->iobuf)) {
+		/* Hold the next command until the client may send one */
+		if (s->source &&
+		    memchr(iobuf_data(&s->iobuf), '\n', iobuf_len(&s->iobuf))) {
+			if (evtimer_pending(&s->throttle, NULL))
+				return;
+			if (!smtp_source_command(s->source)) {
+				smtp_throttle(s);
+				return;
+			}
+		}
+
+		line = iobuf_getline(&s->iobuf, &len);
+		if ((line == NULL && iobuf_len(&s->iobuf) >= SMTPD_MAXLINESIZE) ||
+		    (line && len >= SMTPD_MAXLINESIZE)) {
+		    toolong:
 			s->flags |= SF_BADINPUT;
-			smtp_reply(s, "500 Pipelining not supported");
+			smtp_reply(s, "500 Line too long");
 			smtp_enter_state(s, STATE_QUIT);
 			io_set_write(io);
 			return;
 		}
 
-		/* End of body */
-		if (s->state == STATE_BODY) {
+		/* No complete line received */
+		if (line == NULL) {
 			iobuf_normalize(&s->iobuf);
-			io_set_write(io);
-
-			m_create(p_mfa, IMSG_MFA_REQ_EOM, 0, 0, -1);
-			m_add_id(p_mfa, s->id);
-			m_close(p_mfa);
-			smtp_wait_mfa(s, IMSG_MFA_REQ_EOM);
 			return;
 		}
 
 		/* Must be a command */
-		strlcpy(s->cmd, line, sizeof s->cmd);
+		free(s->cmd);
+		s->cmd = xstrdup(line, "smtp_io");
 		io_set_write(io);
 		smtp_command(s, line);
 		iobuf_normalize(&s->iobuf);
-		if (s->flags & SF_KICK)
+		if (s->flags & SF_KICK) {
+			/* Let the running lookups end first */
+			if (!TAILQ_EMPTY(&s->pending)) {
+				smtp_enter_state(s, STATE_QUIT);
+				break;
+			}
 			smtp_free(s, "kick");
+			break;
+		}
+		if (s->state == STATE_BDAT) {
+			io_set_read(io);
+			goto nextline;
+		}
+		if (smtp_pending_ready(s)) {
+			io_set_read(io);
+			goto nextline;
+		}
 		break;
 
 	case IO_LOWAT:
@@ -859,10 +1014,25 @@ smtp_io(struct io *io, int evt)
 			m_compose(p_lka, IMSG_LKA_SSL_INIT, 0, 0, -1,
 			    &req_ca_cert, sizeof(req_ca_cert));
 			tree_xset(&wait_ssl_init, s->id, s);
+
+			/* Discard anything pipelined after STARTTLS */
+			iobuf_drop(&s->iobuf, iobuf_len(&s->iobuf));
 			break;
 		}
 
 		io_set_read(io);
+
+		/* Process the commands pipelined in the meantime */
+		if (iobuf_len(&s->iobuf)) {
+			smtp_io(io, IO_DATAIN);
+			break;
+		}
+
+		/* Idle outside of a transaction, give back the read buffer */
+		if (s->phase != PHASE_TRANSACTION) {
+			iobuf_release(&s->iobuf);
+			smtp_memory_update(s, smtp_session_memory(s));
+		}
 		break;
 
 	case IO_TIMEOUT:
@@ -891,7 +1061,9 @@ smtp_io(struct io *io, int evt)
 static void
 smtp_command(struct smtp_session *s, char *line)
 {
-	char			*args, *eom, *method;
+	char			*args, *eom, *method, *last;
+	const char		*errstr;
+	long long		 chunklen;
 	int			 cmd, i;
 
 	log_trace(TRACE_SMTP, "smtp: %p: <<< %s", s, line);
@@ -960,14 +1132,18 @@ smtp_command(struct smtp_session *s, char *line)
 			smtp_reply(s, "501 Invalid domain name");
 			break;
 		}
-		strlcpy(s->helo, args, sizeof(s->helo));
+		if (strlcpy(s->helo, args, sizeof(s->helo))
+		    >= sizeof(s->helo)) {
+			smtp_reply(s, "501 Invalid domain name");
+			break;
+		}
 		s->flags &= SF_SECURE | SF_AUTHENTICATED | SF_VERIFIED;
 		if (cmd == CMD_EHLO) {
 			s->flags |= SF_EHLO;
 			s->flags |= SF_8BITMIME;
 		}
 
-		smtp_message_reset(s, 1);
+		smtp_message_reset(s, 0);
 
 		m_create(p_mfa, IMSG_MFA_REQ_HELO, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
@@ -1065,7 +1241,7 @@ smtp_command(struct smtp_session *s, char *line)
 
 		smtp_message_reset(s, 1);
 
-		if (smtp_mailaddr(&s->evp.sender, args, 1, &args) == 0) {
+		if (smtp_mailaddr(&s->evp->sender, args, 1, &args) == 0) {
 			smtp_reply(s, "553 Sender address syntax error");
 			break;
 		}
@@ -1074,7 +1250,7 @@ smtp_command(struct smtp_session *s, char *line)
 
 		m_create(p_mfa, IMSG_MFA_REQ_MAIL, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
-		m_add_mailaddr(p_mfa, &s->evp.sender);
+		m_add_mailaddr(p_mfa, &s->evp->sender);
 		m_close(p_mfa);
 		smtp_wait_mfa(s, IMSG_MFA_REQ_MAIL);
 		break;
@@ -1092,7 +1268,7 @@ smtp_command(struct smtp_session *s, char *line)
 			break;
 		}
 
-		if (smtp_mailaddr(&s->evp.rcpt, args, 0, &args) == 0) {
+		if (smtp_mailaddr(&s->evp->rcpt, args, 0, &args) == 0) {
 			smtp_reply(s,
 			    "553 Recipient address syntax error");
 			break;
@@ -1103,9 +1279,15 @@ smtp_command(struct smtp_session *s, char *line)
 			break;
 		}
 
+		if (! smtp_source_rcpt(s->source)) {
+			smtp_reply(s, "452 4.7.1 Too many recipients, "
+			    "try again later");
+			break;
+		}
+
 		m_create(p_mfa, IMSG_MFA_REQ_RCPT, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
-		m_add_mailaddr(p_mfa, &s->evp.rcpt);
+		m_add_mailaddr(p_mfa, &s->evp->rcpt);
 		m_close(p_mfa);
 		smtp_wait_mfa(s, IMSG_MFA_REQ_RCPT);
 		break;
@@ -1120,9 +1302,9 @@ smtp_command(struct smtp_session *s, char *line)
 		m_add_id(p_mfa, s->id);
 		m_close(p_mfa);
 
-		if (s->evp.id) {
+		if (s->evp && s->evp->id) {
 			m_create(p_queue, IMSG_QUEUE_REMOVE_MESSAGE, 0, 0, -1);
-			m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+			m_add_msgid(p_queue, evpid_to_msgid(s->evp->id));
 			m_close(p_queue);
 		}
 
@@ -1140,12 +1322,65 @@ smtp_command(struct smtp_session *s, char *line)
 			smtp_reply(s, "503 5.5.1 No recipient specified");
 			break;
 		}
+		if (s->msgflags & MF_BDAT) {
+			smtp_reply(s, "503 5.5.1 DATA not allowed after BDAT");
+			break;
+		}
 
 		m_create(p_mfa, IMSG_MFA_REQ_DATA, 0, 0, -1);
 		m_add_id(p_mfa, s->id);
 		m_close(p_mfa);
 		smtp_wait_mfa(s, IMSG_MFA_REQ_DATA);
 		break;
+
+	case CMD_BDAT:
+		if (args == NULL) {
+			smtp_reply(s, "501 BDAT requires chunk size");
+			break;
+		}
+		last = strchr(args, ' ');
+		if (last) {
+			*last++ = '\0';
+			while (isspace((int)*last))
+				last++;
+		}
+		chunklen = strtonum(args, 0, SSIZE_MAX, &errstr);
+		if (errstr || (last && *last && strcasecmp(last, "LAST"))) {
+			s->flags |= SF_BADINPUT;
+			smtp_reply(s, "501 Invalid BDAT parameters");
+			smtp_enter_state(s, STATE_QUIT);
+			break;
+		}
+
+		/* Even a rejected chunk is read and thrown away */
+		s->chunklen = chunklen;
+		smtp_enter_state(s, STATE_BDAT);
+
+		if (s->phase != PHASE_TRANSACTION) {
+			smtp_reply(s, "503 Command not allowed at this point.");
+			s->flags |= SF_BDATSKIP;
+			break;
+		}
+		if (s->rcptcount == 0) {
+			smtp_reply(s, "503 5.5.1 No recipient specified");
+			s->flags |= SF_BDATSKIP;
+			break;
+		}
+
+		s->kickcount--;
+		if (last && *last)
+			s->msgflags |= MF_BDAT_LAST;
+		if (s->msgflags & MF_BDAT)
+			break;
+
+		/* First chunk, wait for the message file */
+		s->msgflags |= MF_BDAT;
+		smtp_enter_state(s, STATE_HELO);
+		m_create(p_mfa, IMSG_MFA_REQ_DATA, 0, 0, -1);
+		m_add_id(p_mfa, s->id);
+		m_close(p_mfa);
+		smtp_wait_mfa(s, IMSG_MFA_REQ_DATA);
+		break;
 	/*
 	 * ANY
 	 */
@@ -1364,6 +1599,130 @@ smtp_message_write(struct smtp_session *s, const char *line)
 	s->datalen += len;
 }
 
+/*
+ * Process the message body lines found in the input buffer.  The lines
+ * are rewritten in place by iobuf_getbody(), so that all the lines of a
+ * buffer fill are written to the message file at once.
+ * Return 1 when the end-of-data marker was found, 0 if more input is
+ * needed, or -1 if a line is too long.
+ */
+static int
+smtp_message_body(struct smtp_session *s)
+{
+	size_t	 off, len;
+	int	 ret, flags;
+
+	flags = 0;
+	ret = iobuf_getbody(&s->iobuf, SMTPD_MAXLINESIZE,
+	    (s->flags & SF_8BITMIME) ? 0 : IOBUF_BODY_7BIT, &off, &len, &flags);
+	if (ret == -1)
+		return (-1);
+
+	if (flags & (IOBUF_LINE_BARECR | IOBUF_LINE_BARELF) &&
+	    !(s->msgflags & MF_BAREEOL)) {
+		log_debug("debug: smtp: %p: bare CR or LF in message", s);
+		s->msgflags |= MF_BAREEOL;
+	}
+
+	if (len)
+		smtp_message_append(s, iobuf_data(&s->iobuf), len);
+	iobuf_drop(&s->iobuf, off);
+
+	return (ret);
+}
+
+static void
+smtp_message_append(struct smtp_session *s, const char *data, size_t len)
+{
+	log_trace(TRACE_SMTP, "<<< [MSG] %zu bytes", len);
+
+	if (s->msgflags & (MF_ERROR_IO | MF_ERROR_SIZE | MF_ERROR_MFA))
+		return;
+
+	if (s->datalen + len > env->sc_maxsize) {
+		s->msgflags |= MF_ERROR_SIZE;
+		return;
+	}
+
+	if (fwrite(data, 1, len, s->ofile) != len) {
+		s->msgflags |= MF_ERROR_IO;
+		return;
+	}
+
+	s->datalen += len;
+}
+
+/*
+ * Append a BDAT chunk to the message.  The spool uses LF line endings,
+ * so CRLF pairs are folded, and a CR ending a chunk is held until the
+ * next byte is known.  A NULL chunk terminates the message.
+ */
+static void
+smtp_message_chunk(struct smtp_session *s, const char *data, size_t len)
+{
+	const char	*cr;
+	size_t		 n;
+
+	log_trace(TRACE_SMTP, "<<< [MSG] %zu bytes", len);
+
+	if (s->msgflags & (MF_ERROR_IO | MF_ERROR_SIZE | MF_ERROR_MFA))
+		return;
+
+	if (s->msgflags & MF_BDAT_CR) {
+		s->msgflags &= ~MF_BDAT_CR;
+		if (data == NULL || data[0] != '\n') {
+			if (fputc('\r', s->ofile) == EOF)
+				goto ioerror;
+			s->datalen += 1;
+			s->msgflags &= ~MF_BDAT_EOL;
+		}
+	}
+
+	if (data == NULL) {
+		if (s->datalen && !(s->msgflags & MF_BDAT_EOL)) {
+			if (fputc('\n', s->ofile) == EOF)
+				goto ioerror;
+			s->datalen += 1;
+		}
+		return;
+	}
+
+	while (len) {
+		cr = memchr(data, '\r', len);
+		n = cr ? (size_t)(cr - data) : len;
+		if (n) {
+			if (fwrite(data, 1, n, s->ofile) != n)
+				goto ioerror;
+			s->datalen += n;
+			if (data[n - 1] == '\n')
+				s->msgflags |= MF_BDAT_EOL;
+			else
+				s->msgflags &= ~MF_BDAT_EOL;
+		}
+		if (cr == NULL)
+			break;
+		data += n + 1;
+		len -= n + 1;
+		if (len == 0) {
+			s->msgflags |= MF_BDAT_CR;
+			break;
+		}
+		if (data[0] != '\n') {
+			if (fputc('\r', s->ofile) == EOF)
+				goto ioerror;
+			s->datalen += 1;
+			s->msgflags &= ~MF_BDAT_EOL;
+		}
+	}
+
+	if (s->datalen > env->sc_maxsize)
+		s->msgflags |= MF_ERROR_SIZE;
+	return;
+
+    ioerror:
+	s->msgflags |= MF_ERROR_IO;
+}
+
 static void
 smtp_message_end(struct smtp_session *s)
 {
@@ -1378,7 +1737,7 @@ smtp_message_end(struct smtp_session *s)
 
 	if (s->msgflags & (MF_ERROR_SIZE | MF_ERROR_MFA | MF_ERROR_IO)) {
 		m_create(p_queue, IMSG_QUEUE_REMOVE_MESSAGE, 0, 0, -1);
-		m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+		m_add_msgid(p_queue, evpid_to_msgid(s->evp->id));
 		m_close(p_queue);
 		if (s->msgflags & MF_ERROR_SIZE)
 			smtp_reply(s, "554 Message too big");
@@ -1391,7 +1750,7 @@ smtp_message_end(struct smtp_session *s)
 
 	m_create(p_queue, IMSG_QUEUE_COMMIT_MESSAGE, 0, 0, -1);
 	m_add_id(p_queue, s->id);
-	m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+	m_add_msgid(p_queue, evpid_to_msgid(s->evp->id));
 	m_close(p_queue);
 	tree_xset(&wait_queue_commit, s->id, s);
 }
@@ -1406,31 +1765,44 @@ smtp_message_reset(struct smtp_session *s, int prepare)
 		free(rcpt);
 	}
 
-	bzero(&s->evp, sizeof s->evp);
+	/* A BDAT transaction can be reset between chunks */
+	if (s->ofile) {
+		tree_pop(&wait_mfa_data, s->id);
+		fclose(s->ofile);
+		s->ofile = NULL;
+	}
+
+	if (s->evp) {
+		smtp_envelope_free(s->evp);
+		s->evp = NULL;
+	}
 	s->msgflags = 0;
-	s->destcount = 0;
 	s->rcptcount = 0;
 	s->datalen = 0;
 
 	if (prepare) {
-		s->evp.ss = s->ss;
-		strlcpy(s->evp.tag, s->listener->tag, sizeof(s->evp.tag));
-		strlcpy(s->evp.hostname, s->hostname, sizeof s->evp.hostname);
-		strlcpy(s->evp.helo, s->helo, sizeof s->evp.helo);
+		s->evp = smtp_envelope_alloc();
+		s->evp->ss = s->ss;
+		strlcpy(s->evp->tag, s->listener->tag, sizeof(s->evp->tag));
+		strlcpy(s->evp->hostname, s->hostname, sizeof s->evp->hostname);
+		strlcpy(s->evp->helo, s->helo, sizeof s->evp->helo);
 
 		if (s->flags & SF_BOUNCE)
-			s->evp.flags |= EF_BOUNCE;
+			s->evp->flags |= EF_BOUNCE;
 		if (s->flags & SF_AUTHENTICATED)
-			s->evp.flags |= EF_AUTHENTICATED;
+			s->evp->flags |= EF_AUTHENTICATED;
 	}
+
+	smtp_memory_update(s, smtp_session_memory(s));
 }
 
 static void
 smtp_reply(struct smtp_session *s, char *fmt, ...)
 {
+	struct smtp_pending	*pending;
 	va_list	 ap;
 	int	 n;
-	char	 buf[SMTPD_MAXLINESIZE], tmp[SMTPD_MAXLINESIZE];
+	char	 buf[SMTPD_MAXLINESIZE];
 
 	va_start(ap, fmt);
 	n = vsnprintf(buf, sizeof buf, fmt, ap);
@@ -1440,6 +1812,21 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 	if (n < 4)
 		fatalx("smtp_reply: response too short");
 
+	/* Earlier commands have not been answered yet */
+	if (!TAILQ_EMPTY(&s->pending)) {
+		pending = smtp_pending_add(s);
+		pending->reply = xstrdup(buf, "smtp_reply");
+		return;
+	}
+
+	smtp_send_reply(s, s->cmd ? s->cmd : "", buf);
+}
+
+static void
+smtp_send_reply(struct smtp_session *s, const char *cmd, const char *buf)
+{
+	char	 tmp[SMTPD_MAXLINESIZE];
+
 	log_trace(TRACE_SMTP, "smtp: %p: >>> %s", s, buf);
 
 	iobuf_xfqueue(&s->iobuf, "smtp_reply", "%s\r\n", buf);
@@ -1449,21 +1836,106 @@ smtp_reply(struct smtp_session *s, char *fmt, ...)
 	case '4':
 		if (s->flags & SF_BADINPUT) {
 			log_info("smtp-in: Bad input on session %016"PRIx64
-			    ": %.*s", s->id, n, buf);
+			    ": %s", s->id, buf);
 		}
-		else if (strstr(s->cmd, "AUTH ") == s->cmd) {
+		else if (strstr(cmd, "AUTH ") == cmd) {
 			log_info("smtp-in: Failed command on session %016"PRIx64
-			    ": \"AUTH [...]\" => %.*s", s->id, n, buf);
+			    ": \"AUTH [...]\" => %s", s->id, buf);
 		}
 		else {
-			strnvis(tmp, s->cmd, sizeof tmp, VIS_SAFE | VIS_CSTYLE);
+			strnvis(tmp, cmd, sizeof tmp, VIS_SAFE | VIS_CSTYLE);
 			log_info("smtp-in: Failed command on session %016"PRIx64
-			    ": \"%s\" => %.*s", s->id, tmp, n, buf);
+			    ": \"%s\" => %s", s->id, tmp, buf);
 		}
 		break;
 	}
 }
 
+static struct smtp_pending *
+smtp_pending_add(struct smtp_session *s)
+{
+	struct smtp_pending	*pending;
+
+	pending = xcalloc(1, sizeof(*pending), "smtp_pending_add");
+	pending->session = s;
+	pending->cmd = xstrdup(s->cmd ? s->cmd : "", "smtp_pending_add");
+	TAILQ_INSERT_TAIL(&s->pending, pending, entry);
+
+	/* Replies are sent together once all lookups are over */
+	io_pause(&s->io, IO_PAUSE_OUT);
+
+	return (pending);
+}
+
+/*
+ * Send the replies of the commands answered so far, in the order the
+ * commands were received.
+ */
+static void
+smtp_pending_flush(struct smtp_session *s)
+{
+	struct smtp_pending	*pending;
+	struct smtp_rcpt	*rcpt;
+
+	while ((pending = TAILQ_FIRST(&s->pending))) {
+		if (pending->reply == NULL)
+			break;
+		TAILQ_REMOVE(&s->pending, pending, entry);
+
+		if (pending->reqid && pending->reply[0] == '2') {
+			rcpt = xcalloc(1, sizeof(*rcpt), "smtp_rcpt");
+			rcpt->destcount = pending->destcount;
+			rcpt->maddr = pending->maddr;
+			TAILQ_INSERT_TAIL(&s->rcpts, rcpt, entry);
+		}
+		smtp_send_reply(s, pending->cmd, pending->reply);
+
+		free(pending->cmd);
+		free(pending->reply);
+		free(pending);
+	}
+
+	if (TAILQ_EMPTY(&s->pending) &&
+	    tree_get(&wait_mfa_response, s->id) == NULL)
+		io_resume(&s->io, IO_PAUSE_OUT);
+}
+
+/*
+ * While recipient lookups are running, only the RCPT commands that the
+ * client has already sent are processed.  Anything else waits until
+ * all pending replies are out.
+ */
+static int
+smtp_pending_ready(struct smtp_session *s)
+{
+	const char	*data;
+	size_t		 len;
+
+	if (TAILQ_EMPTY(&s->pending) || s->state == STATE_QUIT)
+		return (0);
+	if (tree_get(&wait_mfa_response, s->id))
+		return (0);
+
+	data = iobuf_data(&s->iobuf);
+	len = iobuf_len(&s->iobuf);
+	if (len < 8 || strncasecmp(data, "RCPT TO:", 8) ||
+	    memchr(data, '\n', len) == NULL)
+		return (0);
+
+	return (1);
+}
+
+static int
+smtp_pending_next(struct smtp_session *s)
+{
+	if (!smtp_pending_ready(s))
+		return (0);
+
+	io_set_read(&s->io);
+	smtp_io(&s->io, IO_DATAIN);
+	return (1);
+}
+
 static void
 smtp_wait_mfa(struct smtp_session *s, int type)
 {
@@ -1474,6 +1946,7 @@ smtp_wait_mfa(struct smtp_session *s, int type)
 static void
 smtp_free(struct smtp_session *s, const char * reason)
 {
+	struct smtp_pending	*pending;
 	struct smtp_rcpt	*rcpt;
 
 	log_debug("debug: smtp: %p: deleting session: %s", s, reason);
@@ -1484,11 +1957,19 @@ smtp_free(struct smtp_session *s, const char * reason)
 	if (s->ofile)
 		fclose(s->ofile);
 
-	if (s->evp.id) {
+	if (s->evp && s->evp->id) {
 		m_create(p_queue, IMSG_QUEUE_REMOVE_MESSAGE, 0, 0, -1);
-		m_add_msgid(p_queue, evpid_to_msgid(s->evp.id));
+		m_add_msgid(p_queue, evpid_to_msgid(s->evp->id));
 		m_close(p_queue);
 	}
+	if (s->evp)
+		smtp_envelope_free(s->evp);
+
+	smtp_source_disconnect(s->source);
+	if (evtimer_pending(&s->pause, NULL))
+		evtimer_del(&s->pause);
+	if (evtimer_pending(&s->throttle, NULL))
+		evtimer_del(&s->throttle);
 
 	if (s->flags & SF_MFACONNSENT) {
 		m_create(p_mfa, IMSG_MFA_EVENT_DISCONNECT, 0, 0, -1);
@@ -1506,13 +1987,99 @@ smtp_free(struct smtp_session *s, const char * reason)
 		free(rcpt);
 	}
 
+	/* The replies to the lookups still running will be ignored */
+	while ((pending = TAILQ_FIRST(&s->pending))) {
+		TAILQ_REMOVE(&s->pending, pending, entry);
+		if (pending->reqid && pending->reply == NULL)
+			tree_xpop(&wait_lka_rcpt, pending->reqid);
+		free(pending->cmd);
+		free(pending->reply);
+		free(pending);
+	}
+
 	io_clear(&s->io);
 	iobuf_clear(&s->iobuf);
+	free(s->cmd);
+	smtp_nsessions--;
+	smtp_memory_update(s, 0);
 	free(s);
 
 	smtp_collect();
 }
 
+/*
+ * Envelopes are only needed during a transaction.  Idle sessions do
+ * not hold one, and a few free ones are kept for the next transactions.
+ */
+static struct envelope *
+smtp_envelope_alloc(void)
+{
+	struct envelope	*evp;
+
+	if ((evp = TAILQ_FIRST(&evp_pool))) {
+		TAILQ_REMOVE(&evp_pool, evp, entry);
+		evp_npool--;
+		bzero(evp, sizeof *evp);
+		return (evp);
+	}
+
+	return (xcalloc(1, sizeof *evp, "smtp_envelope_alloc"));
+}
+
+static void
+smtp_envelope_free(struct envelope *evp)
+{
+	if (evp_npool >= SMTP_EVP_POOL) {
+		free(evp);
+		return;
+	}
+
+	TAILQ_INSERT_HEAD(&evp_pool, evp, entry);
+	evp_npool++;
+}
+
+/*
+ * Memory held by a session, not counting the SSL state and the
+ * buffers of the message file.
+ */
+static size_t
+smtp_session_memory(struct smtp_session *s)
+{
+	size_t	memory;
+
+	memory = sizeof *s + s->iobuf.size + iobuf_queued(&s->iobuf);
+	if (s->evp)
+		memory += sizeof *s->evp;
+	if (s->cmd)
+		memory += strlen(s->cmd) + 1;
+
+	return (memory);
+}
+
+static void
+smtp_memory_update(struct smtp_session *s, size_t memory)
+{
+	struct timeval	tv;
+
+	smtp_memory = smtp_memory - s->memory + memory;
+	s->memory = memory;
+
+	/* Report at most once per second */
+	if (evtimer_pending(&smtp_memory_ev, NULL))
+		return;
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&smtp_memory_ev, &tv);
+}
+
+static void
+smtp_memory_stat(int fd, short event, void *p)
+{
+	stat_set("smtp.session.memory", stat_counter(smtp_memory));
+	stat_set("smtp.session.memory.average",
+	    stat_counter(smtp_nsessions ? smtp_memory / smtp_nsessions : 0));
+}
+
 static int
 smtp_mailaddr(struct mailaddr *maddr, char *line, int mailfrom, char **args)
 {
@@ -1618,6 +2185,39 @@ smtp_verify_certificate(struct smtp_session *s)
 	return 1;
 }
 
+/*
+ * The client sends commands faster than allowed.  Stop reading from it
+ * for a second, then process the commands already received.  No command
+ * is processed while the timer is pending.
+ */
+static void
+smtp_throttle(struct smtp_session *s)
+{
+	struct timeval	tv;
+
+	if (evtimer_pending(&s->throttle, NULL))
+		return;
+
+	log_debug("debug: smtp: %p: too many commands, pausing", s);
+	io_pause(&s->io, IO_PAUSE_IN);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_set(&s->throttle, smtp_throttle_resume, s);
+	evtimer_add(&s->throttle, &tv);
+}
+
+static void
+smtp_throttle_resume(int fd, short event, void *p)
+{
+	struct smtp_session *s = p;
+
+	io_resume(&s->io, IO_PAUSE_IN);
+
+	/* Otherwise, they are processed once the replies are sent */
+	if ((s->io.flags & IO_RW) == IO_READ && iobuf_len(&s->iobuf))
+		smtp_io(&s->io, IO_DATAIN);
+}
+
 static void
 smtp_auth_failure_resume(int fd, short event, void *p)
 {
@@ -1659,6 +2259,7 @@ smtp_strstate(int state)
 	CASE(STATE_AUTH_PASSWORD);
 	CASE(STATE_AUTH_FINALIZE);
 	CASE(STATE_BODY);
+	CASE(STATE_BDAT);
 	CASE(STATE_QUIT);
 	default:
 		snprintf(buf, sizeof(buf), "STATE_??? (%d)", state);
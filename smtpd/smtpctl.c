@@ -96,6 +96,15 @@ void stat_decrement(const char *k, size_t v)
 {
 }
 
+void stat_set(const char *k, const struct stat_value *v)
+{
+}
+
+struct stat_value *stat_counter(size_t v)
+{
+	return (NULL);
+}
+
 static int
 srv_connect(void)
 {
@@ -429,24 +438,22 @@ do_profile(int argc, struct parameter *argv)
 static int
 do_remove(int argc, struct parameter *argv)
 {
-	struct envelope	 evp;
+	uint64_t	 id;
 	uint32_t	 msgid;
 
+	/* message ids are handled by the scheduler as a whole */
 	if (argc == 0) {
 		while (srv_iter_messages(&msgid)) {
-			while (srv_iter_envelopes(msgid, &evp)) {
-				srv_send(IMSG_CTL_REMOVE, &evp.id,
-				    sizeof(evp.id));
-				srv_check_result();
-			}
-		}
-	} else if (argv[0].type == P_MSGID) {
-		while (srv_iter_envelopes(argv[0].u.u_msgid, &evp)) {
-			srv_send(IMSG_CTL_REMOVE, &evp.id, sizeof(evp.id));
+			id = msgid;
+			srv_send(IMSG_CTL_REMOVE, &id, sizeof(id));
 			srv_check_result();
 		}
+	} else if (argv[0].type == P_MSGID) {
+		id = argv[0].u.u_msgid;
+		srv_send(IMSG_CTL_REMOVE, &id, sizeof(id));
+		srv_check_result();
 	} else {
-		srv_send(IMSG_CTL_REMOVE, &argv[0].u.u_evpid, sizeof(evp.id));
+		srv_send(IMSG_CTL_REMOVE, &argv[0].u.u_evpid, sizeof(id));
 		srv_check_result();
 	}
 
@@ -578,6 +585,23 @@ do_show_hoststats(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_mxcache(int argc, struct parameter *argv)
+{
+	srv_send(IMSG_CTL_MTA_SHOW_MXCACHE, NULL, 0);
+
+	do {
+		srv_recv(IMSG_CTL_MTA_SHOW_MXCACHE);
+		if (rlen) {
+			printf("%s\n", rdata);
+			srv_read(NULL, rlen);
+		}
+		srv_end();
+	} while (rlen);
+
+	return (0);
+}
+
 static int
 do_show_message(int argc, struct parameter *argv)
 {
@@ -659,6 +683,23 @@ do_show_queue(int argc, struct parameter *argv)
 	return (0);
 }
 
+static int
+do_show_relays(int argc, struct parameter *argv)
+{
+	srv_send(IMSG_CTL_MTA_SHOW_RELAYS, NULL, 0);
+
+	do {
+		srv_recv(IMSG_CTL_MTA_SHOW_RELAYS);
+		if (rlen) {
+			printf("%s\n", rdata);
+			srv_read(NULL, rlen);
+		}
+		srv_end();
+	} while (rlen);
+
+	return (0);
+}
+
 static int
 do_show_routes(int argc, struct parameter *argv)
 {
@@ -815,10 +856,12 @@ main(int argc, char **argv)
 	cmd_install("schedule all",		do_schedule);
 	cmd_install("show envelope <evpid>",	do_show_envelope);
 	cmd_install("show hoststats",		do_show_hoststats);
+	cmd_install("show mxcache",		do_show_mxcache);
 	cmd_install("show message <msgid>",	do_show_message);
 	cmd_install("show message <evpid>",	do_show_message);
 	cmd_install("show queue",		do_show_queue);
 	cmd_install("show queue <msgid>",	do_show_queue);
+	cmd_install("show relays",		do_show_relays);
 	cmd_install("show routes",		do_show_routes);
 	cmd_install("show stats",		do_show_stats);
 	cmd_install("stop",			do_stop);
@@ -59,7 +59,10 @@ static void parent_send_config(int, short, void *);
 static void parent_send_config_lka(void);
 static void parent_send_config_mfa(void);
 static void parent_send_config_smtp(void);
+static void parent_send_config_smtp_worker(struct mproc *, int);
+static int parent_listener_socket(struct listener *);
 static void parent_sig_handler(int, short, void *);
+static void parent_send_ticket_key(int, short, void *);
 static void forkmda(struct mproc *, uint64_t, struct deliver *);
 static int parent_forward_open(char *, char *, uid_t, gid_t);
 static void parent_broadcast_verbose(uint32_t);
@@ -104,6 +107,7 @@ static size_t			offline_running = 0;
 TAILQ_HEAD(, offline)		offline_q;
 
 static struct event		config_ev;
+static struct event		ticket_ev;
 static struct event		offline_ev;
 static struct timeval		offline_timeout;
 
@@ -123,10 +127,14 @@ struct mproc	*p_lka = NULL;
 struct mproc	*p_mda = NULL;
 struct mproc	*p_mfa = NULL;
 struct mproc	*p_mta = NULL;
+struct mproc	*p_mta_worker[MTA_MAXWORKERS];
+int		 mta_worker = 0;
 struct mproc	*p_parent = NULL;
 struct mproc	*p_queue = NULL;
 struct mproc	*p_scheduler = NULL;
 struct mproc	*p_smtp = NULL;
+struct mproc	*p_smtp_worker[SMTP_MAXWORKERS];
+int		 smtp_worker = 0;
 
 const char	*backend_queue = "fs";
 const char	*backend_scheduler = "ramqueue";
@@ -151,7 +159,7 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 	uint64_t		 reqid;
 	size_t			 sz;
 	void			*i;
-	int			 fd, n, v, ret;
+	int			 fd, n, v, w, ret;
 
 	if (p->proc == PROC_LKA) {
 		switch (imsg->hdr.type) {
@@ -240,9 +248,11 @@ parent_imsg(struct mproc *p, struct imsg *imsg)
 			m_forward(p_lka, imsg);
 			m_forward(p_mda, imsg);
 			m_forward(p_mfa, imsg);
-			m_forward(p_mta, imsg);
+			for (w = 0; w < env->sc_mta_workers; w++)
+				m_forward(p_mta_worker[w], imsg);
 			m_forward(p_queue, imsg);
-			m_forward(p_smtp, imsg);
+			for (w = 0; w < env->sc_smtp_workers; w++)
+				m_forward(p_smtp_worker[w], imsg);
 			return;
 
 		case IMSG_CTL_TRACE:
@@ -329,17 +339,71 @@ parent_send_config(int fd, short event, void *p)
 	purge_config(PURGE_SSL);
 }
 
+static void
+parent_send_ticket_key(int fd, short event, void *p)
+{
+	struct ssl_ticket_key	key;
+	struct timeval		tv;
+	int			i;
+
+	log_debug("debug: parent: sending new session ticket key");
+	arc4random_buf(&key, sizeof key);
+	/* all workers share the key, so tickets are valid on any of them */
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		m_compose(p_smtp_worker[i], IMSG_SMTP_TICKET_KEY, 0, 0, -1,
+		    &key, sizeof key);
+	bzero(&key, sizeof key);
+
+	tv.tv_sec = SSL_TICKET_KEY_LIFETIME;
+	tv.tv_usec = 0;
+	evtimer_add(&ticket_ev, &tv);
+}
+
 static void
 parent_send_config_smtp(void)
+{
+	struct listener	*l;
+	int		 i;
+
+	log_debug("debug: parent_send_config: configuring smtp");
+	TAILQ_FOREACH(l, env->sc_listeners, entry)
+		l->fd = parent_listener_socket(l);
+	for (i = 0; i < env->sc_smtp_workers; i++)
+		parent_send_config_smtp_worker(p_smtp_worker[i],
+		    i == env->sc_smtp_workers - 1);
+}
+
+static int
+parent_listener_socket(struct listener *l)
+{
+	int	fd, opt;
+
+	if ((fd = socket(l->ss.ss_family, SOCK_STREAM, 0)) == -1)
+		fatal("smtpd: socket");
+	opt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt,
+		sizeof(opt)) < 0)
+		fatal("smtpd: setsockopt");
+	if (bind(fd, (struct sockaddr *)&l->ss, l->ss.ss_len) == -1)
+		fatal("smtpd: bind");
+
+	return (fd);
+}
+
+/*
+ * All smtp workers accept on the same listening sockets: each one
+ * gets a copy of the descriptors, and the last one gets the originals.
+ */
+static void
+parent_send_config_smtp_worker(struct mproc *p, int last)
 {
 	struct listener		*l;
 	struct ssl		*s;
 	void			*iter = NULL;
 	struct iovec		 iov[5];
-	int			 opt;
+	int			 fd;
 
-	log_debug("debug: parent_send_config: configuring smtp");
-	m_compose(p_smtp, IMSG_CONF_START, 0, 0, -1, NULL, 0);
+	m_compose(p, IMSG_CONF_START, 0, 0, -1, NULL, 0);
 
 	while (dict_iter(env->sc_ssl_dict, &iter, NULL, (void **)&s)) {
 		if (!(s->flags & F_SCERT))
@@ -354,23 +418,18 @@ parent_send_config_smtp(void)
 		iov[3].iov_len = s->ssl_dhparams_len;
 		iov[4].iov_base = s->ssl_ca;
 		iov[4].iov_len = s->ssl_ca_len;
-		m_composev(p_smtp, IMSG_CONF_SSL, 0, 0, -1, iov, nitems(iov));
+		m_composev(p, IMSG_CONF_SSL, 0, 0, -1, iov, nitems(iov));
 	}
 
 	TAILQ_FOREACH(l, env->sc_listeners, entry) {
-		if ((l->fd = socket(l->ss.ss_family, SOCK_STREAM, 0)) == -1)
-			fatal("smtpd: socket");
-		opt = 1;
-		if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &opt,
-			sizeof(opt)) < 0)
-			fatal("smtpd: setsockopt");
-		if (bind(l->fd, (struct sockaddr *)&l->ss, l->ss.ss_len) == -1)
-			fatal("smtpd: bind");
-		m_compose(p_smtp, IMSG_CONF_LISTENER, 0, 0, l->fd,
-		    l, sizeof(*l));
+		if (last)
+			fd = l->fd;
+		else if ((fd = dup(l->fd)) == -1)
+			fatal("smtpd: dup");
+		m_compose(p, IMSG_CONF_LISTENER, 0, 0, fd, l, sizeof(*l));
 	}
 
-	m_compose(p_smtp, IMSG_CONF_END, 0, 0, -1, NULL, 0);
+	m_compose(p, IMSG_CONF_END, 0, 0, -1, NULL, 0);
 }
 
 void
@@ -784,6 +843,10 @@ main(int argc, char *argv[])
 	config_peer(PROC_QUEUE);
 	config_done();
 
+	/* the smtp process needs a ticket key before it sets up listeners */
+	evtimer_set(&ticket_ev, parent_send_ticket_key, NULL);
+	parent_send_ticket_key(-1, 0, NULL);
+
 	evtimer_set(&config_ev, parent_send_config, NULL);
 	bzero(&tv, sizeof(tv));
 	evtimer_add(&config_ev, &tv);
@@ -854,6 +917,9 @@ load_ssl_trees(void)
 static void
 fork_peers(void)
 {
+	const char	*title;
+	char		 buf[64];
+
 	tree_init(&children);
 
 	/*
@@ -881,9 +947,30 @@ fork_peers(void)
 	child_add(lka(), CHILD_DAEMON, proc_title(PROC_LKA));
 	child_add(mda(), CHILD_DAEMON, proc_title(PROC_MDA));
 	child_add(mfa(), CHILD_DAEMON, proc_title(PROC_MFA));
-	child_add(mta(), CHILD_DAEMON, proc_title(PROC_MTA));
+	mta_counters_init();
+	for (mta_worker = 0; mta_worker < env->sc_mta_workers; mta_worker++) {
+		title = proc_title(PROC_MTA);
+		if (env->sc_mta_workers > 1) {
+			snprintf(buf, sizeof buf, "%s %d", title, mta_worker);
+			title = xstrdup(buf, "fork_peers");
+		}
+		child_add(mta(), CHILD_DAEMON, title);
+	}
+	mta_worker = 0;
+	mta_counters_free();
 	child_add(scheduler(), CHILD_DAEMON, proc_title(PROC_SCHEDULER));
-	child_add(smtp(), CHILD_DAEMON, proc_title(PROC_SMTP));
+	smtp_counters_init();
+	for (smtp_worker = 0; smtp_worker < env->sc_smtp_workers;
+	    smtp_worker++) {
+		title = proc_title(PROC_SMTP);
+		if (env->sc_smtp_workers > 1) {
+			snprintf(buf, sizeof buf, "%s %d", title, smtp_worker);
+			title = xstrdup(buf, "fork_peers");
+		}
+		child_add(smtp(), CHILD_DAEMON, title);
+	}
+	smtp_worker = 0;
+	smtp_counters_free();
 }
 
 struct child *
@@ -1457,6 +1544,8 @@ imsg_to_str(int type)
 
 	CASE(IMSG_CTL_MTA_SHOW_ROUTES);
 	CASE(IMSG_CTL_MTA_SHOW_HOSTSTATS);
+	CASE(IMSG_CTL_MTA_SHOW_MXCACHE);
+	CASE(IMSG_CTL_MTA_SHOW_RELAYS);
 
 	CASE(IMSG_CONF_START);
 	CASE(IMSG_CONF_SSL);
@@ -1508,7 +1597,10 @@ imsg_to_str(int type)
 	CASE(IMSG_MFA_SMTP_RESPONSE);
 
 	CASE(IMSG_MTA_TRANSFER);
+	CASE(IMSG_MTA_PREFETCH);
 	CASE(IMSG_MTA_SCHEDULE);
+	CASE(IMSG_MTA_HOLD);
+	CASE(IMSG_MTA_SHARD);
 
 	CASE(IMSG_QUEUE_CREATE_MESSAGE);
 	CASE(IMSG_QUEUE_SUBMIT_ENVELOPE);
@@ -1526,6 +1618,7 @@ imsg_to_str(int type)
 	CASE(IMSG_PARENT_KILL_MDA);
 
 	CASE(IMSG_SMTP_ENQUEUE_FD);
+	CASE(IMSG_SMTP_TICKET_KEY);
 
 	CASE(IMSG_DNS_HOST);
 	CASE(IMSG_DNS_HOST_END);
@@ -1567,6 +1660,8 @@ parent_auth_user(const char *username, const char *password)
 static void
 parent_broadcast_verbose(uint32_t v)
 {
+	int	i;
+
 	m_create(p_lka, IMSG_CTL_VERBOSE, 0, 0, -1);
 	m_add_int(p_lka, v);
 	m_close(p_lka);
@@ -1579,22 +1674,28 @@ parent_broadcast_verbose(uint32_t v)
 	m_add_int(p_mfa, v);
 	m_close(p_mfa);
 	
-	m_create(p_mta, IMSG_CTL_VERBOSE, 0, 0, -1);
-	m_add_int(p_mta, v);
-	m_close(p_mta);
+	for (i = 0; i < env->sc_mta_workers; i++) {
+		m_create(p_mta_worker[i], IMSG_CTL_VERBOSE, 0, 0, -1);
+		m_add_int(p_mta_worker[i], v);
+		m_close(p_mta_worker[i]);
+	}
 	
 	m_create(p_queue, IMSG_CTL_VERBOSE, 0, 0, -1);
 	m_add_int(p_queue, v);
 	m_close(p_queue);
 	
-	m_create(p_smtp, IMSG_CTL_VERBOSE, 0, 0, -1);
-	m_add_int(p_smtp, v);
-	m_close(p_smtp);
+	for (i = 0; i < env->sc_smtp_workers; i++) {
+		m_create(p_smtp_worker[i], IMSG_CTL_VERBOSE, 0, 0, -1);
+		m_add_int(p_smtp_worker[i], v);
+		m_close(p_smtp_worker[i]);
+	}
 }
 
 static void
 parent_broadcast_profile(uint32_t v)
 {
+	int	i;
+
 	m_create(p_lka, IMSG_CTL_PROFILE, 0, 0, -1);
 	m_add_int(p_lka, v);
 	m_close(p_lka);
@@ -1607,15 +1708,19 @@ parent_broadcast_profile(uint32_t v)
 	m_add_int(p_mfa, v);
 	m_close(p_mfa);
 	
-	m_create(p_mta, IMSG_CTL_PROFILE, 0, 0, -1);
-	m_add_int(p_mta, v);
-	m_close(p_mta);
+	for (i = 0; i < env->sc_mta_workers; i++) {
+		m_create(p_mta_worker[i], IMSG_CTL_PROFILE, 0, 0, -1);
+		m_add_int(p_mta_worker[i], v);
+		m_close(p_mta_worker[i]);
+	}
 	
 	m_create(p_queue, IMSG_CTL_PROFILE, 0, 0, -1);
 	m_add_int(p_queue, v);
 	m_close(p_queue);
 	
-	m_create(p_smtp, IMSG_CTL_PROFILE, 0, 0, -1);
-	m_add_int(p_smtp, v);
-	m_close(p_smtp);
+	for (i = 0; i < env->sc_smtp_workers; i++) {
+		m_create(p_smtp_worker[i], IMSG_CTL_PROFILE, 0, 0, -1);
+		m_add_int(p_smtp_worker[i], v);
+		m_close(p_smtp_worker[i]);
+	}
 }
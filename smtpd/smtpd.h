@@ -48,6 +48,9 @@
 #define SMTPD_QUEUE_INTERVAL	 (15 * 60)
 #define SMTPD_QUEUE_MAXINTERVAL	 (4 * 60 * 60)
 #define SMTPD_QUEUE_EXPIRY	 (4 * 24 * 60 * 60)
+#define SMTPD_QUEUE_TIER_DELAY	 30
+#define SMTPD_MTA_PREFETCH	 60
+#define SMTPD_QUEUE_TIER_MAXMEM	 (64 * 1024 * 1024)
 #define SMTPD_SOCKET		 "/var/run/smtpd.sock"
 #ifndef SMTPD_NAME
 #define	SMTPD_NAME		 "OpenSMTPD"
@@ -62,6 +65,7 @@
 #define PATH_OFFLINE		"/offline"
 #define PATH_PURGE		"/purge"
 #define PATH_TEMPORARY		"/temporary"
+#define PATH_DEDUP		"/dedup"
 
 #define	PATH_FILTERS		"/usr/libexec/smtpd"
 #define	PATH_TABLES		"/usr/libexec/smtpd"
@@ -146,7 +150,7 @@ union lookup {
  * Bump IMSG_VERSION whenever a change is made to enum imsg_type.
  * This will ensure that we can never use a wrong version of smtpctl with smtpd.
  */
-#define	IMSG_VERSION		5
+#define	IMSG_VERSION		11
 
 enum imsg_type {
 	IMSG_NONE,
@@ -175,6 +179,8 @@ enum imsg_type {
 
 	IMSG_CTL_MTA_SHOW_ROUTES,
 	IMSG_CTL_MTA_SHOW_HOSTSTATS,
+	IMSG_CTL_MTA_SHOW_MXCACHE,
+	IMSG_CTL_MTA_SHOW_RELAYS,
 
 	IMSG_CONF_START,
 	IMSG_CONF_SSL,
@@ -226,7 +232,10 @@ enum imsg_type {
 	IMSG_MFA_SMTP_RESPONSE,
 
 	IMSG_MTA_TRANSFER,
+	IMSG_MTA_PREFETCH,
 	IMSG_MTA_SCHEDULE,
+	IMSG_MTA_HOLD,
+	IMSG_MTA_SHARD,
 
 	IMSG_QUEUE_CREATE_MESSAGE,
 	IMSG_QUEUE_SUBMIT_ENVELOPE,
@@ -244,6 +253,7 @@ enum imsg_type {
 	IMSG_PARENT_KILL_MDA,
 
 	IMSG_SMTP_ENQUEUE_FD,
+	IMSG_SMTP_TICKET_KEY,
 
 	IMSG_DNS_HOST,
 	IMSG_DNS_HOST_END,
@@ -497,6 +507,21 @@ struct listener {
 	TAILQ_ENTRY(listener)	 entry;
 };
 
+/* 0 means unlimited */
+struct smtp_limit {
+	size_t	conn_per_second;
+	size_t	sessions;
+	size_t	cmd_per_second;
+	size_t	rcpt_per_second;
+};
+
+struct smtp_limits {
+	struct smtp_limit	source;		/* per address */
+	struct smtp_limit	network;	/* per network prefix */
+	int			prefix4;
+	int			prefix6;
+};
+
 struct smtpd {
 	char				sc_conffile[SMTPD_MAXPATHLEN];
 	size_t				sc_maxsize;
@@ -519,11 +544,22 @@ struct smtpd {
 #define QUEUE_COMPRESSION      		0x00000001
 #define QUEUE_ENCRYPTION      		0x00000002
 #define QUEUE_EVPCACHE			0x00000004
+#define QUEUE_DEDUP			0x00000008
+#define QUEUE_TIERED			0x00000010
+#define QUEUE_JOURNAL			0x00000020
 	uint32_t			sc_queue_flags;
 	char			       *sc_queue_key;
 	size_t				sc_queue_evpcache_size;
+	time_t				sc_queue_tier_delay;
+	size_t				sc_queue_tier_maxmem;
 
 	int				sc_qexpire;
+#define	MTA_MAXWORKERS			16
+	int				sc_mta_workers;
+#define	SMTP_MAXWORKERS			16
+	int				sc_smtp_workers;
+	struct smtp_limits		sc_smtp_limits;
+	time_t				sc_mta_prefetch;
 #define MAX_BOUNCE_WARN			4
 	time_t				sc_bounce_warn[MAX_BOUNCE_WARN];
 	char				sc_hostname[SMTPD_MAXHOSTNAMELEN];
@@ -603,24 +639,52 @@ struct mta_host {
 #define HOST_IGNORE	0x01
 	int			 flags;
 	int			 nerror;
+
+	TAILQ_HEAD(, mta_candidate)	 candidates;
+	TAILQ_HEAD(, mta_mx)	 mxs;		/* of all domains */
 };
 
 struct mta_mx {
 	TAILQ_ENTRY(mta_mx)	 entry;
+	TAILQ_ENTRY(mta_mx)	 host_entry;
+	struct mta_domain	*domain;
 	struct mta_host		*host;
 	int			 preference;
 };
 
+struct mta_bucket {
+	int64_t			 level;
+	time_t			 last;
+};
+
 struct mta_domain {
 	SPLAY_ENTRY(mta_domain)	 entry;
 	char			*name;
 	int			 flags;
 	TAILQ_HEAD(, mta_mx)	 mxs;
+	TAILQ_HEAD(, mta_relay)	 relays;
 	int			 mxstatus;
 	int			 refcount;
 	size_t			 nconn;
 	time_t			 lastconn;
 	time_t			 lastmxquery;
+	size_t			 mxgen;		/* bumped when MXs are known */
+
+	/* adaptive connection window */
+	size_t			 window;
+	size_t			 winsuccess;
+	time_t			 lastbackoff;
+	uint32_t		 latency;	/* msec, smoothed */
+	size_t			 ndelivered;
+	size_t			 nthrottled;
+	size_t			 rate;		/* messages per minute */
+	size_t			 ratecount;
+	time_t			 ratestart;
+
+	/* rate shaping */
+	struct mta_bucket	 bucket_mail;
+	struct mta_bucket	 bucket_rcpt;
+	struct mta_bucket	 bucket_bytes;
 };
 
 struct mta_source {
@@ -631,10 +695,61 @@ struct mta_source {
 	time_t			 lastconn;
 };
 
+struct mta_candidate {
+	SPLAY_ENTRY(mta_candidate)	 entry;		/* ready or waiting */
+	TAILQ_ENTRY(mta_candidate)	 route_entry;
+	TAILQ_ENTRY(mta_candidate)	 host_entry;
+	TAILQ_ENTRY(mta_candidate)	 limit_entry;
+	struct mta_connector		*connector;
+	struct mta_level		*level;
+	struct mta_route		*route;
+	int				 preference;
+	size_t				 rank;		/* in the MX list */
+	size_t				 nconn;		/* of the route */
+	time_t				 readyat;	/* end of the delays */
+#define CANDIDATE_READY		0
+#define CANDIDATE_IGNORED	1
+#define CANDIDATE_HOSTLIMIT	2
+#define CANDIDATE_DISABLED	3
+#define CANDIDATE_NEW		4
+#define CANDIDATE_WAITING	5
+	int				 state;
+};
+
+/*
+ * Candidates of an MX preference level: the ready ones, fewest connections
+ * first, and the ones waiting for a delay to expire, first usable first.
+ */
+struct mta_level {
+	int						 preference;
+	SPLAY_HEAD(mta_candidate_tree, mta_candidate)	 candidates;
+	SPLAY_HEAD(mta_waiting_tree, mta_candidate)	 waiting;
+	TAILQ_HEAD(, mta_candidate)			 hostlimit;
+	size_t						 nwaiting;
+	size_t						 nhostlimit;
+	size_t						 nnew;
+};
+
+struct mta_search {
+	int				 seen;
+	int				 limit_host;
+	int				 limit_route;
+	int				 suspended;
+	time_t				 tm;
+};
+
 struct mta_connector {
 	struct mta_source		*source;
 	struct mta_relay		*relay;
 
+	/* usable routes for this source, ordered by MX preference */
+	struct mta_candidate		*candidates;
+	size_t				 ncandidates;
+	struct mta_level		*levels;
+	size_t				 nlevels;
+	int				 family_mismatch;
+	size_t				 indexed;
+
 #define CONNECTOR_ERROR_FAMILY		0x0001
 #define CONNECTOR_ERROR_SOURCE		0x0002
 #define CONNECTOR_ERROR_MX		0x0004
@@ -678,6 +793,11 @@ struct mta_route {
 	time_t			 lastconn;
 	time_t			 lastdisc;
 	time_t			 lastpenalty;
+	size_t			 ntls;
+	size_t			 ntlsresumed;
+	size_t			 maxsize;
+
+	TAILQ_HEAD(, mta_candidate)	 candidates;
 };
 
 struct mta_limits {
@@ -702,10 +822,17 @@ struct mta_limits {
 	time_t	sessdelay_keepalive;
 
 	int	family;
+	int	adaptive;
+
+	/* per second, 0 means unlimited */
+	size_t	maxmail_per_second;
+	size_t	maxrcpt_per_second;
+	size_t	maxbytes_per_second;
 };
 
 struct mta_relay {
 	SPLAY_ENTRY(mta_relay)	 entry;
+	TAILQ_ENTRY(mta_relay)	 domain_entry;
 	uint64_t		 id;
 
 	struct mta_domain	*domain;
@@ -875,6 +1002,7 @@ struct mproc {
 	pid_t		 pid;
 	char		*name;
 	int		 proc;
+	int		 instance;
 	void		(*handler)(struct mproc *, struct imsg *);
 	struct imsgbuf	 imsgbuf;
 
@@ -915,9 +1043,13 @@ extern struct mproc *p_lka;
 extern struct mproc *p_mda;
 extern struct mproc *p_mfa;
 extern struct mproc *p_mta;
+extern struct mproc *p_mta_worker[MTA_MAXWORKERS];
+extern int mta_worker;
 extern struct mproc *p_queue;
 extern struct mproc *p_scheduler;
 extern struct mproc *p_smtp;
+extern struct mproc *p_smtp_worker[SMTP_MAXWORKERS];
+extern int smtp_worker;
 
 extern struct smtpd	*env;
 extern void (*imsg_callback)(struct mproc *, struct imsg *);
@@ -1101,6 +1233,8 @@ void imsgproc_reset_callback(struct imsgproc *, void (*)(struct imsg *, void *),
 /* limit.c */
 void limit_mta_set_defaults(struct mta_limits *);
 int limit_mta_set(struct mta_limits *, const char*, int64_t);
+void limit_smtp_set_defaults(struct smtp_limits *);
+int limit_smtp_set(struct smtp_limits *, const char*, int64_t);
 
 /* lka.c */
 pid_t lka(void);
@@ -1177,10 +1311,28 @@ void m_get_envelope(struct msg *, struct envelope *);
 
 /* mta.c */
 pid_t mta(void);
+int mta_worker_for(const struct envelope *);
+void mta_worker_assign(const char *, int);
+void mta_counters_init(void);
+void mta_counters_free(void);
+size_t mta_host_nconn(struct mta_host *);
 void mta_route_ok(struct mta_relay *, struct mta_route *);
 void mta_route_error(struct mta_relay *, struct mta_route *);
 void mta_route_down(struct mta_relay *, struct mta_route *);
+void mta_route_unreachable(struct mta_relay *, struct mta_route *);
 void mta_route_collect(struct mta_relay *, struct mta_route *);
+void mta_route_cancel(struct mta_relay *, struct mta_route *, int);
+struct mta_route *mta_route_race(struct mta_relay *, struct mta_route *);
+int mta_route_shareable(struct mta_relay *, struct mta_relay *,
+    struct mta_route *, size_t);
+struct mta_relay *mta_route_share(struct mta_relay *, struct mta_route *,
+    size_t);
+void mta_route_transfer(struct mta_relay *, struct mta_relay *,
+    struct mta_route *);
+void mta_relay_delivered(struct mta_relay *, uint32_t);
+void mta_relay_throttled(struct mta_relay *);
+time_t mta_relay_shaped(struct mta_relay *);
+void mta_relay_charge(struct mta_relay *, size_t, size_t, size_t);
 void mta_source_error(struct mta_relay *, struct mta_route *, const char *);
 void mta_delivery_log(struct mta_envelope *, const char *, const char *, int, const char *);
 void mta_delivery_notify(struct mta_envelope *, int, const char *, uint32_t);
@@ -1188,10 +1340,19 @@ void mta_delivery(struct mta_envelope *, const char *, const char *, int, const
 struct mta_task *mta_route_next_task(struct mta_relay *, struct mta_route *);
 const char *mta_host_to_text(struct mta_host *);
 const char *mta_relay_to_text(struct mta_relay *);
+const char *mta_route_to_text(struct mta_route *);
+
+/* mta_index.c */
+void mta_index_build(struct mta_connector *);
+void mta_index_clear(struct mta_connector *);
+void mta_index_update(struct mta_route *);
+struct mta_route *mta_index_find(struct mta_connector *, time_t,
+    struct mta_search *);
 
 /* mta_session.c */
 void mta_session(struct mta_relay *, struct mta_route *);
 void mta_session_imsg(struct mproc *, struct imsg *);
+int mta_session_share(struct mta_relay *);
 
 
 /* parse.y */
@@ -1240,13 +1401,21 @@ time_t scheduler_compute_schedule(struct scheduler_info *);
 
 
 /* smtp.c */
+struct smtp_source;
 pid_t smtp(void);
 void smtp_collect(void);
+uint64_t smtp_generate_id(void);
+struct mproc *smtp_worker_for(uint64_t);
+void smtp_counters_init(void);
+void smtp_counters_free(void);
+int smtp_source_command(struct smtp_source *);
+int smtp_source_rcpt(struct smtp_source *);
+void smtp_source_disconnect(struct smtp_source *);
 
 
 /* smtp_session.c */
 int smtp_session(struct listener *, int, const struct sockaddr_storage *,
-    const char *);
+    const char *, struct smtp_source *);
 void smtp_session_imsg(struct mproc *, struct imsg *);
 
 
@@ -225,6 +225,10 @@ ssl_ctx_create(void)
 	    SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_TICKET);
 	SSL_CTX_set_options(ctx,
 	    SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	/* Do not keep the record buffers of idle connections */
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif
 
 	if (!SSL_CTX_set_cipher_list(ctx, SSL_CIPHERS)) {
 		ssl_error("ssl_ctx_create");
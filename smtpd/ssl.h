@@ -18,6 +18,19 @@
 #define SSL_CIPHERS		"HIGH:!aNULL:!MD5"
 #define	SSL_ECDH_CURVE		"prime256v1"
 #define	SSL_SESSION_TIMEOUT	300
+#define	SSL_SESSION_CACHE_SIZE	4096
+#define	SSL_TICKET_KEY_LIFETIME	3600
+
+/*
+ * Session ticket keys are generated by the parent process and handed to
+ * the smtp process, which keeps the previous key around so that tickets
+ * issued before a rotation can still be used.
+ */
+struct ssl_ticket_key {
+	unsigned char		 name[16];
+	unsigned char		 aes_key[32];
+	unsigned char		 hmac_key[32];
+};
 
 struct ssl {
 	char			 ssl_name[PATH_MAX];
@@ -39,6 +52,8 @@ SSL_CTX	       *ssl_ctx_create(void);
 int		ssl_load_certfile(struct ssl **, const char *, const char *, uint8_t);
 void	       *ssl_mta_init(char *, off_t, char *, off_t);
 void	       *ssl_smtp_init(void *, char *, off_t, char *, off_t);
+void		ssl_smtp_session_cache(void *);
+void		ssl_smtp_ticket_key(const struct ssl_ticket_key *);
 int	        ssl_cmp(struct ssl *, struct ssl *);
 DH	       *get_dh1024(void);
 DH	       *get_dh_from_memory(char *, size_t);
@@ -34,6 +34,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/ssl.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
@@ -115,3 +117,72 @@ err:
 	ssl_error("ssl_smtp_init");
 	return (NULL);
 }
+
+/* current and previous ticket keys */
+static struct ssl_ticket_key	ticket_keys[2];
+static int			ticket_nkeys;
+
+static int
+ssl_smtp_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+	struct ssl_ticket_key	*key;
+	int			 i;
+
+	if (enc) {
+		if (ticket_nkeys == 0)
+			return (0);
+		key = &ticket_keys[0];
+		arc4random_buf(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc()));
+		memcpy(name, key->name, sizeof key->name);
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+			key->aes_key, iv))
+			return (-1);
+		if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof key->hmac_key,
+			EVP_sha256(), NULL))
+			return (-1);
+		return (1);
+	}
+
+	for (i = 0; i < ticket_nkeys; i++)
+		if (memcmp(name, ticket_keys[i].name,
+			sizeof ticket_keys[i].name) == 0)
+			break;
+	if (i == ticket_nkeys) {
+		stat_increment("smtp.ssl.ticket.unknown", 1);
+		return (0);
+	}
+
+	key = &ticket_keys[i];
+	if (!HMAC_Init_ex(hctx, key->hmac_key, sizeof key->hmac_key,
+		EVP_sha256(), NULL))
+		return (-1);
+	if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+		key->aes_key, iv))
+		return (-1);
+
+	/* issued with the previous key, ask for a new ticket */
+	return (i == 0 ? 1 : 2);
+}
+
+void
+ssl_smtp_session_cache(void *ssl_ctx)
+{
+	SSL_CTX	*ctx = ssl_ctx;
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, SSL_SESSION_CACHE_SIZE);
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, ssl_smtp_ticket_cb);
+}
+
+void
+ssl_smtp_ticket_key(const struct ssl_ticket_key *key)
+{
+	log_debug("debug: ssl: rotating session ticket key");
+
+	ticket_keys[1] = ticket_keys[0];
+	ticket_keys[0] = *key;
+	if (ticket_nkeys < 2)
+		ticket_nkeys += 1;
+}